@@ -0,0 +1,335 @@
+/**
+ * @File math_benchmark.cpp
+ * @Brief Times the Vector, Color and Matrix math against SIMD-backed versions of the same types.
+ *
+ * Runs the shading-like inner loop of a light sample (normalize the normal and the direction to the light,
+ * the Lambert and the Phong terms, a matrix transform, color multiply-adds) over arrays of hits, written
+ * once with the scalar Vector, Color and Matrix the renderer uses, and once with each SIMD prototype the
+ * compiler can target: SSE2 (x, y packed, z in a lane of its own) and AVX2 (x, y, z in one register), both
+ * with an rsqrt estimate refined by Newton-Raphson for the normalization, and SSE colors. Also times the
+ * Color division by a float, as three divisions and as a multiplication by the reciprocal.
+ * Prints the nanoseconds per hit of each, and how far the SIMD results are from the scalar ones.
+ *
+ * Not a part of the renderer: the prototypes were slower than the scalar types, which is why the renderer
+ * keeps those. Usage: math_benchmark [repeats]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "maths/vector.h"
+#include "maths/matrix.h"
+#include "color/color.h"
+#include "utils/random.h"
+
+namespace {
+
+constexpr int NUM_HITS = 4096; // small enough to stay in the cache, so it's the math that gets timed
+
+/// the inputs, generated once and converted to each version's types
+struct Hits
+{
+    std::vector<Vector> points, normals;
+    std::vector<Color> colors;
+    std::vector<float> weights; // for the Color division
+    Vector light;
+    Matrix transform;
+    Color specular;
+};
+
+Hits makeHits()
+{
+    Random rng(12345);
+    Hits hits;
+    for (int i = 0; i < NUM_HITS; i++) {
+        hits.points.push_back(Vector(rng.randomDouble(), rng.randomDouble(), rng.randomDouble()) * 100);
+        hits.normals.push_back(Vector(rng.randomDouble() - 0.5, rng.randomDouble() - 0.5, rng.randomDouble() - 0.5));
+        hits.colors.push_back(Color(rng.randomFloat(), rng.randomFloat(), rng.randomFloat()));
+        hits.weights.push_back(1 + rng.randomFloat() * 16);
+    }
+    hits.light = Vector(40, 150, -130);
+    hits.transform = rotationAroundX(0.3) * rotationAroundY(0.7);
+    hits.specular = Color(0.9f, 0.8f, 0.7f);
+    return hits;
+}
+
+/// times fn(), repeated, in nanoseconds per hit
+template <typename Fn>
+double timePerHit(int repeats, Fn&& fn)
+{
+    fn(); // warm up the cache
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < repeats; r++) fn();
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / (double(repeats) * NUM_HITS);
+}
+
+float relativeError(const Color& result, const Color& reference)
+{
+    float error = 0;
+    for (int i = 0; i < 3; i++)
+        error = std::max(error, fabsf(result[i] - reference[i]) / std::max(fabsf(reference[i]), 1e-30f));
+    return error;
+}
+
+/// the loop, with the renderer's types
+Color shadeScalar(const Hits& hits)
+{
+    Color sum(0, 0, 0);
+    for (int i = 0; i < NUM_HITS; i++) {
+        Vector normal = hits.normals[i];
+        normal.normalize();
+        Vector toLight = hits.light - hits.points[i];
+        toLight.normalize();
+        double lambert = std::max(0.0, dot(normal, toLight));
+        Vector reflected = normal * (2 * dot(normal, toLight)) - toLight;
+        Vector transformed = reflected * hits.transform;
+        double phong = std::max(0.0, transformed.z_);
+        sum += hits.colors[i] * float(lambert) + hits.specular * float(phong * phong);
+    }
+    return sum;
+}
+
+#if defined(__SSE2__)
+
+/// the SSE2 prototype: (x, y) in one register, z in the low lane of another
+struct SseVector
+{
+    __m128d xy_, z_;
+};
+
+inline SseVector toSse(const Vector& v) { return {_mm_set_pd(v.y_, v.x_), _mm_set_sd(v.z_)}; }
+inline SseVector operator- (const SseVector& a, const SseVector& b) { return {_mm_sub_pd(a.xy_, b.xy_), _mm_sub_sd(a.z_, b.z_)}; }
+inline SseVector operator* (const SseVector& a, __m128d s) { return {_mm_mul_pd(a.xy_, s), _mm_mul_sd(a.z_, s)}; }
+inline SseVector operator+ (const SseVector& a, const SseVector& b) { return {_mm_add_pd(a.xy_, b.xy_), _mm_add_sd(a.z_, b.z_)}; }
+
+/// the dot product, broadcast to both lanes
+inline __m128d dot(const SseVector& a, const SseVector& b)
+{
+    __m128d products = _mm_mul_pd(a.xy_, b.xy_);
+    __m128d sum = _mm_add_sd(_mm_add_sd(products, _mm_unpackhi_pd(products, products)), _mm_mul_sd(a.z_, b.z_));
+    return _mm_unpacklo_pd(sum, sum);
+}
+
+/// 1 / sqrt(x), from the 12-bit float estimate, refined by two Newton-Raphson steps
+inline __m128d rsqrt(__m128d x)
+{
+    __m128d y = _mm_cvtps_pd(_mm_rsqrt_ps(_mm_cvtpd_ps(x)));
+    const __m128d half = _mm_set1_pd(0.5), threeHalves = _mm_set1_pd(1.5);
+    for (int step = 0; step < 2; step++)
+        y = _mm_mul_pd(y, _mm_sub_pd(threeHalves, _mm_mul_pd(_mm_mul_pd(half, x), _mm_mul_pd(y, y))));
+    return y;
+}
+
+inline SseVector normalized(const SseVector& v) { return v * rsqrt(dot(v, v)); }
+
+/// the rows of the matrix; v * m is the sum of the rows, multiplied by v's coordinates
+struct SseMatrix
+{
+    SseVector rows_[3];
+};
+
+inline SseVector operator* (const SseVector& v, const SseMatrix& m)
+{
+    return m.rows_[0] * _mm_unpacklo_pd(v.xy_, v.xy_) + m.rows_[1] * _mm_unpackhi_pd(v.xy_, v.xy_) +
+           m.rows_[2] * _mm_unpacklo_pd(v.z_, v.z_);
+}
+
+/// a color in the first three lanes. Wrapped, so that it can go in a vector
+struct SseColor
+{
+    __m128 rgb_;
+};
+
+inline SseColor toSse(const Color& c) { return {_mm_set_ps(0, c.b_, c.g_, c.r_)}; }
+inline Color fromSse(__m128 c)
+{
+    alignas(16) float values[4];
+    _mm_store_ps(values, c);
+    return Color(values[0], values[1], values[2]);
+}
+
+struct SseHits
+{
+    std::vector<SseVector> points, normals;
+    std::vector<SseColor> colors;
+    SseVector light;
+    SseMatrix transform;
+    SseColor specular;
+};
+
+SseHits toSse(const Hits& hits)
+{
+    SseHits result;
+    for (int i = 0; i < NUM_HITS; i++) {
+        result.points.push_back(toSse(hits.points[i]));
+        result.normals.push_back(toSse(hits.normals[i]));
+        result.colors.push_back(toSse(hits.colors[i]));
+    }
+    result.light = toSse(hits.light);
+    for (int row = 0; row < 3; row++)
+        result.transform.rows_[row] = toSse(Vector(hits.transform.m_[row][0], hits.transform.m_[row][1],
+                                                   hits.transform.m_[row][2]));
+    result.specular = toSse(hits.specular);
+    return result;
+}
+
+Color shadeSse(const SseHits& hits)
+{
+    const __m128d zero = _mm_setzero_pd();
+    __m128 sum = _mm_setzero_ps();
+    for (int i = 0; i < NUM_HITS; i++) {
+        SseVector normal = normalized(hits.normals[i]);
+        SseVector toLight = normalized(hits.light - hits.points[i]);
+        __m128d cosine = dot(normal, toLight);
+        __m128d lambert = _mm_max_sd(zero, cosine);
+        SseVector reflected = normal * _mm_add_pd(cosine, cosine) - toLight;
+        SseVector transformed = reflected * hits.transform;
+        __m128d phong = _mm_max_sd(zero, transformed.z_);
+        __m128 lambertF = _mm_cvtpd_ps(lambert), phongF = _mm_cvtpd_ps(_mm_mul_sd(phong, phong));
+        sum = _mm_add_ps(sum, _mm_add_ps(_mm_mul_ps(hits.colors[i].rgb_, _mm_shuffle_ps(lambertF, lambertF, 0)),
+                                         _mm_mul_ps(hits.specular.rgb_, _mm_shuffle_ps(phongF, phongF, 0))));
+    }
+    return fromSse(sum);
+}
+
+#endif // __SSE2__
+
+#if defined(__AVX2__)
+
+/// the AVX2 prototype: x, y, z (and a zero) in one register. Wrapped, so that it can go in a vector
+struct AvxVector
+{
+    __m256d xyz_;
+};
+
+inline AvxVector toAvx(const Vector& v) { return {_mm256_set_pd(0, v.z_, v.y_, v.x_)}; }
+
+/// the dot product, broadcast to all lanes
+inline __m256d dot(__m256d a, __m256d b)
+{
+    __m256d products = _mm256_mul_pd(a, b);
+    __m128d sum = _mm_add_pd(_mm256_castpd256_pd128(products), _mm256_extractf128_pd(products, 1));
+    sum = _mm_add_sd(sum, _mm_unpackhi_pd(sum, sum));
+    return _mm256_broadcastsd_pd(sum);
+}
+
+inline __m256d rsqrt(__m256d x)
+{
+    __m256d y = _mm256_cvtps_pd(_mm_rsqrt_ps(_mm256_cvtpd_ps(x)));
+    const __m256d half = _mm256_set1_pd(0.5), threeHalves = _mm256_set1_pd(1.5);
+    for (int step = 0; step < 2; step++)
+        y = _mm256_mul_pd(y, _mm256_sub_pd(threeHalves, _mm256_mul_pd(_mm256_mul_pd(half, x), _mm256_mul_pd(y, y))));
+    return y;
+}
+
+inline __m256d normalized(__m256d v) { return _mm256_mul_pd(v, rsqrt(dot(v, v))); }
+
+struct AvxHits
+{
+    std::vector<AvxVector> points, normals;
+    std::vector<SseColor> colors;
+    AvxVector light, rows[3];
+    SseColor specular;
+};
+
+AvxHits toAvx(const Hits& hits)
+{
+    AvxHits result;
+    for (int i = 0; i < NUM_HITS; i++) {
+        result.points.push_back(toAvx(hits.points[i]));
+        result.normals.push_back(toAvx(hits.normals[i]));
+        result.colors.push_back(toSse(hits.colors[i]));
+    }
+    result.light = toAvx(hits.light);
+    for (int row = 0; row < 3; row++)
+        result.rows[row] = toAvx(Vector(hits.transform.m_[row][0], hits.transform.m_[row][1], hits.transform.m_[row][2]));
+    result.specular = toSse(hits.specular);
+    return result;
+}
+
+Color shadeAvx(const AvxHits& hits)
+{
+    const __m256d zero = _mm256_setzero_pd();
+    __m128 sum = _mm_setzero_ps();
+    for (int i = 0; i < NUM_HITS; i++) {
+        __m256d normal = normalized(hits.normals[i].xyz_);
+        __m256d toLight = normalized(_mm256_sub_pd(hits.light.xyz_, hits.points[i].xyz_));
+        __m256d cosine = dot(normal, toLight);
+        __m256d lambert = _mm256_max_pd(zero, cosine);
+        __m256d reflected = _mm256_sub_pd(_mm256_mul_pd(normal, _mm256_add_pd(cosine, cosine)), toLight);
+        // v * m: the rows, multiplied by the broadcast coordinates
+        __m256d transformed = _mm256_add_pd(
+            _mm256_add_pd(_mm256_mul_pd(hits.rows[0].xyz_, _mm256_permute4x64_pd(reflected, 0x00)),
+                          _mm256_mul_pd(hits.rows[1].xyz_, _mm256_permute4x64_pd(reflected, 0x55))),
+            _mm256_mul_pd(hits.rows[2].xyz_, _mm256_permute4x64_pd(reflected, 0xaa)));
+        __m256d phong = _mm256_max_pd(zero, _mm256_permute4x64_pd(transformed, 0xaa));
+        __m128 lambertF = _mm256_cvtpd_ps(lambert), phongF = _mm256_cvtpd_ps(_mm256_mul_pd(phong, phong));
+        sum = _mm_add_ps(sum, _mm_add_ps(_mm_mul_ps(hits.colors[i].rgb_, lambertF),
+                                         _mm_mul_ps(hits.specular.rgb_, phongF)));
+    }
+    return fromSse(sum);
+}
+
+#endif // __AVX2__
+
+/// the two ways of dividing a color: the results are summed, so that the loops aren't optimized away
+Color divideThrice(const Hits& hits)
+{
+    Color sum(0, 0, 0);
+    for (int i = 0; i < NUM_HITS; i++) {
+        const Color& c = hits.colors[i];
+        float w = hits.weights[i];
+        sum += Color(c.r_ / w, c.g_ / w, c.b_ / w);
+    }
+    return sum;
+}
+
+Color divideByReciprocal(const Hits& hits)
+{
+    Color sum(0, 0, 0);
+    for (int i = 0; i < NUM_HITS; i++)
+        sum += hits.colors[i] * (1.0f / hits.weights[i]);
+    return sum;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    int repeats = argc > 1 ? std::max(1, atoi(argv[1])) : 2000;
+    Hits hits = makeHits();
+    Color reference(0, 0, 0), result(0, 0, 0);
+    printf("Math benchmark: %d hits, %d times\n", NUM_HITS, repeats);
+
+    double scalarNs = timePerHit(repeats, [&] { reference = shadeScalar(hits); });
+    printf("  scalar Vector/Color/Matrix  %6.2f ns per hit\n", scalarNs);
+#if defined(__SSE2__)
+    SseHits sseHits = toSse(hits);
+    double sseNs = timePerHit(repeats, [&] { result = shadeSse(sseHits); });
+    printf("  SSE2 prototype              %6.2f ns per hit (%.2fx the scalar speed), relative error %.1e\n", sseNs,
+           scalarNs / sseNs, relativeError(result, reference));
+#else
+    printf("  SSE2 prototype              not available for this target\n");
+#endif
+#if defined(__AVX2__)
+    AvxHits avxHits = toAvx(hits);
+    double avxNs = timePerHit(repeats, [&] { result = shadeAvx(avxHits); });
+    printf("  AVX2 prototype              %6.2f ns per hit (%.2fx the scalar speed), relative error %.1e\n", avxNs,
+           scalarNs / avxNs, relativeError(result, reference));
+#else
+    printf("  AVX2 prototype              not compiled in (build with RAYTRACER_SIMD=AVX2 or NATIVE)\n");
+#endif
+
+    double thriceNs = timePerHit(repeats, [&] { reference = divideThrice(hits); });
+    double reciprocalNs = timePerHit(repeats, [&] { result = divideByReciprocal(hits); });
+    printf("  Color / float: 3 divisions  %6.2f ns, by the reciprocal %6.2f ns, relative error %.1e\n", thriceNs,
+           reciprocalNs, relativeError(result, reference));
+    return 0;
+}
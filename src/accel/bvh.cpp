@@ -0,0 +1,461 @@
+/**
+ * @File bvh.cpp
+ * @Brief Construction of the bounding volume hierarchy.
+ */
+#include "bvh.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+
+#include "utils/thread_pool.h"
+
+static constexpr int NUM_BINS = 16;
+static constexpr int PARALLEL_THRESHOLD = 16384;  // ranges of more primitives are processed in parallel
+static constexpr int BLOCK_SIZE = 16384;          // how many primitives a thread takes at once
+static constexpr double TRAVERSAL_COST = 1.0;     // the cost of a box test, relative to a primitive test
+
+/// a primitive during the build. The SAH builder keeps these (instead of indices) in order,
+/// so that binning reads them sequentially
+struct PrimRef
+{
+    BBox box;
+    Vector center;
+    int prim;
+};
+
+/// state shared by the threads building one hierarchy
+struct BuildContext
+{
+    const std::vector<BBox>& boxes;
+    std::vector<PrimRef> refs; // SAH only
+    std::vector<BvhNode>& nodes;
+    std::vector<int>& primIndices;
+    std::atomic<int> numNodes;
+    int maxLeafSize;
+    int primsPerTest;
+
+    BuildContext(const std::vector<BBox>& primBoxes, std::vector<BvhNode>& bvhNodes, std::vector<int>& indices,
+                 int leafSize, int perTest)
+    : boxes(primBoxes)
+    , nodes(bvhNodes)
+    , primIndices(indices)
+    , numNodes(1)
+    , maxLeafSize(leafSize)
+    , primsPerTest(perTest) {}
+
+    int allocateChildren() { return numNodes.fetch_add(2); }
+
+    void makeLeaf(int nodeIdx, int begin, int end, const BBox& box)
+    {
+        nodes[nodeIdx].box_ = box;
+        nodes[nodeIdx].first_ = begin;
+        nodes[nodeIdx].count_ = end - begin;
+        nodes[nodeIdx].axis_ = 0;
+    }
+};
+
+/// calls fn(blockBegin, blockEnd) for the blocks of [begin, end), in parallel if the range is big
+template <typename Fn>
+static void forEachBlock(int begin, int end, Fn&& fn)
+{
+    int numBlocks = (end - begin + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (numBlocks <= 1) {
+        fn(begin, end);
+        return;
+    }
+    ThreadPool::instance().parallelFor(numBlocks, [&] (int block) {
+        fn(begin + block * BLOCK_SIZE, std::min(end, begin + (block + 1) * BLOCK_SIZE));
+    });
+}
+
+/// runs the two calls in parallel if the range they work on is big enough
+template <typename Left, typename Right>
+static void forkJoin(int rangeSize, Left&& left, Right&& right)
+{
+    if (rangeSize < PARALLEL_THRESHOLD) {
+        left();
+        right();
+        return;
+    }
+    ThreadPool::instance().parallelFor(2, [&] (int which) {
+        if (which == 0) left();
+        else right();
+    });
+}
+
+/// the cost of testing count primitives, primsPerTest at a time
+static inline double testCost(int count, int primsPerTest)
+{
+    return (count + primsPerTest - 1) / primsPerTest;
+}
+
+// ---------------------------------------------------------------------------------------------
+// binned SAH build
+
+struct Bin
+{
+    BBox box, centerBox;
+    int count;
+
+    void makeEmpty()
+    {
+        box.makeEmpty();
+        centerBox.makeEmpty();
+        count = 0;
+    }
+
+    void add(const Bin& other)
+    {
+        if (other.count == 0) return; // BBox::add() can't take an empty box
+        box.add(other.box);
+        centerBox.add(other.centerBox);
+        count += other.count;
+    }
+};
+
+struct Bins
+{
+    Bin bins[3][NUM_BINS];
+
+    void makeEmpty(int numBins)
+    {
+        for (int axis = 0; axis < 3; axis++)
+            for (int i = 0; i < numBins; i++)
+                bins[axis][i].makeEmpty();
+    }
+};
+
+/// maps centers to bins, splitting the centers' box evenly along each axis.
+/// Small nodes get fewer bins, so that their (many) builds aren't dominated by handling empty bins
+struct BinMapping
+{
+    Vector origin, scale;
+    int numBins;
+
+    BinMapping(const BBox& centerBox, int count)
+    : origin(centerBox.vmin_)
+    , numBins(std::min(NUM_BINS, count))
+    {
+        for (int axis = 0; axis < 3; axis++) {
+            double extent = centerBox.vmax_[axis] - centerBox.vmin_[axis];
+            scale[axis] = extent > 0 ? numBins / extent : 0; // 0 for flat axes, which are not split
+        }
+    }
+
+    bool canSplit(int axis) const { return scale[axis] > 0; }
+
+    int index(int axis, double center) const
+    {
+        int index = int((center - origin[axis]) * scale[axis]);
+        return std::max(0, std::min(numBins - 1, index));
+    }
+};
+
+static void buildSAH(BuildContext& ctx, int nodeIdx, int begin, int end, int depth,
+                     const BBox& box, const BBox& centerBox)
+{
+    int count = end - begin;
+    if (count <= 1 || depth >= Bvh::MAX_DEPTH) {
+        ctx.makeLeaf(nodeIdx, begin, end, box);
+        return;
+    }
+
+    // put the primitives in bins along each axis (per block, then merged)
+    BinMapping mapping(centerBox, count);
+    int numBlocks = (count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    Bins bins;
+    std::vector<Bins> blockBins(numBlocks - 1); // the first block goes directly to `bins'
+    forEachBlock(begin, end, [&] (int blockBegin, int blockEnd) {
+        int block = (blockBegin - begin) / BLOCK_SIZE;
+        Bins& blockBin = block ? blockBins[block - 1] : bins;
+        blockBin.makeEmpty(mapping.numBins);
+        for (int i = blockBegin; i < blockEnd; i++) {
+            const PrimRef& ref = ctx.refs[i];
+            for (int axis = 0; axis < 3; axis++) {
+                if (!mapping.canSplit(axis)) continue;
+                Bin& bin = blockBin.bins[axis][mapping.index(axis, ref.center[axis])];
+                bin.box.add(ref.box);
+                bin.centerBox.add(ref.center);
+                bin.count++;
+            }
+        }
+    });
+    for (const Bins& blockBin : blockBins)
+        for (int axis = 0; axis < 3; axis++)
+            for (int i = 0; i < mapping.numBins; i++)
+                bins.bins[axis][i].add(blockBin.bins[axis][i]);
+
+    // find the split with the lowest cost: accumulate the bins from the right, then sweep from the left
+    double bestCost = INF;
+    int bestAxis = -1, bestSplit = 0;
+    Bin bestLeft, bestRight;
+    for (int axis = 0; axis < 3; axis++) {
+        if (!mapping.canSplit(axis)) continue;
+
+        int numBins = mapping.numBins;
+        Bin right[NUM_BINS];
+        right[numBins - 1] = bins.bins[axis][numBins - 1];
+        for (int i = numBins - 2; i >= 0; i--) {
+            right[i] = right[i + 1];
+            right[i].add(bins.bins[axis][i]);
+        }
+        Bin left;
+        left.makeEmpty();
+        for (int split = 1; split < numBins; split++) {
+            left.add(bins.bins[axis][split - 1]);
+            if (left.count == 0 || right[split].count == 0) continue;
+            double cost = left.box.surfaceArea() * testCost(left.count, ctx.primsPerTest)
+                        + right[split].box.surfaceArea() * testCost(right[split].count, ctx.primsPerTest);
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = split;
+                bestLeft = left;
+                bestRight = right[split];
+            }
+        }
+    }
+
+    double leafCost = testCost(count, ctx.primsPerTest);
+    double splitCost = TRAVERSAL_COST + bestCost / box.surfaceArea();
+    if (bestAxis < 0 || (count <= ctx.maxLeafSize && leafCost <= splitCost)) {
+        if (count <= ctx.maxLeafSize || bestAxis >= 0) {
+            ctx.makeLeaf(nodeIdx, begin, end, box);
+            return;
+        }
+        // all centers coincide, but there are too many primitives for a leaf: split them in halves
+        int middle = (begin + end) / 2;
+        int children = ctx.allocateChildren();
+        ctx.nodes[nodeIdx].box_ = box;
+        ctx.nodes[nodeIdx].first_ = children;
+        ctx.nodes[nodeIdx].count_ = 0;
+        ctx.nodes[nodeIdx].axis_ = 0;
+        forkJoin(count,
+                 [&] { buildSAH(ctx, children, begin, middle, depth + 1, box, centerBox); },
+                 [&] { buildSAH(ctx, children + 1, middle, end, depth + 1, box, centerBox); });
+        return;
+    }
+
+    auto middle = std::partition(ctx.refs.begin() + begin, ctx.refs.begin() + end, [&] (const PrimRef& ref) {
+        return mapping.index(bestAxis, ref.center[bestAxis]) < bestSplit;
+    });
+    int middleIdx = int(middle - ctx.refs.begin());
+
+    int children = ctx.allocateChildren();
+    ctx.nodes[nodeIdx].box_ = box;
+    ctx.nodes[nodeIdx].first_ = children;
+    ctx.nodes[nodeIdx].count_ = 0;
+    ctx.nodes[nodeIdx].axis_ = bestAxis;
+    forkJoin(count,
+             [&] { buildSAH(ctx, children, begin, middleIdx, depth + 1, bestLeft.box, bestLeft.centerBox); },
+             [&] { buildSAH(ctx, children + 1, middleIdx, end, depth + 1, bestRight.box, bestRight.centerBox); });
+}
+
+// ---------------------------------------------------------------------------------------------
+// LBVH build
+
+/// spreads the lower 10 bits of x, so that there are two zero bits between each of them
+static inline uint32_t spreadBits(uint32_t x)
+{
+    x = (x | (x << 16)) & 0x030000ff;
+    x = (x | (x << 8)) & 0x0300f00f;
+    x = (x | (x << 4)) & 0x030c30c3;
+    x = (x | (x << 2)) & 0x09249249;
+    return x;
+}
+
+static inline int countLeadingZeros(uint32_t x)
+{
+    return __builtin_clz(x);
+}
+
+static void buildLBVH(BuildContext& ctx, const std::vector<uint32_t>& codes, int nodeIdx, int begin, int end, int depth)
+{
+    int count = end - begin;
+    if (count <= ctx.maxLeafSize || depth >= Bvh::MAX_DEPTH) {
+        BBox box;
+        box.makeEmpty();
+        for (int i = begin; i < end; i++)
+            box.add(ctx.boxes[ctx.primIndices[i]]);
+        ctx.makeLeaf(nodeIdx, begin, end, box);
+        return;
+    }
+
+    // split where the highest bit, in which the codes in the range differ, changes
+    uint32_t firstCode = codes[begin], lastCode = codes[end - 1];
+    int split, axis = 0;
+    if (firstCode == lastCode) {
+        split = (begin + end) / 2;
+    } else {
+        int bit = 31 - countLeadingZeros(firstCode ^ lastCode);
+        uint32_t mask = 1U << bit;
+        split = int(std::partition_point(codes.begin() + begin, codes.begin() + end,
+                                         [mask] (uint32_t code) { return !(code & mask); }) - codes.begin());
+        axis = 2 - bit % 3;
+    }
+
+    int children = ctx.allocateChildren();
+    ctx.nodes[nodeIdx].first_ = children;
+    ctx.nodes[nodeIdx].count_ = 0;
+    ctx.nodes[nodeIdx].axis_ = axis;
+    forkJoin(count,
+             [&] { buildLBVH(ctx, codes, children, begin, split, depth + 1); },
+             [&] { buildLBVH(ctx, codes, children + 1, split, end, depth + 1); });
+
+    ctx.nodes[nodeIdx].box_ = ctx.nodes[children].box_;
+    ctx.nodes[nodeIdx].box_.add(ctx.nodes[children + 1].box_);
+}
+
+/// sorts the keys on all threads: the blocks are sorted in parallel, then merged pairwise
+static void parallelSort(std::vector<uint64_t>& keys)
+{
+    int size = int(keys.size());
+    int numBlocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    ThreadPool& pool = ThreadPool::instance();
+    pool.parallelFor(numBlocks, [&] (int block) {
+        std::sort(keys.begin() + block * BLOCK_SIZE, keys.begin() + std::min(size, (block + 1) * BLOCK_SIZE));
+    });
+    for (long long width = BLOCK_SIZE; width < size; width *= 2) {
+        int numMerges = int((size + 2 * width - 1) / (2 * width));
+        pool.parallelFor(numMerges, [&] (int merge) {
+            long long first = merge * 2 * width;
+            long long middle = std::min<long long>(size, first + width);
+            long long last = std::min<long long>(size, first + 2 * width);
+            std::inplace_merge(keys.begin() + first, keys.begin() + middle, keys.begin() + last);
+        });
+    }
+}
+
+// ---------------------------------------------------------------------------------------------
+
+void Bvh::build(const std::vector<BBox>& primBoxes, int maxLeafSize, BvhQuality quality, int primsPerTest)
+{
+    auto startTime = std::chrono::steady_clock::now();
+
+    int numPrims = int(primBoxes.size());
+    nodes_.clear();
+    primIndices_.resize(numPrims);
+    stats_ = BvhBuildStats();
+    if (numPrims == 0) return;
+
+    nodes_.resize(std::max(1, 2 * numPrims - 1));
+    primsPerTest_ = std::max(1, primsPerTest);
+    BuildContext ctx(primBoxes, nodes_, primIndices_, std::max(1, maxLeafSize), primsPerTest_);
+
+    // the bounds of everything, and of the primitives' centers
+    bool sah = (quality == BvhQuality::SAH);
+    if (sah) ctx.refs.resize(numPrims);
+    int numBlocks = (numPrims + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    std::vector<BBox> blockBoxes(numBlocks), blockCenterBoxes(numBlocks);
+    forEachBlock(0, numPrims, [&] (int blockBegin, int blockEnd) {
+        BBox& box = blockBoxes[blockBegin / BLOCK_SIZE];
+        BBox& centerBox = blockCenterBoxes[blockBegin / BLOCK_SIZE];
+        box.makeEmpty();
+        centerBox.makeEmpty();
+        for (int i = blockBegin; i < blockEnd; i++) {
+            Vector center = primBoxes[i].center();
+            box.add(primBoxes[i]);
+            centerBox.add(center);
+            if (sah) ctx.refs[i] = {primBoxes[i], center, i};
+        }
+    });
+    BBox box = blockBoxes[0], centerBox = blockCenterBoxes[0];
+    for (int block = 1; block < numBlocks; block++) {
+        box.add(blockBoxes[block]);
+        centerBox.add(blockCenterBoxes[block]);
+    }
+
+    if (sah) {
+        buildSAH(ctx, 0, 0, numPrims, 0, box, centerBox);
+        forEachBlock(0, numPrims, [&] (int blockBegin, int blockEnd) {
+            for (int i = blockBegin; i < blockEnd; i++)
+                primIndices_[i] = ctx.refs[i].prim;
+        });
+    } else {
+        // 10 bits per axis of the position in the centers' box, interleaved, and the primitive index
+        std::vector<uint64_t> keys(numPrims);
+        forEachBlock(0, numPrims, [&] (int blockBegin, int blockEnd) {
+            for (int i = blockBegin; i < blockEnd; i++) {
+                Vector center = primBoxes[i].center();
+                uint32_t cell[3];
+                for (int axis = 0; axis < 3; axis++) {
+                    double extent = centerBox.vmax_[axis] - centerBox.vmin_[axis];
+                    double t = extent > 0 ? (center[axis] - centerBox.vmin_[axis]) / extent : 0;
+                    cell[axis] = uint32_t(std::min(1023.0, t * 1024));
+                }
+                uint32_t code = (spreadBits(cell[0]) << 2) | (spreadBits(cell[1]) << 1) | spreadBits(cell[2]);
+                keys[i] = (uint64_t(code) << 32) | uint32_t(i);
+            }
+        });
+        parallelSort(keys);
+
+        std::vector<uint32_t> codes(numPrims);
+        forEachBlock(0, numPrims, [&] (int blockBegin, int blockEnd) {
+            for (int i = blockBegin; i < blockEnd; i++) {
+                codes[i] = uint32_t(keys[i] >> 32);
+                primIndices_[i] = int(keys[i] & 0xffffffffU);
+            }
+        });
+        buildLBVH(ctx, codes, 0, 0, numPrims, 0);
+    }
+
+    nodes_.resize(ctx.numNodes);
+    nodes_.shrink_to_fit();
+
+    stats_.buildTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    stats_.numPrims = numPrims;
+    computeStats();
+}
+
+void Bvh::computeStats()
+{
+    stats_.numNodes = int(nodes_.size());
+    stats_.numLeaves = 0;
+    stats_.maxDepth = 0;
+    stats_.sahCost = 0;
+    if (nodes_.empty()) return;
+
+    double rootArea = std::max(nodes_[0].box_.surfaceArea(), 1e-12);
+    std::vector<std::pair<int, int>> stack; // node, depth
+    stack.push_back({0, 0});
+    while (!stack.empty()) {
+        auto [index, depth] = stack.back();
+        stack.pop_back();
+        const BvhNode& node = nodes_[index];
+        double areaRatio = node.box_.surfaceArea() / rootArea;
+        stats_.maxDepth = std::max(stats_.maxDepth, depth);
+        if (node.count_ > 0) {
+            stats_.numLeaves++;
+            stats_.sahCost += areaRatio * testCost(node.count_, primsPerTest_);
+        } else {
+            stats_.sahCost += areaRatio * TRAVERSAL_COST;
+            stack.push_back({node.first_, depth + 1});
+            stack.push_back({node.first_ + 1, depth + 1});
+        }
+    }
+}
+
+void Bvh::printStats(const char* name) const
+{
+    printf("%s: BVH over %d primitives: %d nodes, %d leaves, depth %d, SAH cost %.2f, built in %.3lfs\n",
+           name, stats_.numPrims, stats_.numNodes, stats_.numLeaves, stats_.maxDepth, stats_.sahCost, stats_.buildTime);
+}
+
+void Bvh::refit(const std::vector<BBox>& primBoxes)
+{
+    // the children are always after their parent, so going backwards updates them first
+    for (int index = int(nodes_.size()) - 1; index >= 0; index--) {
+        BvhNode& node = nodes_[index];
+        if (node.count_ > 0) {
+            node.box_.makeEmpty();
+            for (int i = node.first_; i < node.first_ + node.count_; i++)
+                node.box_.add(primBoxes[primIndices_[i]]);
+        } else {
+            node.box_ = nodes_[node.first_].box_;
+            node.box_.add(nodes_[node.first_ + 1].box_);
+        }
+    }
+}
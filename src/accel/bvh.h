@@ -0,0 +1,150 @@
+/**
+ * @File bvh.h
+ * @Brief A bounding volume hierarchy over a set of primitives, known only by their bounding boxes.
+ */
+#ifndef __BVH_H__
+#define __BVH_H__
+
+#include <vector>
+
+#include "maths/bbox.h"
+#include "maths/ray.h"
+#include "utils/memory.h"
+
+/// a node of the flattened hierarchy. The children of an inner node are next to each other,
+/// and always after their parent
+struct BvhNode
+{
+    BBox box_;
+    int first_;  // leaf: index of the first primitive in Bvh::primIndices_; inner node: index of the left child
+    int count_;  // leaf: number of primitives; 0 for inner nodes
+    int axis_;   // inner node: the split axis, used to visit the nearer child first
+};
+
+/// how to build a hierarchy: FAST sorts the primitives along a Morton curve and splits by the curve
+/// (LBVH) - good for per-frame rebuilds; SAH does binned surface area heuristic splits - slower to
+/// build, but faster to trace
+enum class BvhQuality { FAST, SAH };
+
+struct BvhBuildStats
+{
+    int numPrims = 0;
+    int numNodes = 0;
+    int numLeaves = 0;
+    int maxDepth = 0;
+    double sahCost = 0;    // expected cost of a ray (in box tests), with primitive tests counted as one box test
+    double buildTime = 0;  // in seconds
+};
+
+class Bvh
+{
+public:
+    static constexpr int MAX_DEPTH = 64;
+
+    /// builds the hierarchy over primitives with the given bounding boxes, on all threads of the pool. If the
+    /// primitives of a leaf are tested several at a time (see intersectLeaves()), primsPerTest tells the SAH how many
+    void build(const std::vector<BBox>& primBoxes, int maxLeafSize = 4, BvhQuality quality = BvhQuality::SAH,
+               int primsPerTest = 1);
+    /// updates the node boxes after the primitives have moved, keeping the tree topology. Linear in the
+    /// number of nodes, but the tree gets less efficient if the primitives move far from their old neighbours
+    void refit(const std::vector<BBox>& primBoxes);
+
+    bool isEmpty() const { return nodes_.empty(); }
+    const BBox& getBBox() const { return nodes_[0].box_; }
+
+    /// finds the closest primitive along the ray. intersectPrim(primIndex, maxDist) must test the
+    /// primitive and, if it's hit closer than maxDist, update maxDist and return true
+    template <typename IntersectPrim>
+    bool intersect(const Ray& ray, double& maxDist, IntersectPrim&& intersectPrim) const
+    {
+        return traverse<false>(ray, maxDist, intersectPrim);
+    }
+
+    /// like intersect(), but stops at the first primitive hit closer than maxDist (for shadow rays)
+    template <typename IntersectPrim>
+    bool intersectAny(const Ray& ray, double maxDist, IntersectPrim&& intersectPrim) const
+    {
+        return traverse<true>(ray, maxDist, intersectPrim);
+    }
+
+    /// like intersect(), but hands over whole leaves, e.g. to test their primitives together with SIMD.
+    /// intersectLeaf(nodeIndex, maxDist) must test primIndices_[first_ .. first_ + count_) of nodes_[nodeIndex]
+    /// and, if one of them is hit closer than maxDist, update maxDist and return true
+    template <typename IntersectLeaf>
+    bool intersectLeaves(const Ray& ray, double& maxDist, IntersectLeaf&& intersectLeaf) const
+    {
+        return traverseLeaves<false>(ray, maxDist, intersectLeaf);
+    }
+
+    const BvhBuildStats& getStats() const { return stats_; }
+    void printStats(const char* name) const; //!< prints the statistics of the last build
+    size_t getMemoryUsage() const { return vectorBytes(nodes_) + vectorBytes(primIndices_); } //!< of the arrays
+
+    std::vector<BvhNode> nodes_;
+    std::vector<int> primIndices_; // the primitives, reordered so that each leaf references a contiguous range
+
+private:
+    template <bool anyHit, typename IntersectPrim>
+    bool traverse(const Ray& ray, double& maxDist, IntersectPrim& intersectPrim) const;
+    template <bool anyHit, typename IntersectLeaf>
+    bool traverseLeaves(const Ray& ray, double& maxDist, IntersectLeaf& intersectLeaf) const;
+
+    void computeStats();
+
+    BvhBuildStats stats_;
+    int primsPerTest_ = 1;
+};
+
+template <bool anyHit, typename IntersectPrim>
+bool Bvh::traverse(const Ray& ray, double& maxDist, IntersectPrim& intersectPrim) const
+{
+    auto intersectLeaf = [&] (int index, double& maxDist) {
+        const BvhNode& node = nodes_[index];
+        bool found = false;
+        for (int i = node.first_; i < node.first_ + node.count_; i++) {
+            if (intersectPrim(primIndices_[i], maxDist)) {
+                if (anyHit) return true;
+                found = true;
+            }
+        }
+        return found;
+    };
+    return traverseLeaves<anyHit>(ray, maxDist, intersectLeaf);
+}
+
+template <bool anyHit, typename IntersectLeaf>
+bool Bvh::traverseLeaves(const Ray& ray, double& maxDist, IntersectLeaf& intersectLeaf) const
+{
+    if (nodes_.empty()) return false;
+
+    Vector invDir(1.0 / ray.dir_.x_, 1.0 / ray.dir_.y_, 1.0 / ray.dir_.z_);
+    int stack[2 * MAX_DEPTH + 2];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    bool found = false;
+
+    while (stackSize > 0) {
+        int index = stack[--stackSize];
+        const BvhNode& node = nodes_[index];
+        double tNear;
+        if (!node.box_.intersect(ray.start_, invDir, maxDist, tNear))
+            continue;
+
+        if (node.count_ > 0) {
+            if (intersectLeaf(index, maxDist)) {
+                if (anyHit) return true;
+                found = true;
+            }
+        } else {
+            // push the farther child first, so the nearer one is visited first
+            int nearChild = node.first_, farChild = node.first_ + 1;
+            if (ray.dir_[node.axis_] < 0) std::swap(nearChild, farChild);
+            stack[stackSize++] = farChild;
+            stack[stackSize++] = nearChild;
+        }
+    }
+
+    return found;
+}
+
+#endif // __BVH_H__
@@ -0,0 +1,97 @@
+/**
+ * @File tlas.cpp
+ * @Brief The top-level acceleration structure over the scene nodes.
+ */
+#include "tlas.h"
+
+#include "utils/constants.h"
+
+void Tlas::build(const std::vector<Node>& nodes, BvhQuality quality)
+{
+    nodes_ = &nodes;
+    bounded_.clear();
+    unbounded_.clear();
+    boxes_.clear();
+
+    for (int i = 0; i < int(nodes.size()); i++) {
+        BBox box;
+        if (nodes[i].geometry_->getBBox(box)) {
+            bounded_.push_back(i);
+            boxes_.push_back(box);
+        } else {
+            unbounded_.push_back(i);
+        }
+    }
+
+    bvh_.build(boxes_, 1, quality);
+    builtArea_ = bvh_.isEmpty() ? 0 : bvh_.getBBox().surfaceArea();
+}
+
+void Tlas::getBoxes()
+{
+    for (size_t i = 0; i < bounded_.size(); i++)
+        (*nodes_)[bounded_[i]].geometry_->getBBox(boxes_[i]);
+}
+
+void Tlas::update()
+{
+    if (!nodes_ || bvh_.isEmpty()) return;
+
+    getBoxes();
+    bvh_.refit(boxes_);
+
+    // if the scene spread out a lot, the old topology is probably poor; start over
+    if (bvh_.getBBox().surfaceArea() > 2 * builtArea_)
+        build(*nodes_, BvhQuality::FAST);
+}
+
+const Node* Tlas::intersect(const Ray& ray, IntersectionInfo& info) const
+{
+    const Node* closestNode = nullptr;
+    double closestDist = INF;
+
+    auto intersectNode = [&] (int nodeIdx, double& maxDist) {
+        const Node& node = (*nodes_)[nodeIdx];
+        IntersectionInfo nodeInfo;
+        if (!node.geometry_->intersect(ray, nodeInfo) || nodeInfo.distance_ >= maxDist)
+            return false;
+
+        maxDist = nodeInfo.distance_;
+        closestNode = &node;
+        info = nodeInfo;
+        return true;
+    };
+
+    for (int nodeIdx : unbounded_)
+        intersectNode(nodeIdx, closestDist);
+    bvh_.intersect(ray, closestDist, [&] (int primIdx, double& maxDist) {
+        return intersectNode(bounded_[primIdx], maxDist);
+    });
+
+    return closestNode;
+}
+
+const Node* Tlas::intersectAny(const Ray& ray, double maxDist, const Node* skip) const
+{
+    const Node* found = nullptr;
+
+    auto intersectNode = [&] (int nodeIdx, double maxDist) {
+        const Node& node = (*nodes_)[nodeIdx];
+        if (&node == skip) return false;
+        IntersectionInfo info;
+        if (!node.geometry_->intersect(ray, info) || info.distance_ >= maxDist)
+            return false;
+
+        found = &node;
+        return true;
+    };
+
+    for (int nodeIdx : unbounded_)
+        if (intersectNode(nodeIdx, maxDist))
+            return found;
+    bvh_.intersectAny(ray, maxDist, [&] (int primIdx, double& maxDist) {
+        return intersectNode(bounded_[primIdx], maxDist);
+    });
+
+    return found;
+}
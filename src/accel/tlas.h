@@ -0,0 +1,49 @@
+/**
+ * @File tlas.h
+ * @Brief The top-level acceleration structure over the scene nodes.
+ */
+#ifndef __TLAS_H__
+#define __TLAS_H__
+
+#include <vector>
+
+#include "bvh.h"
+#include "shaders/shading.h"
+
+/// The top level of a two-level acceleration structure. The bottom levels are the geometries' own
+/// hierarchies (e.g. the BVH of a Mesh), built once per prototype and shared by all of its instances.
+/// This one is a BVH over the bounding boxes of the nodes, so after objects move it only needs a
+/// refit (or a rebuild), both of which cost in proportion to the number of nodes, not primitives.
+/// Unbounded geometries (e.g. planes) are kept aside and tested for every ray.
+class Tlas
+{
+public:
+    /// (re)builds the hierarchy over the given nodes
+    void build(const std::vector<Node>& nodes, BvhQuality quality = BvhQuality::SAH);
+    /// updates the hierarchy after some nodes have moved, rebuilding it (with the fast builder)
+    /// if refitting would make it too loose
+    void update();
+
+    void printStats() const { bvh_.printStats("Scene"); }
+    size_t getMemoryUsage() const //!< of the arrays
+    {
+        return vectorBytes(bounded_) + vectorBytes(unbounded_) + vectorBytes(boxes_) + bvh_.getMemoryUsage();
+    }
+
+    /// finds the closest node along the ray. Returns nullptr if nothing is hit
+    const Node* intersect(const Ray& ray, IntersectionInfo& info) const;
+    /// finds a node hit before maxDist (any one, not necessarily the closest). Skips the node `skip`
+    const Node* intersectAny(const Ray& ray, double maxDist, const Node* skip = nullptr) const;
+
+private:
+    void getBoxes();
+
+    const std::vector<Node>* nodes_ = nullptr;
+    std::vector<int> bounded_;    // indices of the bounded nodes; the BVH primitives index this
+    std::vector<int> unbounded_;  // indices of the rest
+    std::vector<BBox> boxes_;     // the boxes of the bounded nodes
+    Bvh bvh_;
+    double builtArea_ = 0;        // the surface area of the root box, when last built
+};
+
+#endif // __TLAS_H__
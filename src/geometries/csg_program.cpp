@@ -0,0 +1,100 @@
+/**
+ * @File csg_program.cpp
+ * @Brief Compiling and running CSG programs.
+ */
+#include "csg_program.h"
+
+#include <algorithm>
+
+bool CsgProgram::compile(CsgOp& root)
+{
+    code_.clear();
+    primitives_.clear();
+    boxes_.clear();
+    if (!root.hasSpans()) return false;
+
+    compileNode(&root, code_, stackDepth_);
+    return stackDepth_ <= MAX_STACK_DEPTH;
+}
+
+void CsgProgram::compileNode(Geometry* geom, std::vector<Instruction>& code, int& depth)
+{
+    CsgOp* csg = dynamic_cast<CsgOp*>(geom);
+    if (!csg) {
+        code.push_back({PRIMITIVE, 0, int(primitives_.size()), 0});
+        primitives_.push_back(geom);
+        depth = 1;
+        return;
+    }
+
+    std::vector<Instruction> first, second;
+    int firstDepth, secondDepth;
+    compileNode(csg->left_.get(), first, firstDepth);
+    compileNode(csg->right_.get(), second, secondDepth);
+
+    // evaluate the deeper operand first: while it runs, nothing else is on the stack
+    unsigned table = csg->truthTable();
+    if (secondDepth > firstDepth) {
+        std::swap(first, second);
+        std::swap(firstDepth, secondDepth);
+        table = (table & 9) | (table & 2) << 1 | (table & 4) >> 1; // swap A and B
+    }
+    depth = std::max(firstDepth, secondDepth + 1);
+
+    BBox box;
+    int boundsAt = -1;
+    if (csg->getBBox(box)) {
+        boundsAt = int(code.size());
+        code.push_back({BOUNDS, 0, int(boxes_.size()), 0});
+        boxes_.push_back(box);
+    }
+    code.insert(code.end(), first.begin(), first.end());
+    if ((table & 3) == 0) // the result is a subset of the first operand
+        code.push_back({SKIP_IF_EMPTY, 0, 0, int(second.size()) + 1});
+    code.insert(code.end(), second.begin(), second.end());
+    code.push_back({COMBINE, uint8_t(table), 0, 0});
+    if (boundsAt >= 0)
+        code[boundsAt].skip_ = int(code.size()) - boundsAt - 1;
+}
+
+bool CsgProgram::getSpans(const Ray& ray, SpanList& spans) const
+{
+    Vector invDir(1.0 / ray.dir_.x_, 1.0 / ray.dir_.y_, 1.0 / ray.dir_.z_);
+
+    // one more list than the stack can hold, so there's always a free one to merge into
+    SpanList lists[MAX_STACK_DEPTH + 1];
+    SpanList* stack[MAX_STACK_DEPTH + 1];
+    for (int i = 0; i <= MAX_STACK_DEPTH; i++) stack[i] = &lists[i];
+    int top = 0;
+
+    const int last = int(code_.size()) - 1;
+    for (int pc = 0; pc <= last; pc++) {
+        const Instruction& instruction = code_[pc];
+        switch (instruction.opcode_) {
+            case PRIMITIVE:
+                stack[top]->count_ = 0;
+                if (!primitives_[instruction.operand_]->getSpans(ray, *stack[top])) return false;
+                top++;
+                break;
+            case BOUNDS:
+                if (!boxes_[instruction.operand_].testLine(ray.start_, invDir)) {
+                    stack[top++]->count_ = 0;
+                    pc += instruction.skip_;
+                }
+                break;
+            case SKIP_IF_EMPTY:
+                if (stack[top - 1]->count_ == 0) pc += instruction.skip_;
+                break;
+            case COMBINE:
+                if (pc == last) // the final result goes straight to the caller
+                    return mergeSpans(*stack[top - 2], *stack[top - 1], instruction.truthTable_, spans);
+                if (!mergeSpans(*stack[top - 2], *stack[top - 1], instruction.truthTable_, *stack[top]))
+                    return false;
+                std::swap(stack[top - 2], stack[top]);
+                top--;
+                break;
+        }
+    }
+    spans = *stack[0]; // a single primitive, or the whole tree was skipped
+    return true;
+}
@@ -0,0 +1,55 @@
+/**
+ * @File csg_program.h
+ * @Brief A CSG tree flattened into a postfix program over the spans of its primitives.
+ */
+#ifndef __CSG_PROGRAM_H__
+#define __CSG_PROGRAM_H__
+
+#include <cstdint>
+#include <vector>
+
+#include "geometry.h"
+
+/// A CSG tree compiled into a linear postfix program: the primitives push their spans on a stack and
+/// each boolean operation pops two span lists and pushes the merged one. The operations are truth
+/// tables instead of virtual calls, the children of each one are ordered so that the stack stays
+/// shallow (O(log n) for any tree shape), and subtrees are skipped if the line of the ray misses
+/// their bounding box, or if the result is a subset of an empty first operand
+class CsgProgram
+{
+public:
+    static constexpr int MAX_STACK_DEPTH = 16;
+
+    /// compiles the tree. Returns false if it needs too deep a stack or not all primitives support spans
+    bool compile(CsgOp& root);
+    /// the same as CsgOp::getSpans(), without the recursion
+    bool getSpans(const Ray& ray, SpanList& spans) const;
+
+    int getStackDepth() const { return stackDepth_; }
+    size_t getMemoryUsage() const { return vectorBytes(code_) + vectorBytes(primitives_) + vectorBytes(boxes_); }
+
+private:
+    enum Opcode : uint8_t {
+        PRIMITIVE,     // push the spans of primitives_[operand_]
+        BOUNDS,        // if the line misses boxes_[operand_], push nothing in and skip the subtree
+        SKIP_IF_EMPTY, // if the top of the stack is empty, the result is too: skip the second operand
+        COMBINE,       // pop two, push the merged spans
+    };
+
+    struct Instruction
+    {
+        Opcode opcode_;
+        uint8_t truthTable_; // for COMBINE
+        int operand_;
+        int skip_;           // for BOUNDS and SKIP_IF_EMPTY: how many instructions to jump over
+    };
+
+    void compileNode(Geometry* geom, std::vector<Instruction>& code, int& depth);
+
+    std::vector<Instruction> code_;
+    std::vector<Geometry*> primitives_;
+    std::vector<BBox> boxes_;
+    int stackDepth_ = 0;
+};
+
+#endif // __CSG_PROGRAM_H__
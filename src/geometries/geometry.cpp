@@ -4,10 +4,52 @@
  */
 
 #include "geometry.h"
+#include "csg_program.h"
 #include "utils/constants.h"
+#include "utils/util.h"
 
 #include <algorithm>
 
+void IntersectionInfo::setDifferentials(const Ray& ray, const Vector& gradU, const Vector& gradV)
+{
+    hasDifferentials_ = false;
+    if (!ray.hasDifferentials_) return;
+
+    // the neighbouring rays, intersected with the tangent plane dot(normal_, p) == dot(normal_, ip_)
+    const RayDifferentials& diff = ray.differentials_;
+    Vector dirX = ray.dir_ + diff.dDirDx_, dirY = ray.dir_ + diff.dDirDy_;
+    double cosX = dot(normal_, dirX), cosY = dot(normal_, dirY);
+    if (fabs(cosX) < 1e-12 || fabs(cosY) < 1e-12) return; // along the plane: the footprint is unbounded
+    Vector startX = ray.start_ + diff.dStartDx_, startY = ray.start_ + diff.dStartDy_;
+    dpdx_ = startX + dirX * (dot(normal_, ip_ - startX) / cosX) - ip_;
+    dpdy_ = startY + dirY * (dot(normal_, ip_ - startY) / cosY) - ip_;
+
+    dudx_ = dot(gradU, dpdx_);
+    dudy_ = dot(gradU, dpdy_);
+    dvdx_ = dot(gradV, dpdx_);
+    dvdy_ = dot(gradV, dpdy_);
+    hasDifferentials_ = true;
+}
+
+void IntersectionInfo::setHitPoint(const Ray& ray, double distance)
+{
+    distance_ = distance;
+    ip_ = ray.start_ + ray.dir_ * distance;
+    double startMagnitude = std::max(fabs(ray.start_.x_), std::max(fabs(ray.start_.y_), fabs(ray.start_.z_)));
+    ipError_ = (startMagnitude + fabs(distance)) * HIT_ERROR;
+}
+
+Vector IntersectionInfo::offsetStart(const Vector& dir) const
+{
+    // the error bound, projected on the normal, is how far off the surface ip_ may be along it. The addition
+    // below rounds too, by up to half a unit in the last place of each coordinate
+    double ipMagnitude = std::max(fabs(ip_.x_), std::max(fabs(ip_.y_), fabs(ip_.z_)));
+    double error = ipError_ + ipMagnitude * std::numeric_limits<double>::epsilon();
+    double distance = error * (fabs(normal_.x_) + fabs(normal_.y_) + fabs(normal_.z_));
+    if (dot(dir, normal_) < 0) distance = -distance;
+    return ip_ + normal_ * distance;
+}
+
 bool Plane::intersect(const Ray& ray, IntersectionInfo& info)
 {
     if (ray.start_.y_ > y_ && ray.dir_.y_ >= 0)
@@ -18,35 +60,89 @@ bool Plane::intersect(const Ray& ray, IntersectionInfo& info)
     // else we can hit the plane and checking that by calculating how long the
     // vector should be to hit the plane instead of calculating the intersection of the plane
     double scaleFactor = (y_ - ray.start_.y_)/ray.dir_.y_;
-    info.ip_ = ray.start_ + ray.dir_ * scaleFactor;
-    info.distance_ = scaleFactor;
+    if (scaleFactor <= 0) return false; // starting on the plane
+    info.setHitPoint(ray, scaleFactor);
 
     // should be _|_ to the plane and when the plane is || XZ -> normal = Y so
     // if we watch from upside the normal is +1 else is -1
     info.normal_ = Vector(0., ray.start_.y_ > y_ ? 1. : -1., 0.);
     info.u_ = info.ip_.x_;
     info.v_ = info.ip_.z_;
+    info.setDifferentials(ray, Vector(1, 0, 0), Vector(0, 0, 1));
     info.geom_ = this;
 
     return true;
 }
 
-bool Sphere::intersect(const Ray &ray, IntersectionInfo &info)
+bool Plane::getSpans(const Ray& ray, SpanList& spans)
 {
-    // H = ray.start - center_
-    // p^2 * dir.length^2 + p * (2 * dir · H) + (H.length^2 – R^2) = 0
+    if (ray.dir_.y_ == 0) {
+        if (ray.start_.y_ < y_) { // the whole line is below
+            spans.add(-INF, this);
+            spans.add(INF, this);
+        }
+        return true;
+    }
 
-    Vector H = ray.start_ - center_;
-    double A = 1; // ray._dir.lengthSqr() -> this is 1 because the direction is normalized so the length is 1s
-    double B = 2 * ray.dir_ * H;
-    double C = H.lengthSqr() - radius_*radius_;
+    double distance = (y_ - ray.start_.y_) / ray.dir_.y_;
+    if (ray.dir_.y_ < 0) { // going down: enters the half-space
+        spans.add(distance, this);
+        spans.add(INF, this);
+    } else {
+        spans.add(-INF, this);
+        spans.add(distance, this);
+    }
+    return true;
+}
 
-    double disc = B*B - 4*A*C;
+void Plane::getCrossingInfo(const Ray& ray, double distance, IntersectionInfo& info)
+{
+    info.setHitPoint(ray, distance);
+    info.normal_ = Vector(0, 1, 0);
+    info.u_ = info.ip_.x_;
+    info.v_ = info.ip_.z_;
+    info.setDifferentials(ray, Vector(1, 0, 0), Vector(0, 0, 1));
+    info.geom_ = this;
+}
 
+bool Plane::setParam(const std::string& name, const ParamValues& values)
+{
+    return name == "y" && getParam(values, y_);
+}
+
+/// the distances along the line of the ray to where it crosses the sphere, p1 <= p2: the roots of
+/// p^2 + 2 * halfB * p + C = 0 (the direction is normalized), with H = start - center, halfB = dir · H and
+/// C = H.length^2 - R^2. Computed so that they keep their precision far from the sphere and close to its
+/// surface. Returns false if the line misses it
+static bool intersectSphereLine(const Ray& ray, const Vector& center, double radius, double& p1, double& p2)
+{
+    Vector H = ray.start_ - center;
+    double halfB = ray.dir_ * H;
+    double C = H.lengthSqr() - radius*radius;
+
+    // halfB^2 - C, but from the distance between the line and the center, which doesn't cancel out when
+    // both terms are large (a sphere far away)
+    Vector perpendicular = H - ray.dir_ * halfB;
+    double disc = radius*radius - perpendicular.lengthSqr();
     if (disc < 0) return false;
 
-    double p1 = (-B - sqrt(disc)) / 2*A;
-    double p2 = (-B + sqrt(disc)) / 2*A;
+    // the root of the larger magnitude is a sum of terms of the same sign; the other one follows from the
+    // product of the two, C, instead of from a difference which would lose the digits
+    double q = -(halfB + copysign(sqrt(disc), halfB));
+    if (q == 0) { // touching the sphere at the start
+        p1 = p2 = 0;
+        return true;
+    }
+    p1 = q;
+    p2 = C / q;
+    if (p1 > p2) std::swap(p1, p2);
+    return true;
+}
+
+bool Sphere::intersect(const Ray &ray, IntersectionInfo &info)
+{
+    double p1, p2;
+    if (!intersectSphereLine(ray, center_, radius_, p1, p2)) return false;
 
     double p;
     bool reverseNormal = false;
@@ -61,81 +157,265 @@ bool Sphere::intersect(const Ray &ray, IntersectionInfo &info)
     }
     else return false; // if both are negative the sphere is behind the camera
 
-    info.distance_ = p;
-    info.ip_ = ray.start_ + p * ray.dir_;
+    info.setHitPoint(ray, p);
     info.normal_ = info.ip_ - center_;   // this is the continuation of the line from the center to the intersection point
     info.normal_.normalize();
     info.normal_ = reverseNormal ? -info.normal_ : info.normal_;
+    setUV(ray, info);
+    info.geom_ = this;
+
+    return true;
+}
 
+void Sphere::setUV(const Ray& ray, IntersectionInfo& info) const
+{
     Vector posRelative = info.ip_ - center_;    // used for spherical coordinates for u v coords
     info.u_ = atan2(posRelative.z_, posRelative.x_);
     info.v_ = asin(posRelative.y_ / radius_); // it can be between -1 1
     // we want to remap them from [(-PI...PI)x_(-PI/2...PI/2)] -> [(0..1)x_(0..1)] for easier texturing later
     info.u_ = (info.u_ + PI) / (2*PI);
     info.v_ = -(info.v_ + PI/2) / (PI);
+
+    info.hasDifferentials_ = false;
+    if (!ray.hasDifferentials_) return;
+    // the derivatives of the above. They grow without bound at the poles, where the texture gets pinched
+    double distFromAxisSqr = std::max(sqr(posRelative.x_) + sqr(posRelative.z_), 1e-12 * sqr(radius_));
+    Vector gradU = Vector(-posRelative.z_, 0, posRelative.x_) / (distFromAxisSqr * 2*PI);
+    Vector gradV = Vector(0, -1 / (sqrt(distFromAxisSqr) * PI), 0);
+    info.setDifferentials(ray, gradU, gradV);
+}
+
+bool Sphere::setParam(const std::string& name, const ParamValues& values)
+{
+    if (name == "center") return getParam(values, center_);
+    if (name == "radius") return getParam(values, radius_);
+    return false;
+}
+
+bool Sphere::getSpans(const Ray& ray, SpanList& spans)
+{
+    double p1, p2;
+    if (!intersectSphereLine(ray, center_, radius_, p1, p2)) return true; // the line misses it
+
+    spans.add(p1, this);
+    spans.add(p2, this);
+    return true;
+}
+
+void Sphere::getCrossingInfo(const Ray& ray, double distance, IntersectionInfo& info)
+{
+    info.setHitPoint(ray, distance);
+    info.normal_ = info.ip_ - center_;
+    info.normal_.normalize();
+    setUV(ray, info);
     info.geom_ = this;
+}
 
+bool Sphere::getBBox(BBox& box) const
+{
+    Vector extent(radius_, radius_, radius_);
+    box = BBox(center_ - extent, center_ + extent);
     return true;
 }
 
+bool Cube::clipLine(const Ray& ray, double& tNear, int& nearAxis, double& tFar, int& farAxis) const
+{
+    tNear = -INF, tFar = INF;
+    nearAxis = farAxis = 0;
+    for (int axis = 0; axis < 3; axis++) {
+        double lo = center_[axis] - halfSide_, hi = center_[axis] + halfSide_;
+        double start = ray.start_[axis], dir = ray.dir_[axis];
+        if (dir == 0) {
+            if (start < lo || start > hi) return false; // parallel to the slab and outside it
+            continue;
+        }
+        double t1 = (lo - start) / dir;
+        double t2 = (hi - start) / dir;
+        if (t1 > t2) std::swap(t1, t2);
+        if (t1 > tNear) {
+            tNear = t1;
+            nearAxis = axis;
+        }
+        if (t2 < tFar) {
+            tFar = t2;
+            farAxis = axis;
+        }
+    }
+    return tNear <= tFar;
+}
+
 bool Cube::intersect(const Ray& ray, IntersectionInfo& info)
 {
-        info.distance_ = INF;
-        intersectSide(center_.x_ - halfSide_, ray.start_.x_, ray.dir_.x_, ray, Vector(-1, 0, 0), info);
-        intersectSide(center_.x_ + halfSide_, ray.start_.x_, ray.dir_.x_, ray, Vector(+1, 0, 0), info);
-        intersectSide(center_.y_ - halfSide_, ray.start_.y_, ray.dir_.y_, ray, Vector( 0,-1, 0), info);
-        intersectSide(center_.y_ + halfSide_, ray.start_.y_, ray.dir_.y_, ray, Vector( 0,+1, 0), info);
-        intersectSide(center_.z_ - halfSide_, ray.start_.z_, ray.dir_.z_, ray, Vector( 0, 0,-1), info);
-        intersectSide(center_.z_ + halfSide_, ray.start_.z_, ray.dir_.z_, ray, Vector( 0, 0,+1), info);
+    // the sides are where the slabs are clipped, so two sides sharing an edge are hit on the same
+    // distance there: no gap between them for a ray to slip through
+    double tNear, tFar;
+    int nearAxis, farAxis;
+    if (!clipLine(ray, tNear, nearAxis, tFar, farAxis) || tFar <= 0)
+        return false;
 
-        return (info.distance_ < INF);
+    bool entering = tNear > 0; // else the ray starts inside, and leaves through the far side
+    int axis = entering ? nearAxis : farAxis;
+    info.setHitPoint(ray, entering ? tNear : tFar);
+    info.normal_.makeZero();
+    info.normal_[axis] = (ray.dir_[axis] > 0) == entering ? -1 : +1; // pointing out of the cube
+    info.u_ = info.ip_.x_ + info.ip_.z_;
+    info.v_ = info.ip_.y_;
+    info.setDifferentials(ray, Vector(1, 0, 1), Vector(0, 1, 0));
+    info.geom_ = this;
+    return true;
 }
 
-bool Cube::intersectSide(double level, double start, double dir, const Ray& ray, const Vector& normal, IntersectionInfo& info)
+bool Cube::getBBox(BBox& box) const
 {
-    if (start > level && dir >= 0)
-        return false;
-    if (start < level && dir <= 0)
-        return false;
+    Vector extent(halfSide_, halfSide_, halfSide_);
+    box = BBox(center_ - extent, center_ + extent);
+    return true;
+}
 
-    double scaleFactor = (level - start) / dir;
-    Vector ip = ray.start_ + ray.dir_ * scaleFactor;
-    if (ip.y_ > center_.y_ + halfSide_ + 1e-6) return false;
-    if (ip.y_ < center_.y_ - halfSide_ - 1e-6) return false;
-
-    if (ip.x_ > center_.x_ + halfSide_ + 1e-6) return false;
-    if (ip.x_ < center_.x_ - halfSide_ - 1e-6) return false;
-
-    if (ip.z_ > center_.z_ + halfSide_ + 1e-6) return false;
-    if (ip.z_ < center_.z_ - halfSide_ - 1e-6) return false;
-
-    double distance = scaleFactor;
-    if (distance < info.distance_) {
-        info.ip_ = ip;
-        info.distance_ = distance;
-        info.normal_ = normal;
-        info.u_ = info.ip_.x_ + info.ip_.z_;
-        info.v_ = info.ip_.y_;
-        info.geom_ = this;
-        return true;
-    }
+bool Cube::setParam(const std::string& name, const ParamValues& values)
+{
+    if (name == "center") return getParam(values, center_);
+    if (name == "halfSide") return getParam(values, halfSide_);
     return false;
 }
 
-void CsgOp::findAllIntersections(Ray ray, Geometry* geom, std::vector<IntersectionInfo>& ips)
+bool Cube::getSpans(const Ray& ray, SpanList& spans)
+{
+    double tNear, tFar;
+    int nearAxis, farAxis;
+    if (!clipLine(ray, tNear, nearAxis, tFar, farAxis)) return true;
+
+    spans.add(tNear, this);
+    spans.add(tFar, this);
+    return true;
+}
+
+void Cube::getCrossingInfo(const Ray& ray, double distance, IntersectionInfo& info)
+{
+    info.setHitPoint(ray, distance);
+
+    // the side is the one along the axis where the point is farthest from the center
+    Vector posRelative = info.ip_ - center_;
+    int axis = 0;
+    for (int i = 1; i < 3; i++)
+        if (fabs(posRelative[i]) > fabs(posRelative[axis])) axis = i;
+    info.normal_.makeZero();
+    info.normal_[axis] = posRelative[axis] > 0 ? 1 : -1;
+
+    info.u_ = info.ip_.x_ + info.ip_.z_;
+    info.v_ = info.ip_.y_;
+    info.setDifferentials(ray, Vector(1, 0, 1), Vector(0, 1, 0));
+    info.geom_ = this;
+}
+
+void CsgOp::findAllIntersections(const Ray& ray, Geometry* geom, std::vector<IntersectionInfo>& ips)
 {
+    // each one past the previous (see offsetStart()), with the distances kept from the ray's start
+    Ray next = ray;
     IntersectionInfo info;
     int counter = 30;      // used for safety, if we have a weird geometry it might get in an endless loop
-    while (geom->intersect(ray, info) && counter-- > 0)
+    while (geom->intersect(next, info) && counter-- > 0)
     {
+        info.distance_ = dot(info.ip_ - ray.start_, ray.dir_);
         ips.push_back(info);
-        ray.start_ = info.ip_ + ray.dir_ * 1e-6;
+        next.start_ = info.offsetStart(ray.dir_);
     }
-    for (int i = 1; i < (int) ips.size(); i++)
-        ips[i].distance_ = ips[i - 1].distance_ + ips[i].distance_ + 1e-6;
+}
+
+bool mergeSpans(const SpanList& a, const SpanList& b, unsigned truthTable, SpanList& result)
+{
+    // sweep along the line, merging the crossings of both, and keep those where the result changes
+    result.count_ = 0;
+    int state = 0; // inA * 2 + inB
+    bool predicateNow = truthTable & 1;
+    if (predicateNow && !result.add(-INF, nullptr)) return false; // everything outside both is in
+
+    int i = 0, j = 0;
+    while (i < a.count_ || j < b.count_) {
+        const Crossing* crossing;
+        if (j == b.count_ || (i < a.count_ && a.crossings_[i].distance_ < b.crossings_[j].distance_)) {
+            crossing = &a.crossings_[i++];
+            state ^= 2;
+        } else {
+            crossing = &b.crossings_[j++];
+            state ^= 1;
+        }
+
+        bool predicateNext = (truthTable >> state) & 1;
+        if (predicateNext != predicateNow) {
+            // a span of zero length (e.g. two solids with a common side) cancels out
+            if (result.count_ > 0 && result.crossings_[result.count_ - 1].distance_ == crossing->distance_)
+                result.count_--;
+            else if (!result.add(crossing->distance_, crossing->geom_))
+                return false;
+            predicateNow = predicateNext;
+        }
+    }
+    return true;
+}
+
+unsigned CsgOp::truthTable() const
+{
+    return boolOp(false, false) | boolOp(false, true) << 1 | boolOp(true, false) << 2 | boolOp(true, true) << 3;
+}
+
+bool CsgOp::getSpans(const Ray& ray, SpanList& spans)
+{
+    unsigned table = truthTable();
+    SpanList leftSpans, rightSpans;
+    if (!left_->getSpans(ray, leftSpans)) return false;
+    // the result is empty if the line misses a child it is a subset of
+    if (leftSpans.count_ == 0 && (table & 3) == 0) {
+        spans.count_ = 0;
+        return true;
+    }
+    if (!right_->getSpans(ray, rightSpans)) return false;
+    return mergeSpans(leftSpans, rightSpans, table, spans);
+}
+
+bool CsgOp::prepare()
+{
+    if (state_.load(std::memory_order_acquire) == PREPARED) return true;
+
+    int expected = UNPREPARED;
+    if (!state_.compare_exchange_strong(expected, PREPARING))
+        return false; // another thread is doing it
+    bounded_ = getBBox(box_);
+    program_ = std::make_unique<CsgProgram>();
+    if (!program_->compile(*this)) program_.reset();
+    state_.store(PREPARED, std::memory_order_release);
+    return true;
 }
 
 bool CsgOp::intersect(const Ray& ray, IntersectionInfo& info)
+{
+    SpanList spans;
+    bool haveSpans;
+    if (prepare()) {
+        if (bounded_ && !box_.testIntersect(ray))
+            return false;
+        haveSpans = program_ ? program_->getSpans(ray, spans) : getSpans(ray, spans);
+    } else {
+        haveSpans = getSpans(ray, spans);
+    }
+    if (!haveSpans)
+        return intersectGeneric(ray, info);
+
+    for (int i = 0; i < spans.count_; i++) {
+        const Crossing& crossing = spans.crossings_[i];
+        if (crossing.distance_ <= 0) continue;
+
+        crossing.geom_->getCrossingInfo(ray, crossing.distance_, info);
+        // the primitive's normal points out of it, which may be into the result (e.g. the subtracted one)
+        bool entering = (i % 2 == 0);
+        if (entering == (dot(info.normal_, ray.dir_) > 0))
+            info.normal_ = -info.normal_;
+        return true;
+    }
+    return false;
+}
+
+bool CsgOp::intersectGeneric(const Ray& ray, IntersectionInfo& info)
 {
     std::vector<IntersectionInfo> leftIPs, rightIPs;
     findAllIntersections(ray, left_.get(), leftIPs);
@@ -170,7 +450,161 @@ bool CsgOp::intersect(const Ray& ray, IntersectionInfo& info)
     return false;
 }
 
+bool CsgOp::getBBox(BBox& box) const
+{
+    if (boolOp(false, false)) return false; // everything outside both children is in
+
+    BBox leftBox, rightBox;
+    bool leftBounded = left_->getBBox(leftBox);
+    bool rightBounded = right_->getBBox(rightBox);
+    bool onlyInLeft = !boolOp(false, true);  // the result is a subset of the left child
+    bool onlyInRight = !boolOp(true, false); // the result is a subset of the right child
+
+    if (onlyInLeft && onlyInRight && leftBounded && rightBounded) {
+        for (int axis = 0; axis < 3; axis++) {
+            box.vmin_[axis] = std::max(leftBox.vmin_[axis], rightBox.vmin_[axis]);
+            box.vmax_[axis] = std::min(leftBox.vmax_[axis], rightBox.vmax_[axis]);
+        }
+        if (box.isEmpty()) box = leftBox; // nothing's left; any box would do
+        return true;
+    }
+    if (onlyInLeft && leftBounded) {
+        box = leftBox;
+        return true;
+    }
+    if (onlyInRight && rightBounded) {
+        box = rightBox;
+        return true;
+    }
+    if (!leftBounded || !rightBounded) return false;
+
+    box = leftBox;
+    box.add(rightBox);
+    return true;
+}
+
+CsgOp::CsgOp() = default;
+
 CsgOp::CsgOp(std::unique_ptr<Geometry>& left, std::unique_ptr<Geometry>& right)
     : left_(std::move(left))
     , right_(std::move(right))
     { }
+
+CsgOp::~CsgOp() = default;
+
+bool CsgOp::setParam(const std::string& name, const ParamValues& values)
+{
+    std::string childParam;
+    bool changed = false;
+    if (stripParamPrefix(name, "left", childParam)) changed = left_->setParam(childParam, values);
+    else if (stripParamPrefix(name, "right", childParam)) changed = right_->setParam(childParam, values);
+    if (changed) childrenChanged(); // the box and the program
+    return changed;
+}
+
+void CsgOp::reportMemory(MemoryReport& report) const
+{
+    left_->reportMemory(report);
+    right_->reportMemory(report);
+    if (program_) report.add(MemoryCategory::ACCELERATION, sizeof(CsgProgram) + program_->getMemoryUsage());
+}
+
+void Instance::reset()
+{
+    transform_ = Matrix(1.0);
+    offset_.makeZero();
+    updateInverse();
+}
+
+void Instance::scale(double x, double y, double z)
+{
+    Matrix scaling(1.0);
+    scaling.m_[0][0] = x;
+    scaling.m_[1][1] = y;
+    scaling.m_[2][2] = z;
+    transform_ = transform_ * scaling;
+    offset_ *= scaling;
+    updateInverse();
+}
+
+void Instance::rotate(double yaw, double pitch, double roll)
+{
+    Matrix rotation = rotationAroundZ(toRadians(roll)) *
+                      rotationAroundX(toRadians(pitch)) *
+                      rotationAroundY(toRadians(yaw));
+    transform_ = transform_ * rotation;
+    offset_ *= rotation;
+    updateInverse();
+}
+
+void Instance::translate(const Vector& offset)
+{
+    offset_ += offset;
+}
+
+void Instance::updateInverse()
+{
+    inverseTransform_ = inverseMatrix(transform_);
+    normalTransform_ = transposeMatrix(inverseTransform_);
+    stretch_ = 0;
+    for (int col = 0; col < 3; col++)
+        stretch_ = std::max(stretch_, fabs(transform_.m_[0][col]) + fabs(transform_.m_[1][col]) + fabs(transform_.m_[2][col]));
+}
+
+void Instance::reportMemory(MemoryReport& report) const
+{
+    if (report.countOnce(prototype_.get())) prototype_->reportMemory(report);
+}
+
+bool Instance::getBBox(BBox& box) const
+{
+    BBox protoBox;
+    if (!prototype_->getBBox(protoBox)) return false;
+
+    // the box around the transformed corners of the prototype's box
+    box.makeEmpty();
+    for (int corner = 0; corner < 8; corner++) {
+        Vector point((corner & 1) ? protoBox.vmax_.x_ : protoBox.vmin_.x_,
+                     (corner & 2) ? protoBox.vmax_.y_ : protoBox.vmin_.y_,
+                     (corner & 4) ? protoBox.vmax_.z_ : protoBox.vmin_.z_);
+        box.add(point * transform_ + offset_);
+    }
+    return true;
+}
+
+bool Instance::intersect(const Ray& ray, IntersectionInfo& info)
+{
+    // shoot the ray in the object space of the prototype. The geometries expect a normalized
+    // direction, so the distances there are scaled by the length of the transformed one
+    Ray localRay = ray;
+    localRay.start_ = (ray.start_ - offset_) * inverseTransform_;
+    localRay.dir_ = ray.dir_ * inverseTransform_;
+    double scaling = localRay.dir_.length();
+    localRay.dir_ /= scaling;
+    if (ray.hasDifferentials_) {
+        // the same transform, with the derivatives of the normalization for the directions
+        const RayDifferentials& diff = ray.differentials_;
+        RayDifferentials& localDiff = localRay.differentials_;
+        localDiff.dStartDx_ = diff.dStartDx_ * inverseTransform_;
+        localDiff.dStartDy_ = diff.dStartDy_ * inverseTransform_;
+        Vector dDirDx = diff.dDirDx_ * inverseTransform_, dDirDy = diff.dDirDy_ * inverseTransform_;
+        localDiff.dDirDx_ = (dDirDx - localRay.dir_ * dot(localRay.dir_, dDirDx)) / scaling;
+        localDiff.dDirDy_ = (dDirDy - localRay.dir_ * dot(localRay.dir_, dDirDy)) / scaling;
+    }
+
+    if (!prototype_->intersect(localRay, info))
+        return false;
+
+    // the error of the hit in the object space, stretched by the transform, and that of the point here
+    double localError = info.ipError_;
+    info.setHitPoint(ray, info.distance_ / scaling);
+    info.ipError_ += localError * stretch_;
+    info.normal_ = info.normal_ * normalTransform_;
+    info.normal_.normalize();
+    if (info.hasDifferentials_) { // the u v ones stay as they are
+        info.dpdx_ = info.dpdx_ * transform_;
+        info.dpdy_ = info.dpdy_ * transform_;
+    }
+    info.geom_ = this;
+    return true;
+}
@@ -5,30 +5,108 @@
 #ifndef __GEOMETRY_H__
 #define __GEOMETRY_H__
 
+#include <atomic>
+#include <limits>
 #include <memory>
 #include <vector>
 
 #include "maths/vector.h"
+#include "maths/matrix.h"
 #include "maths/ray.h"
+#include "maths/bbox.h"
+#include "utils/params.h"
+#include "utils/memory.h"
 
 
 class Geometry;
 struct IntersectionInfo
 {
+    /// the bound on the rounding error of a hit point, relative to how far it is from the origin plus how far
+    /// the ray went: a few roundings for start + dir * distance, a few more for the distance itself, and
+    /// some to spare for the transforms of instances
+    static constexpr double HIT_ERROR = 64 * std::numeric_limits<double>::epsilon();
+
     Vector ip_;
     Vector normal_;
     double distance_;
+    double ipError_; // how far ip_ may be from the true surface, in each coordinate (see setHitPoint)
     double u_, v_;   // u v coords used for texturing
     Geometry* geom_;
+
+    // the footprint of the ray's pixel: how the hit point and its u v coords change from one pixel to the
+    // next. Only set if hasDifferentials_ (the ray had differentials), else the hit is taken as a point
+    bool hasDifferentials_;
+    Vector dpdx_, dpdy_;
+    double dudx_, dudy_, dvdx_, dvdy_;
+
+    /// sets the differentials from the ray's (ip_ and normal_ must be set already): where the neighbouring
+    /// pixels' rays cross the tangent plane, and the u v coords there, with the surface's u v mapping taken
+    /// as linear, given by the gradients of u and v
+    void setDifferentials(const Ray& ray, const Vector& gradU, const Vector& gradV);
+
+    /// sets distance_ and ip_ for a hit that far along the ray, and the error bound of ip_
+    void setHitPoint(const Ray& ray, double distance);
+    /// the start of a ray leaving the hit in the direction dir: ip_, moved along the normal just past its error
+    /// bound, to the side dir goes to. Scales with the scene, unlike a fixed epsilon, so the ray neither hits the
+    /// same surface right away (acne) nor starts on the far side of a thin wall (leaks)
+    Vector offsetStart(const Vector& dir) const;
+};
+
+/// a point where the line of a ray crosses the surface of a solid
+struct Crossing
+{
+    double distance_; // along the ray; negative if it is behind the start
+    Geometry* geom_;  // the primitive whose surface is crossed
+};
+
+/// the parts of the line of a ray inside a solid: a sorted list of crossings, entering the solid
+/// at the even ones and leaving it at the odd ones. It has a fixed capacity, to live on the stack
+struct SpanList
+{
+    static constexpr int MAX_CROSSINGS = 32;
+
+    Crossing crossings_[MAX_CROSSINGS];
+    int count_ = 0;
+
+    /// returns false if there's no more room
+    bool add(double distance, Geometry* geom)
+    {
+        if (count_ == MAX_CROSSINGS) return false;
+        crossings_[count_++] = {distance, geom};
+        return true;
+    }
 };
 
+/// combines the spans of two solids A and B with a boolean operation, given as a truth table: bit (inA * 2 + inB)
+/// tells if a point is in the result. Returns false if the result doesn't fit in a SpanList
+bool mergeSpans(const SpanList& a, const SpanList& b, unsigned truthTable, SpanList& result);
+
 class Geometry
 {
 public:
     virtual ~Geometry() = default;
 
+    /// the geometries live in the scene's arena (see getSceneArena()), and are freed with it
+    static void* operator new(size_t size) { return getSceneArena().allocate(size, MemoryCategory::PRIMITIVES); }
+    static void operator delete(void*) {}
+
     virtual bool intersect(const Ray& ray, IntersectionInfo& info) = 0;
+    /// gets the bounding box of the geometry. Returns false if it is unbounded
+    virtual bool getBBox(BBox& box) const = 0;
 
+    /// for solids: finds where the whole line of the ray (behind its start too) is inside the geometry,
+    /// in closed form. This is what CSG combines. Returns false if not supported (the default)
+    virtual bool getSpans(const Ray& ray, SpanList& spans) { return false; }
+    virtual bool hasSpans() const { return false; } //!< whether getSpans() is supported
+    /// the intersection info for one of the crossings found by getSpans(). The normal points out of the solid
+    virtual void getCrossingInfo(const Ray& ray, double distance, IntersectionInfo& info) {}
+
+    /// sets a parameter by name, e.g. "center" (see SceneParams). Returns false if there's no such parameter
+    /// or the values don't fit it. Update the acceleration structure over the geometry afterwards
+    virtual bool setParam(const std::string& name, const ParamValues& values) { return false; }
+    /// adds the memory the geometry holds outside of itself (e.g. a mesh's arrays and BVH) to the report.
+    /// The geometry objects themselves are counted by the arena
+    virtual void reportMemory(MemoryReport& report) const {}
 };
 
 class Plane : public Geometry
@@ -40,6 +118,12 @@ public:
 
 
     bool intersect(const Ray& ray, IntersectionInfo& info) override;
+    bool getBBox(BBox& box) const override { return false; }
+    /// as a solid, the plane is the half-space below it
+    bool getSpans(const Ray& ray, SpanList& spans) override;
+    bool hasSpans() const override { return true; }
+    void getCrossingInfo(const Ray& ray, double distance, IntersectionInfo& info) override;
+    bool setParam(const std::string& name, const ParamValues& values) override; //!< y
 
 public:
     double y_; // the plane will always be || XZ plane
@@ -55,7 +139,14 @@ public:
     ~Sphere() = default;
 
     bool intersect(const Ray& ray, IntersectionInfo& info) override;
+    bool getBBox(BBox& box) const override;
+    bool getSpans(const Ray& ray, SpanList& spans) override;
+    bool hasSpans() const override { return true; }
+    void getCrossingInfo(const Ray& ray, double distance, IntersectionInfo& info) override;
+    bool setParam(const std::string& name, const ParamValues& values) override; //!< center, radius
 private:
+    void setUV(const Ray& ray, IntersectionInfo& info) const; //!< and the differentials
+
     Vector center_;
     float radius_;
 };
@@ -70,44 +161,105 @@ public:
     ~Cube() = default;
 
     bool intersect(const Ray& ray, IntersectionInfo& info) override;
-    bool intersectSide(double level, double start, double dir, const Ray& ray, const Vector& normal, IntersectionInfo& info);
+    bool getBBox(BBox& box) const override;
+    bool getSpans(const Ray& ray, SpanList& spans) override;
+    bool hasSpans() const override { return true; }
+    void getCrossingInfo(const Ray& ray, double distance, IntersectionInfo& info) override;
+    bool setParam(const std::string& name, const ParamValues& values) override; //!< center, halfSide
 
 private:
+    /// the slab test over the whole line of the ray: where it enters the cube, through a side across nearAxis,
+    /// and where it leaves, across farAxis. Returns false if it misses it
+    bool clipLine(const Ray& ray, double& tNear, int& nearAxis, double& tFar, int& farAxis) const;
+
     Vector center_;
     float halfSide_;
 };
 
+class CsgProgram;
+
+/// A boolean operation over two solids. If all the primitives in the tree support getSpans() (spheres, cubes,
+/// planes) the tree is flattened into a CsgProgram, which combines their spans in closed form; otherwise the
+/// children are intersected repeatedly to find all of their surfaces along the ray
 class CsgOp: public Geometry
 {
-    void findAllIntersections(Ray ray, Geometry* geom, std::vector<IntersectionInfo>& ips);
+    void findAllIntersections(const Ray& ray, Geometry* geom, std::vector<IntersectionInfo>& ips);
+    bool intersectGeneric(const Ray& ray, IntersectionInfo& info);
+    bool prepare();
 public:
-    CsgOp() = default;
+    CsgOp();
     CsgOp(std::unique_ptr<Geometry>& left, std::unique_ptr<Geometry>& right);
+    ~CsgOp();
     std::unique_ptr<Geometry> left_, right_;
-    virtual bool boolOp(bool inA, bool inB) = 0;
+    virtual bool boolOp(bool inA, bool inB) const = 0;
+    unsigned truthTable() const; //!< boolOp() as a truth table, as in mergeSpans()
 
     bool intersect(const Ray& ray, IntersectionInfo& info);
+    bool getBBox(BBox& box) const override;
+    bool getSpans(const Ray& ray, SpanList& spans) override;
+    bool hasSpans() const override { return left_->hasSpans() && right_->hasSpans(); }
+    /// the children's parameters, as "left.radius", "right.center"...
+    bool setParam(const std::string& name, const ParamValues& values) override;
+
+    void childrenChanged() { state_ = UNPREPARED; } //!< call after changing the tree once rendering has started
+    void reportMemory(MemoryReport& report) const override; //!< the children's, and the program, once made
+
+private:
+    enum { UNPREPARED, PREPARING, PREPARED };
+    std::atomic<int> state_{UNPREPARED}; // the bounding box and the program are made on first use
+    BBox box_;
+    bool bounded_ = false;
+    std::unique_ptr<CsgProgram> program_; // null if the tree can't be compiled
 };
 
 class CsgAnd: public CsgOp {
 public:
     CsgAnd() = default;
     CsgAnd(std::unique_ptr<Geometry>& left, std::unique_ptr<Geometry>& right) : CsgOp(left, right) {}
-    bool boolOp(bool inA, bool inB) { return inA && inB; }
+    bool boolOp(bool inA, bool inB) const override { return inA && inB; }
 };
 
 class CsgPlus: public CsgOp {
 public:
     CsgPlus() = default;
     CsgPlus(std::unique_ptr<Geometry>& left, std::unique_ptr<Geometry>& right) : CsgOp(left, right) {}
-    bool boolOp(bool inA, bool inB) { return inA || inB; }
+    bool boolOp(bool inA, bool inB) const override { return inA || inB; }
 };
 
 class CsgMinus: public CsgOp {
 public:
     CsgMinus() = default;
     CsgMinus(std::unique_ptr<Geometry>& left, std::unique_ptr<Geometry>& right) : CsgOp(left, right) {}
-    bool boolOp(bool inA, bool inB) { return inA && !inB; }
+    bool boolOp(bool inA, bool inB) const override { return inA && !inB; }
+};
+
+/// Places a prototype geometry (a primitive, a CSG tree, a mesh...) in the scene with an affine
+/// transform. Many instances may share one prototype, so only the transform is stored per instance.
+/// The transforms are applied in the order they are called: e.g. scale, then rotate, then translate
+class Instance: public Geometry {
+public:
+    Instance(std::shared_ptr<Geometry> prototype)
+    : prototype_(std::move(prototype)) { reset(); }
+
+    void reset(); //!< sets the identity transform
+    void scale(double x, double y, double z);
+    void rotate(double yaw, double pitch, double roll); //!< angles are in degrees, as in the Camera
+    void translate(const Vector& offset);
+
+    bool intersect(const Ray& ray, IntersectionInfo& info) override;
+    bool getBBox(BBox& box) const override;
+    void reportMemory(MemoryReport& report) const override; //!< the prototype's, once for all its instances
+
+    std::shared_ptr<Geometry> prototype_;
+
+private:
+    void updateInverse();
+
+    Matrix transform_;         // object space -> world space, without the translation
+    Matrix inverseTransform_;  // world space -> object space
+    Matrix normalTransform_;   // transposed inverse, for transforming the normals
+    Vector offset_;            // the translation
+    double stretch_;           // how much transform_ may lengthen a coordinate (its largest column sum), for the error bounds
 };
 
 
@@ -0,0 +1,244 @@
+/**
+ * @File leak_test.cpp
+ * @Brief The test solids and the ray walks of the leak test.
+ */
+#include "leak_test.h"
+
+#include <stdio.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+
+#include "geometry.h"
+#include "mesh.h"
+#include "utils/random.h"
+#include "utils/thread_pool.h"
+#include "utils/util.h"
+
+namespace {
+
+constexpr int MAX_HITS = 16;     // no solid here has more along a line; more is runaway acne
+constexpr int CHUNK_SIZE = 4096; // rays per task, each with its own random stream
+
+/// a closed solid to fire at, with the ground truth for the checks
+struct TestSolid
+{
+    const char* name_;
+    std::shared_ptr<Geometry> geometry_;
+    bool convex_;
+    std::function<bool(const Vector&)> inside_;      //!< whether the point is in the solid
+    std::function<Vector(Random&)> randomFeature_;   //!< a random point on an edge or the silhouette, to aim at
+};
+
+struct Failures
+{
+    std::atomic<long long> leaks_{0}, wrongCounts_{0}, selfHits_{0};
+};
+
+Vector randomDirection(Random& rng)
+{
+    double z = 1 - 2 * rng.randomDouble(), phi = 2 * PI * rng.randomDouble();
+    double r = sqrt(std::max(0.0, 1 - z * z));
+    return Vector(r * cos(phi), r * sin(phi), z);
+}
+
+/// a random point on one of the 12 edges of the box
+Vector randomEdgePoint(Random& rng, const Vector& lo, const Vector& hi)
+{
+    int along = rng.randomInt(3);
+    Vector point;
+    for (int axis = 0; axis < 3; axis++) {
+        if (axis == along) point[axis] = lo[axis] + (hi[axis] - lo[axis]) * rng.randomDouble();
+        else point[axis] = rng.randomInt(2) ? hi[axis] : lo[axis];
+    }
+    return point;
+}
+
+bool insideBox(const Vector& point, const Vector& lo, const Vector& hi)
+{
+    return lo.x_ < point.x_ && point.x_ < hi.x_ && lo.y_ < point.y_ && point.y_ < hi.y_ &&
+           lo.z_ < point.z_ && point.z_ < hi.z_;
+}
+
+/// a mesh of a box, 2 triangles per side, wound so that the normals point out. Its corners are vertices_[0] (lo)
+/// and vertices_[7] (hi)
+std::unique_ptr<Mesh> makeMeshBox(const Vector& lo, const Vector& hi)
+{
+    auto mesh = std::make_unique<Mesh>();
+    for (int corner = 0; corner < 8; corner++) {
+        mesh->vertices_.push_back({float((corner & 1) ? hi.x_ : lo.x_), float((corner & 2) ? hi.y_ : lo.y_),
+                                   float((corner & 4) ? hi.z_ : lo.z_)});
+    }
+    static const int quads[6][4] = {
+        {0, 4, 6, 2}, {1, 3, 7, 5}, {0, 1, 5, 4}, {2, 6, 7, 3}, {0, 2, 3, 1}, {4, 5, 7, 6},
+    };
+    for (const auto& quad : quads) {
+        mesh->triangles_.push_back({{quad[0], quad[1], quad[2]}, {-1, -1, -1}, {-1, -1, -1}});
+        mesh->triangles_.push_back({{quad[0], quad[2], quad[3]}, {-1, -1, -1}, {-1, -1, -1}});
+    }
+    mesh->buildBvh();
+    return mesh;
+}
+
+/// the solids, of about the given size (the distance from the center to the surface) around the center
+std::vector<TestSolid> makeSolids(const Vector& center, double size)
+{
+    std::vector<TestSolid> solids;
+
+    // the primitives keep their sizes as floats; the ground truth uses the same values
+    double radius = float(size), halfSide = float(size), holeRadius = float(0.8 * size);
+    Vector extent(halfSide, halfSide, halfSide);
+    Vector lo = center - extent, hi = center + extent;
+
+    auto inSphere = [center] (const Vector& point, double r) { return (point - center).lengthSqr() < r * r; };
+    auto onSphere = [center] (Random& rng, double r) { return center + randomDirection(rng) * r; };
+
+    solids.push_back({"sphere", std::make_shared<Sphere>(center, float(size)), true,
+                      [=] (const Vector& point) { return inSphere(point, radius); },
+                      [=] (Random& rng) { return onSphere(rng, radius); }});
+
+    solids.push_back({"cube", std::make_shared<Cube>(center, float(size)), true,
+                      [=] (const Vector& point) { return insideBox(point, lo, hi); },
+                      [=] (Random& rng) { return randomEdgePoint(rng, lo, hi); }});
+
+    // the mesh keeps its vertices as floats; the ground truth takes them from there
+    std::shared_ptr<Mesh> mesh = makeMeshBox(lo, hi);
+    Vector meshLo = mesh->vertices_[0].toVector(), meshHi = mesh->vertices_[7].toVector();
+    solids.push_back({"mesh", mesh, true,
+                      [=] (const Vector& point) { return insideBox(point, meshLo, meshHi); },
+                      [=] (Random& rng) { return randomEdgePoint(rng, meshLo, meshHi); }});
+
+    // a unit sphere, stretched unevenly and rotated, the same way Instance does it
+    auto instance = std::make_shared<Instance>(std::make_shared<Sphere>(Vector(0, 0, 0), 1.0f));
+    instance->scale(size, size * 0.5, size * 2);
+    instance->rotate(30, 45, 60);
+    instance->translate(center);
+    Matrix scaling(1.0);
+    scaling.m_[0][0] = size;
+    scaling.m_[1][1] = size * 0.5;
+    scaling.m_[2][2] = size * 2;
+    Matrix transform = scaling * (rotationAroundZ(toRadians(60)) * rotationAroundX(toRadians(45)) *
+                                  rotationAroundY(toRadians(30)));
+    Matrix inverse = inverseMatrix(transform);
+    solids.push_back({"instance", instance, true,
+                      [=] (const Vector& point) { return ((point - center) * inverse).lengthSqr() < 1; },
+                      [=] (Random& rng) { return randomDirection(rng) * transform + center; }});
+
+    // a cube with a spherical hole in the middle: a closed solid with an inner surface
+    auto inHollowCube = [=] (const Vector& point, const Vector& boxLo, const Vector& boxHi) {
+        return insideBox(point, boxLo, boxHi) && !inSphere(point, holeRadius);
+    };
+    auto hollowCubeFeature = [=] (Random& rng, const Vector& boxLo, const Vector& boxHi) {
+        return rng.randomInt(2) ? randomEdgePoint(rng, boxLo, boxHi) : onSphere(rng, holeRadius);
+    };
+    {
+        std::unique_ptr<Geometry> cube = std::make_unique<Cube>(center, float(size));
+        std::unique_ptr<Geometry> hole = std::make_unique<Sphere>(center, float(0.8 * size));
+        solids.push_back({"csg", std::make_shared<CsgMinus>(cube, hole), false,
+                          [=] (const Vector& point) { return inHollowCube(point, lo, hi); },
+                          [=] (Random& rng) { return hollowCubeFeature(rng, lo, hi); }});
+    }
+    { // the mesh has no spans, so this one re-shoots the children (CsgOp::intersectGeneric)
+        std::unique_ptr<Geometry> cube = makeMeshBox(lo, hi);
+        std::unique_ptr<Geometry> hole = std::make_unique<Sphere>(center, float(0.8 * size));
+        solids.push_back({"csg generic", std::make_shared<CsgMinus>(cube, hole), false,
+                          [=] (const Vector& point) { return inHollowCube(point, meshLo, meshHi); },
+                          [=] (Random& rng) { return hollowCubeFeature(rng, meshLo, meshHi); }});
+    }
+    return solids;
+}
+
+/// follows the ray through all of its hits with the solid; returns their count. The first one goes to `first`
+int walkHits(Geometry& geometry, Ray ray, IntersectionInfo& first)
+{
+    IntersectionInfo info;
+    int hits = 0;
+    while (hits < MAX_HITS && geometry.intersect(ray, info)) {
+        if (hits == 0) first = info;
+        hits++;
+        ray.start_ = info.offsetStart(ray.dir_);
+    }
+    return hits;
+}
+
+void fireRays(const TestSolid& solid, const Vector& center, double size, Random& rng, int count, Failures& failures)
+{
+    Geometry& geometry = *solid.geometry_;
+    for (int i = 0; i < count; i++) {
+        // from anywhere around the solid: random, or aimed at its edges, where the gaps would be
+        Ray ray;
+        ray.start_ = center + Vector(rng.randomDouble() - 0.5, rng.randomDouble() - 0.5, rng.randomDouble() - 0.5) * (6 * size);
+        if (rng.randomInt(2)) {
+            ray.dir_ = randomDirection(rng);
+        } else {
+            // exactly at an edge, the ray may only touch the solid, where no answer is wrong; so a bit off it.
+            // Still well past the error bounds of the hits: a corner cut thinner than them is beyond resolving
+            double scale = size + std::max(fabs(center.x_), std::max(fabs(center.y_), fabs(center.z_)));
+            Vector target = solid.randomFeature_(rng) + randomDirection(rng) * (scale * pow(10, -10 + 6 * rng.randomDouble()));
+            ray.dir_ = target - ray.start_;
+            if (ray.dir_.lengthSqr() == 0) continue;
+            ray.dir_.normalize();
+        }
+
+        bool startsInside = solid.inside_(ray.start_);
+        IntersectionInfo first;
+        int hits = walkHits(geometry, ray, first);
+        if (startsInside && hits == 0) {
+            failures.leaks_++;
+            continue;
+        }
+        if (hits % 2 != (startsInside ? 1 : 0) || hits == MAX_HITS) {
+            failures.wrongCounts_++;
+            continue;
+        }
+
+        // leaving the outside of a convex solid, away from it, there's nothing more to hit
+        if (solid.convex_ && !startsInside && hits > 0) {
+            Vector outward = faceforward(ray.dir_, first.normal_);
+            Vector dir = randomDirection(rng);
+            if (dot(dir, outward) < 0) dir = -dir;
+            Ray leaving;
+            leaving.start_ = first.offsetStart(dir);
+            leaving.dir_ = dir;
+            IntersectionInfo info;
+            if (geometry.intersect(leaving, info)) failures.selfHits_++;
+        }
+    }
+}
+
+} // namespace
+
+bool runLeakTest(long long numRays)
+{
+    const double sizes[] = {1e-6, 1e-3, 1, 1e3, 1e5};
+    const double distances[] = {0, 1e4}; // of the center from the origin, in sizes
+    const int numSolids = int(makeSolids(Vector(0, 0, 0), 1).size());
+    long long raysPerCase = std::max(1LL, numRays / (numSolids * 5 * 2));
+    printf("Leak test: %lld rays per solid and scale\n", raysPerCase);
+
+    long long totalFailures = 0;
+    int caseIndex = 0;
+    for (double size : sizes) {
+        for (double distance : distances) {
+            Vector center = Vector(1, 0.7, 0.3) * (distance * size);
+            for (const TestSolid& solid : makeSolids(center, size)) {
+                Failures failures;
+                int numChunks = int((raysPerCase + CHUNK_SIZE - 1) / CHUNK_SIZE);
+                ThreadPool::instance().parallelFor(numChunks, [&] (int chunk) {
+                    Random rng(hash32(caseIndex * 65537 + chunk), caseIndex);
+                    int count = int(std::min<long long>(CHUNK_SIZE, raysPerCase - (long long) chunk * CHUNK_SIZE));
+                    fireRays(solid, center, size, rng, count, failures);
+                });
+                caseIndex++;
+
+                long long failed = failures.leaks_ + failures.wrongCounts_ + failures.selfHits_;
+                totalFailures += failed;
+                printf("  %-12s size %-6g at %-6g: %lld leaks, %lld wrong hit counts, %lld self-hits\n", solid.name_,
+                       size, distance * size, failures.leaks_.load(), failures.wrongCounts_.load(),
+                       failures.selfHits_.load());
+            }
+        }
+    }
+    printf("Leak test %s: %lld failures\n", totalFailures ? "FAILED" : "passed", totalFailures);
+    return totalFailures == 0;
+}
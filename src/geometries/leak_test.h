@@ -0,0 +1,19 @@
+/**
+ * @File leak_test.h
+ * @Brief A self-check of the intersection code, firing random rays at closed solids.
+ */
+#ifndef __LEAK_TEST_H__
+#define __LEAK_TEST_H__
+
+/// Fires random rays at the closed solids (a sphere, a cube, a mesh cube, a transformed instance and CSG trees,
+/// both the closed-form and the generic ones), at sizes from 1e-6 to 1e5, at the origin and 1e4 sizes away from
+/// it, and walks each ray through all of its hits, re-shooting from IntersectionInfo::offsetStart(). Half of
+/// the rays are aimed at the edges and the silhouettes, where the gaps would be. Checks that:
+///  - a ray starting inside a solid hits it (else it leaked out),
+///  - the number of hits along a ray is odd if it starts inside, even if outside; an extra hit is acne (the
+///    surface hit again right where the ray left it), a missing one is a leak,
+///  - rays leaving a convex solid's outside, in any direction away from it, don't hit it again.
+/// Prints the failure counts per solid and scale. Returns true if there were none
+bool runLeakTest(long long numRays);
+
+#endif // __LEAK_TEST_H__
@@ -0,0 +1,515 @@
+/**
+ * @File mesh.cpp
+ * @Brief Contains the implementation of the triangle mesh geometry and its .OBJ loader.
+ */
+#include "mesh.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "utils/constants.h"
+#include "utils/thread_pool.h"
+
+/// the 4 lanes of a TrianglePacket as doubles: one AVX register, two SSE2 ones, or plain C++ on other CPUs.
+/// The comparisons give all-ones/all-zeros masks, mask() packs their signs into the low 4 bits
+#if defined(__AVX__)
+struct Lanes
+{
+    __m256d v;
+
+    static Lanes load(const float* p) { return { _mm256_cvtps_pd(_mm_load_ps(p)) }; }
+    static Lanes broadcast(double x) { return { _mm256_set1_pd(x) }; }
+    void store(double* p) const { _mm256_storeu_pd(p, v); }
+    int mask() const { return _mm256_movemask_pd(v); }
+
+    Lanes operator+(Lanes b) const { return { _mm256_add_pd(v, b.v) }; }
+    Lanes operator-(Lanes b) const { return { _mm256_sub_pd(v, b.v) }; }
+    Lanes operator*(Lanes b) const { return { _mm256_mul_pd(v, b.v) }; }
+    Lanes operator/(Lanes b) const { return { _mm256_div_pd(v, b.v) }; }
+    Lanes operator|(Lanes b) const { return { _mm256_or_pd(v, b.v) }; }
+    Lanes operator&(Lanes b) const { return { _mm256_and_pd(v, b.v) }; }
+    Lanes operator<(Lanes b) const { return { _mm256_cmp_pd(v, b.v, _CMP_LT_OQ) }; }
+    Lanes operator>(Lanes b) const { return { _mm256_cmp_pd(v, b.v, _CMP_GT_OQ) }; }
+    Lanes operator<=(Lanes b) const { return { _mm256_cmp_pd(v, b.v, _CMP_LE_OQ) }; }
+    Lanes operator>=(Lanes b) const { return { _mm256_cmp_pd(v, b.v, _CMP_GE_OQ) }; }
+    Lanes operator==(Lanes b) const { return { _mm256_cmp_pd(v, b.v, _CMP_EQ_OQ) }; }
+    /// where the mask is set, a; elsewhere b
+    static Lanes select(Lanes mask, Lanes a, Lanes b) { return { _mm256_blendv_pd(b.v, a.v, mask.v) }; }
+};
+#elif defined(__SSE2__)
+struct Lanes
+{
+    __m128d lo, hi;
+
+    static Lanes load(const float* p)
+    {
+        __m128 f = _mm_load_ps(p);
+        return { _mm_cvtps_pd(f), _mm_cvtps_pd(_mm_movehl_ps(f, f)) };
+    }
+    static Lanes broadcast(double x) { return { _mm_set1_pd(x), _mm_set1_pd(x) }; }
+    void store(double* p) const { _mm_storeu_pd(p, lo); _mm_storeu_pd(p + 2, hi); }
+    int mask() const { return _mm_movemask_pd(lo) | (_mm_movemask_pd(hi) << 2); }
+
+    Lanes operator+(Lanes b) const { return { _mm_add_pd(lo, b.lo), _mm_add_pd(hi, b.hi) }; }
+    Lanes operator-(Lanes b) const { return { _mm_sub_pd(lo, b.lo), _mm_sub_pd(hi, b.hi) }; }
+    Lanes operator*(Lanes b) const { return { _mm_mul_pd(lo, b.lo), _mm_mul_pd(hi, b.hi) }; }
+    Lanes operator/(Lanes b) const { return { _mm_div_pd(lo, b.lo), _mm_div_pd(hi, b.hi) }; }
+    Lanes operator|(Lanes b) const { return { _mm_or_pd(lo, b.lo), _mm_or_pd(hi, b.hi) }; }
+    Lanes operator&(Lanes b) const { return { _mm_and_pd(lo, b.lo), _mm_and_pd(hi, b.hi) }; }
+    Lanes operator<(Lanes b) const { return { _mm_cmplt_pd(lo, b.lo), _mm_cmplt_pd(hi, b.hi) }; }
+    Lanes operator>(Lanes b) const { return { _mm_cmpgt_pd(lo, b.lo), _mm_cmpgt_pd(hi, b.hi) }; }
+    Lanes operator<=(Lanes b) const { return { _mm_cmple_pd(lo, b.lo), _mm_cmple_pd(hi, b.hi) }; }
+    Lanes operator>=(Lanes b) const { return { _mm_cmpge_pd(lo, b.lo), _mm_cmpge_pd(hi, b.hi) }; }
+    Lanes operator==(Lanes b) const { return { _mm_cmpeq_pd(lo, b.lo), _mm_cmpeq_pd(hi, b.hi) }; }
+    static Lanes select(Lanes mask, Lanes a, Lanes b)
+    {
+        return { _mm_or_pd(_mm_and_pd(mask.lo, a.lo), _mm_andnot_pd(mask.lo, b.lo)),
+                 _mm_or_pd(_mm_and_pd(mask.hi, a.hi), _mm_andnot_pd(mask.hi, b.hi)) };
+    }
+};
+#else
+struct Lanes
+{
+    double v[4];
+    bool m[4]; // set by the comparisons, used by mask(), select(), | and &
+
+    template <typename Op>
+    static Lanes map(const Lanes& a, const Lanes& b, Op op)
+    {
+        Lanes r = {};
+        for (int i = 0; i < 4; i++) op(a, b, r, i);
+        return r;
+    }
+
+    static Lanes load(const float* p) { return { { p[0], p[1], p[2], p[3] }, {} }; }
+    static Lanes broadcast(double x) { return { { x, x, x, x }, {} }; }
+    void store(double* p) const { for (int i = 0; i < 4; i++) p[i] = v[i]; }
+    int mask() const { return m[0] | (m[1] << 1) | (m[2] << 2) | (m[3] << 3); }
+
+#define LANES_ARITHMETIC(op) \
+    Lanes operator op(const Lanes& b) const \
+    { return map(*this, b, [] (const Lanes& a, const Lanes& b, Lanes& r, int i) { r.v[i] = a.v[i] op b.v[i]; }); }
+#define LANES_COMPARISON(op) \
+    Lanes operator op(const Lanes& b) const \
+    { return map(*this, b, [] (const Lanes& a, const Lanes& b, Lanes& r, int i) { r.m[i] = a.v[i] op b.v[i]; }); }
+#define LANES_LOGIC(op, scalarOp) \
+    Lanes operator op(const Lanes& b) const \
+    { return map(*this, b, [] (const Lanes& a, const Lanes& b, Lanes& r, int i) { r.m[i] = a.m[i] scalarOp b.m[i]; }); }
+    LANES_ARITHMETIC(+) LANES_ARITHMETIC(-) LANES_ARITHMETIC(*) LANES_ARITHMETIC(/)
+    LANES_COMPARISON(<) LANES_COMPARISON(>) LANES_COMPARISON(<=) LANES_COMPARISON(>=) LANES_COMPARISON(==)
+    LANES_LOGIC(|, ||) LANES_LOGIC(&, &&)
+#undef LANES_ARITHMETIC
+#undef LANES_COMPARISON
+#undef LANES_LOGIC
+
+    static Lanes select(const Lanes& mask, const Lanes& a, const Lanes& b)
+    {
+        Lanes r = {};
+        for (int i = 0; i < 4; i++) {
+            r.v[i] = mask.m[i] ? a.v[i] : b.v[i];
+            r.m[i] = mask.m[i] ? a.m[i] : b.m[i];
+        }
+        return r;
+    }
+};
+#endif
+
+/// the per-ray part of the watertight ray/triangle test (Woop, Benthin, Wald, "Watertight
+/// Ray/Triangle Intersection", JCGT 2013): the ray is sheared so that it becomes the +Z axis,
+/// then the triangle edges are tested in 2D. Rays through an edge or a vertex hit exactly
+/// one of the triangles sharing it, so there are no cracks in the mesh. The triangles are
+/// tested a TrianglePacket at a time, in double precision, like the rest of the geometries
+struct WatertightRay
+{
+    int kx, ky, kz;
+    double sx, sy, sz;
+    Vector start;
+
+    WatertightRay(const Ray& ray)
+    : start(ray.start_)
+    {
+        Vector absDir(fabs(ray.dir_.x_), fabs(ray.dir_.y_), fabs(ray.dir_.z_));
+        kz = absDir.x_ > absDir.y_ ? (absDir.x_ > absDir.z_ ? 0 : 2) : (absDir.y_ > absDir.z_ ? 1 : 2);
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+        if (ray.dir_[kz] < 0) std::swap(kx, ky); // keep the winding of the triangles
+
+        sx = ray.dir_[kx] / ray.dir_[kz];
+        sy = ray.dir_[ky] / ray.dir_[kz];
+        sz = 1.0 / ray.dir_[kz];
+    }
+
+    /// tests the triangles of the packet; returns a bit mask of those hit closer than maxDist, and fills in
+    /// their distances and the barycentric coordinates of the hits (b1 is the weight of the second vertex,
+    /// b2 of the third)
+    int intersect(const TrianglePacket& packet, double maxDist, double dist[4], double b1[4], double b2[4]) const
+    {
+        // the corners relative to the ray start, sheared: (x, y) in the 2D of the test, z along the ray
+        Lanes startX = Lanes::broadcast(start[kx]), startY = Lanes::broadcast(start[ky]);
+        Lanes startZ = Lanes::broadcast(start[kz]);
+        Lanes shearX = Lanes::broadcast(sx), shearY = Lanes::broadcast(sy), scaleZ = Lanes::broadcast(sz);
+        Lanes x[3], y[3], z[3];
+        for (int corner = 0; corner < 3; corner++) {
+            z[corner] = Lanes::load(packet.v_[corner][kz]) - startZ;
+            x[corner] = (Lanes::load(packet.v_[corner][kx]) - startX) - shearX * z[corner];
+            y[corner] = (Lanes::load(packet.v_[corner][ky]) - startY) - shearY * z[corner];
+        }
+
+        // scaled barycentric coordinates
+        Lanes u = x[2] * y[1] - y[2] * x[1];
+        Lanes v = x[0] * y[2] - y[0] * x[2];
+        Lanes w = x[1] * y[0] - y[1] * x[0];
+        Lanes zero = Lanes::broadcast(0);
+        Lanes miss = ((u < zero) | (v < zero) | (w < zero)) & ((u > zero) | (v > zero) | (w > zero));
+
+        Lanes det = u + v + w;
+        miss = miss | (det == zero);
+
+        // scaled distance, compared against the range without dividing yet
+        Lanes t = u * (scaleZ * z[0]) + v * (scaleZ * z[1]) + w * (scaleZ * z[2]);
+        Lanes maxT = Lanes::broadcast(maxDist) * det;
+        Lanes outOfRange = Lanes::select(det < zero, (t >= zero) | (t < maxT), (t <= zero) | (t > maxT));
+        int hits = ~(miss | outOfRange).mask() & 0xf;
+        if (!hits) return 0;
+
+        Lanes invDet = Lanes::broadcast(1.0) / det;
+        (t * invDet).store(dist);
+        (v * invDet).store(b1);
+        (w * invDet).store(b2);
+        return hits;
+    }
+};
+
+void Mesh::buildBvh()
+{
+    std::vector<BBox> boxes(triangles_.size());
+    ThreadPool::instance().parallelFor(int(triangles_.size() + 4095) / 4096, [&] (int block) {
+        int end = std::min(int(triangles_.size()), (block + 1) * 4096);
+        for (int i = block * 4096; i < end; i++) {
+            boxes[i].makeEmpty();
+            for (int j = 0; j < 3; j++)
+                boxes[i].add(vertices_[triangles_[i].v_[j]].toVector());
+        }
+    });
+    bvh_.build(boxes, TrianglePacket::LANES, bvhQuality_, TrianglePacket::LANES);
+
+    // lay out the triangles of the leaves in packets; a leaf has up to 4 of them, unless the builder couldn't
+    // split it (e.g. all of its triangles have the same centroid)
+    packets_.clear();
+    leafPackets_.assign(bvh_.nodes_.size(), -1);
+    for (int index = 0; index < int(bvh_.nodes_.size()); index++) {
+        const BvhNode& node = bvh_.nodes_[index];
+        if (node.count_ == 0) continue;
+        leafPackets_[index] = int(packets_.size());
+        for (int first = 0; first < node.count_; first += TrianglePacket::LANES) {
+            TrianglePacket packet = {};
+            for (int lane = 0; lane < TrianglePacket::LANES; lane++) {
+                int i = first + lane;
+                packet.tri_[lane] = i < node.count_ ? bvh_.primIndices_[node.first_ + i] : -1;
+                if (packet.tri_[lane] < 0) continue;
+                for (int corner = 0; corner < 3; corner++) {
+                    const Float3& vertex = vertices_[triangles_[packet.tri_[lane]].v_[corner]];
+                    packet.v_[corner][0][lane] = vertex.x_;
+                    packet.v_[corner][1][lane] = vertex.y_;
+                    packet.v_[corner][2][lane] = vertex.z_;
+                }
+            }
+            packets_.push_back(packet);
+        }
+    }
+}
+
+bool Mesh::getBBox(BBox& box) const
+{
+    if (bvh_.isEmpty()) {
+        box = BBox(Vector(0, 0, 0), Vector(0, 0, 0));
+        return true;
+    }
+    box = bvh_.getBBox();
+    return true;
+}
+
+void Mesh::reportMemory(MemoryReport& report) const
+{
+    report.add(MemoryCategory::PRIMITIVES,
+               vectorBytes(vertices_) + vectorBytes(normals_) + vectorBytes(uvs_) + vectorBytes(triangles_));
+    report.add(MemoryCategory::ACCELERATION, bvh_.getMemoryUsage() + vectorBytes(packets_) + vectorBytes(leafPackets_));
+}
+
+bool Mesh::intersect(const Ray& ray, IntersectionInfo& info)
+{
+    WatertightRay wtRay(ray);
+    double closestDist = INF;
+    int closestTri = -1;
+    double closestB1 = 0, closestB2 = 0;
+
+    bvh_.intersectLeaves(ray, closestDist, [&] (int nodeIndex, double& maxDist) {
+        int firstPacket = leafPackets_[nodeIndex];
+        int numPackets = (bvh_.nodes_[nodeIndex].count_ + TrianglePacket::LANES - 1) / TrianglePacket::LANES;
+        bool found = false;
+        for (int i = firstPacket; i < firstPacket + numPackets; i++) {
+            double dist[4], b1[4], b2[4];
+            int hits = wtRay.intersect(packets_[i], maxDist, dist, b1, b2);
+            for (int lane = 0; lane < TrianglePacket::LANES; lane++) {
+                if (!(hits & (1 << lane)) || packets_[i].tri_[lane] < 0 || dist[lane] < 0 || dist[lane] > maxDist)
+                    continue;
+                maxDist = dist[lane];
+                closestTri = packets_[i].tri_[lane];
+                closestB1 = b1[lane];
+                closestB2 = b2[lane];
+                found = true;
+            }
+        }
+        return found;
+    });
+
+    if (closestTri < 0) return false;
+
+    const MeshTriangle& tri = triangles_[closestTri];
+    double b0 = 1 - closestB1 - closestB2;
+
+    info.setHitPoint(ray, closestDist);
+
+    if (tri.n_[0] >= 0) {
+        info.normal_ = normals_[tri.n_[0]].toVector() * b0
+                     + normals_[tri.n_[1]].toVector() * closestB1
+                     + normals_[tri.n_[2]].toVector() * closestB2;
+    } else {
+        Vector v0 = vertices_[tri.v_[0]].toVector();
+        info.normal_ = (vertices_[tri.v_[1]].toVector() - v0) ^ (vertices_[tri.v_[2]].toVector() - v0);
+    }
+    info.normal_.normalize();
+    info.normal_ = faceforward(ray.dir_, info.normal_); // a mesh needn't be closed, so it's seen from both sides
+
+    // u and v at the three corners
+    double u[3] = {0, 1, 0}, v[3] = {0, 0, 1};
+    if (tri.t_[0] >= 0) {
+        for (int i = 0; i < 3; i++) {
+            u[i] = uvs_[tri.t_[i]].u_;
+            v[i] = uvs_[tri.t_[i]].v_;
+        }
+    }
+    info.u_ = u[0] * b0 + u[1] * closestB1 + u[2] * closestB2;
+    info.v_ = v[0] * b0 + v[1] * closestB1 + v[2] * closestB2;
+
+    info.hasDifferentials_ = false;
+    if (ray.hasDifferentials_) {
+        // the gradients of the barycentric coordinates b1 and b2 in the triangle's plane, which u and v
+        // are linear in
+        Vector v0 = vertices_[tri.v_[0]].toVector();
+        Vector edge1 = vertices_[tri.v_[1]].toVector() - v0, edge2 = vertices_[tri.v_[2]].toVector() - v0;
+        Vector normal = edge1 ^ edge2;
+        double areaSqr = normal.lengthSqr();
+        if (areaSqr > 0) {
+            Vector gradB1 = (edge2 ^ normal) / areaSqr, gradB2 = (normal ^ edge1) / areaSqr;
+            info.setDifferentials(ray, gradB1 * (u[1] - u[0]) + gradB2 * (u[2] - u[0]),
+                                       gradB1 * (v[1] - v[0]) + gradB2 * (v[2] - v[0]));
+        }
+    }
+    info.geom_ = this;
+
+    return true;
+}
+
+/// what one thread parsed from its part of the .OBJ file. Relative (negative) face indices can only be
+/// resolved once we know how many elements the preceding chunks have, so until then they are stored
+/// as RELATIVE_INDEX + (index within this chunk, which may be negative)
+static const int RELATIVE_INDEX = -(1 << 30);
+
+struct ObjChunk
+{
+    std::vector<Float3> vertices, normals;
+    std::vector<Float2> uvs;
+    std::vector<MeshTriangle> triangles;
+    int errorLine = -1; // the first unparseable line (counted within the chunk), or -1
+};
+
+static inline bool isSpace(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+/// parses one "v/vt/vn" group of a face. Returns false if there's no number
+static bool parseFaceVertex(const char*& p, const ObjChunk& chunk, int index[3])
+{
+    const int counts[3] = { int(chunk.vertices.size()), int(chunk.uvs.size()), int(chunk.normals.size()) };
+    for (int k = 0; k < 3; k++) index[k] = -1;
+
+    for (int k = 0; k < 3; k++) {
+        if (k > 0) {
+            if (*p != '/') break;
+            p++;
+            if (*p == '/') continue; // "v//vn"
+        }
+        char* end;
+        long value = strtol(p, &end, 10);
+        if (end == p) return k > 0;
+        p = end;
+        if (value > 0) index[k] = int(value - 1);
+        else if (value < 0) index[k] = RELATIVE_INDEX + int(counts[k] + value);
+        else return false;
+    }
+    return true;
+}
+
+static void parseObjChunk(const char* begin, const char* end, ObjChunk& chunk)
+{
+    int line = 0;
+    for (const char* p = begin; p < end; line++) {
+        const char* lineEnd = (const char*) memchr(p, '\n', end - p);
+        if (!lineEnd) lineEnd = end;
+        while (p < lineEnd && isSpace(*p)) p++;
+
+        bool ok = true;
+        if (p[0] == 'v' && isSpace(p[1])) {
+            char* q;
+            Float3 v;
+            v.x_ = strtof(p + 2, &q);
+            v.y_ = strtof(q, &q);
+            v.z_ = strtof(q, &q);
+            chunk.vertices.push_back(v);
+        } else if (p[0] == 'v' && p[1] == 'n' && isSpace(p[2])) {
+            char* q;
+            Float3 n;
+            n.x_ = strtof(p + 3, &q);
+            n.y_ = strtof(q, &q);
+            n.z_ = strtof(q, &q);
+            chunk.normals.push_back(n);
+        } else if (p[0] == 'v' && p[1] == 't' && isSpace(p[2])) {
+            char* q;
+            Float2 t;
+            t.u_ = strtof(p + 3, &q);
+            t.v_ = strtof(q, &q);
+            chunk.uvs.push_back(t);
+        } else if (p[0] == 'f' && isSpace(p[1])) {
+            // polygons are triangulated as a fan around the first vertex
+            const char* q = p + 2;
+            int first[3], prev[3], current[3];
+            int numVertices = 0;
+            while (true) {
+                while (q < lineEnd && isSpace(*q)) q++;
+                if (q >= lineEnd) break;
+                if (!parseFaceVertex(q, chunk, current)) {
+                    ok = false;
+                    break;
+                }
+                if (numVertices == 0) {
+                    std::copy(current, current + 3, first);
+                } else if (numVertices >= 2) {
+                    MeshTriangle tri;
+                    int* corners[3] = { first, prev, current };
+                    for (int j = 0; j < 3; j++) {
+                        tri.v_[j] = corners[j][0];
+                        tri.t_[j] = corners[j][1];
+                        tri.n_[j] = corners[j][2];
+                    }
+                    chunk.triangles.push_back(tri);
+                }
+                std::copy(current, current + 3, prev);
+                numVertices++;
+            }
+            if (numVertices < 3) ok = false;
+        } // everything else (comments, groups, materials, ...) is ignored
+
+        if (!ok && chunk.errorLine < 0) chunk.errorLine = line;
+        p = lineEnd + 1;
+    }
+}
+
+/// makes the indices of a triangle global, given the counts in all preceding chunks
+static bool resolveIndices(int* indices, int offset, int total)
+{
+    for (int j = 0; j < 3; j++) {
+        int& index = indices[j];
+        if (index < -1) index = index - RELATIVE_INDEX + offset; // relative to this chunk
+        if (index < -1 || index >= total) return false;
+    }
+    // all corners must either have the attribute, or not have it
+    return (indices[0] < 0) == (indices[1] < 0) && (indices[1] < 0) == (indices[2] < 0);
+}
+
+bool Mesh::loadFromOBJ(const char* filename)
+{
+    FILE* fp = fopen(filename, "rb");
+    if (!fp) {
+        printf("loadFromOBJ: Can't open file: `%s'\n", filename);
+        return false;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    std::vector<char> text(size + 1);
+    bool readOk = fread(text.data(), 1, size, fp) == size_t(size);
+    fclose(fp);
+    if (!readOk) {
+        printf("loadFromOBJ: short read while opening `%s'\n", filename);
+        return false;
+    }
+    text[size] = 0; // so that strtof() & co. stop at the end
+
+    // split the file into chunks at line boundaries and parse them in parallel
+    ThreadPool& pool = ThreadPool::instance();
+    int numChunks = std::max(1, std::min(pool.getNumThreads() * 4, int(size / (1 << 20))));
+    std::vector<const char*> bounds(numChunks + 1);
+    bounds[0] = text.data();
+    bounds[numChunks] = text.data() + size;
+    for (int i = 1; i < numChunks; i++) {
+        const char* p = text.data() + size / numChunks * i;
+        const char* newline = (const char*) memchr(p, '\n', text.data() + size - p);
+        bounds[i] = std::max(bounds[i - 1], newline ? newline + 1 : text.data() + size);
+    }
+
+    std::vector<ObjChunk> chunks(numChunks);
+    pool.parallelFor(numChunks, [&] (int i) {
+        parseObjChunk(bounds[i], bounds[i + 1], chunks[i]);
+    });
+
+    // concatenate the chunks, fixing up the indices
+    std::vector<int> vertexOffset(numChunks + 1, 0), normalOffset(numChunks + 1, 0);
+    std::vector<int> uvOffset(numChunks + 1, 0), triOffset(numChunks + 1, 0);
+    for (int i = 0; i < numChunks; i++) {
+        if (chunks[i].errorLine >= 0) {
+            printf("loadFromOBJ: `%s': cannot parse face in chunk %d, line %d\n", filename, i, chunks[i].errorLine + 1);
+            return false;
+        }
+        vertexOffset[i + 1] = vertexOffset[i] + int(chunks[i].vertices.size());
+        normalOffset[i + 1] = normalOffset[i] + int(chunks[i].normals.size());
+        uvOffset[i + 1] = uvOffset[i] + int(chunks[i].uvs.size());
+        triOffset[i + 1] = triOffset[i] + int(chunks[i].triangles.size());
+    }
+
+    vertices_.resize(vertexOffset[numChunks]);
+    normals_.resize(normalOffset[numChunks]);
+    uvs_.resize(uvOffset[numChunks]);
+    triangles_.resize(triOffset[numChunks]);
+    std::vector<char> chunkOk(numChunks, 1);
+
+    pool.parallelFor(numChunks, [&] (int i) {
+        ObjChunk& chunk = chunks[i];
+        std::copy(chunk.vertices.begin(), chunk.vertices.end(), vertices_.begin() + vertexOffset[i]);
+        std::copy(chunk.normals.begin(), chunk.normals.end(), normals_.begin() + normalOffset[i]);
+        std::copy(chunk.uvs.begin(), chunk.uvs.end(), uvs_.begin() + uvOffset[i]);
+        for (size_t j = 0; j < chunk.triangles.size(); j++) {
+            MeshTriangle tri = chunk.triangles[j];
+            if (!resolveIndices(tri.v_, vertexOffset[i], int(vertices_.size())) || tri.v_[0] < 0 ||
+                !resolveIndices(tri.t_, uvOffset[i], int(uvs_.size())) ||
+                !resolveIndices(tri.n_, normalOffset[i], int(normals_.size())))
+                chunkOk[i] = 0;
+            triangles_[triOffset[i] + j] = tri;
+        }
+        chunk = ObjChunk(); // free the memory early
+    });
+
+    if (std::find(chunkOk.begin(), chunkOk.end(), 0) != chunkOk.end()) {
+        printf("loadFromOBJ: `%s' has faces with out-of-range indices\n", filename);
+        triangles_.clear();
+        return false;
+    }
+
+    buildBvh();
+    bvh_.printStats(filename);
+    return true;
+}
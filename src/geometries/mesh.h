@@ -0,0 +1,70 @@
+/**
+ * @File mesh.h
+ * @Brief Contains the declaration of the triangle mesh geometry.
+ */
+#ifndef __MESH_H__
+#define __MESH_H__
+
+#include <vector>
+
+#include "geometry.h"
+#include "accel/bvh.h"
+
+/// a compact 3D point/direction, for the big per-vertex arrays
+struct Float3
+{
+    float x_, y_, z_;
+    Vector toVector() const { return Vector(x_, y_, z_); }
+};
+
+struct Float2
+{
+    float u_, v_;
+};
+
+/// a triangle, indexing the vertex, normal and UV arrays of its mesh. Missing normal/UV indices are -1
+struct MeshTriangle
+{
+    int v_[3];
+    int n_[3];
+    int t_[3];
+};
+
+/// up to 4 triangles of a BVH leaf, with their vertices laid out for testing them all at once with SIMD:
+/// v_[corner][axis][lane]. Unused lanes hold a degenerate triangle at the origin, which is never hit
+struct TrianglePacket
+{
+    static constexpr int LANES = 4;
+    alignas(16) float v_[3][3][LANES];
+    int tri_[LANES]; //!< index in Mesh::triangles_, or -1 for an unused lane
+};
+
+/// A triangle mesh, with its own bounding volume hierarchy - the whole mesh is one geometry,
+/// intersected in logarithmic time
+class Mesh : public Geometry
+{
+public:
+    Mesh() = default;
+    ~Mesh() = default;
+
+    bool loadFromOBJ(const char* filename); //!< Loads the mesh from a Wavefront .OBJ file. Returns false in the case of an error
+    void buildBvh(); //!< (re)builds the acceleration structure. Needed after modifying the arrays by hand
+
+    bool intersect(const Ray& ray, IntersectionInfo& info) override;
+    bool getBBox(BBox& box) const override;
+    void reportMemory(MemoryReport& report) const override; //!< the arrays, and the BVH
+
+    std::vector<Float3> vertices_;
+    std::vector<Float3> normals_;
+    std::vector<Float2> uvs_;
+    std::vector<MeshTriangle> triangles_;
+
+    BvhQuality bvhQuality_ = BvhQuality::SAH; //!< set to FAST for meshes that get rebuilt often
+
+private:
+    Bvh bvh_;
+    std::vector<TrianglePacket> packets_; // the triangles of each leaf, in the order of the leaves
+    std::vector<int> leafPackets_;        // for each BVH node that is a leaf, the index of its first packet
+};
+
+#endif // __MESH_H__
@@ -0,0 +1,190 @@
+/**
+ * @File environment.cpp
+ * @Brief Loading, prefiltering and sampling the environment map.
+ */
+#include "environment.h"
+
+#include <algorithm>
+#include <stdio.h>
+
+#include "materials/bitmap.h"
+#include "utils/memory.h"
+#include "utils/util.h"
+
+static float luminance(const Color& color)
+{
+    return color.r_ * 0.299f + color.g_ * 0.587f + color.b_ * 0.114f;
+}
+
+/// the lat-long coords of a direction: u goes around the Y axis, v from +Y (0) to -Y (1)
+static void toLatLong(const Vector& dir, double& u, double& v)
+{
+    u = (atan2(dir.z_, dir.x_) + PI) / (2 * PI);
+    v = acos(std::min(1.0, std::max(-1.0, dir.y_))) / PI;
+}
+
+static Vector fromLatLong(double u, double v)
+{
+    double phi = u * 2 * PI - PI;
+    double theta = v * PI;
+    return Vector(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi));
+}
+
+/// finds the interval of the (normalized) cdf with `count` intervals, where sample falls. remainder is
+/// where exactly in the interval, in [0..1)
+static int pickInterval(const float* cdf, int count, double sample, double& remainder)
+{
+    int index = int(std::upper_bound(cdf, cdf + count + 1, float(sample)) - cdf) - 1;
+    index = std::min(std::max(index, 0), count - 1);
+    double width = cdf[index + 1] - cdf[index];
+    remainder = width > 0 ? std::min((sample - cdf[index]) / width, 0.999999) : 0.5;
+    return index;
+}
+
+bool EnvironmentMap::load(const char* filename)
+{
+    Bitmap bitmap;
+    if (!bitmap.loadImage(filename) || !bitmap.isOK()) {
+        printf("Cannot load the environment map %s\n", filename);
+        return false;
+    }
+
+    width_ = bitmap.getWidth();
+    height_ = bitmap.getHeight();
+    radiance_.resize(width_ * height_);
+    for (int y = 0; y < height_; y++)
+        for (int x = 0; x < width_; x++)
+            radiance_[y * width_ + x] = bitmap.getPixel(x, y);
+
+    buildDistribution();
+    prefilter();
+    return true;
+}
+
+size_t EnvironmentMap::getMemoryUsage() const
+{
+    return vectorBytes(radiance_) + vectorBytes(rowCdfs_) + vectorBytes(marginalCdf_) + vectorBytes(rowSums_) +
+           vectorBytes(diffuse_);
+}
+
+void EnvironmentMap::buildDistribution()
+{
+    // the pixels near the poles cover less of the sphere, hence the sin(theta)
+    rowCdfs_.assign((width_ + 1) * height_, 0);
+    marginalCdf_.assign(height_ + 1, 0);
+    rowSums_.assign(height_, 0);
+
+    std::vector<double> cumulative(width_ + 1);
+    total_ = 0;
+    for (int y = 0; y < height_; y++) {
+        double sinTheta = sin((y + 0.5) / height_ * PI);
+        cumulative[0] = 0;
+        for (int x = 0; x < width_; x++)
+            cumulative[x + 1] = cumulative[x] + luminance(getPixel(x, y)) * sinTheta;
+
+        double sum = cumulative[width_];
+        float* cdf = &rowCdfs_[y * (width_ + 1)];
+        for (int x = 0; x <= width_; x++)
+            cdf[x] = sum > 0 ? float(cumulative[x] / sum) : float(x) / width_;
+
+        rowSums_[y] = sum;
+        total_ += sum;
+    }
+
+    double sum = 0;
+    for (int y = 0; y < height_; y++) {
+        marginalCdf_[y] = total_ > 0 ? float(sum / total_) : float(y) / height_;
+        sum += rowSums_[y];
+    }
+    marginalCdf_[height_] = 1;
+}
+
+void EnvironmentMap::prefilter()
+{
+    // average the map down to a coarse grid of directions first...
+    const int coarseWidth = 2 * DIFFUSE_WIDTH, coarseHeight = 2 * DIFFUSE_HEIGHT;
+    std::vector<Color> coarse(coarseWidth * coarseHeight, Color(0, 0, 0));
+    std::vector<int> counts(coarseWidth * coarseHeight, 0);
+    for (int y = 0; y < height_; y++)
+        for (int x = 0; x < width_; x++) {
+            int cell = (y * coarseHeight / height_) * coarseWidth + x * coarseWidth / width_;
+            coarse[cell] += getPixel(x, y);
+            counts[cell]++;
+        }
+
+    std::vector<Vector> directions(coarse.size());
+    std::vector<float> solidAngles(coarse.size());
+    for (int y = 0; y < coarseHeight; y++)
+        for (int x = 0; x < coarseWidth; x++) {
+            int cell = y * coarseWidth + x;
+            if (counts[cell]) coarse[cell] /= float(counts[cell]);
+            else coarse[cell] = getPixel(x * width_ / coarseWidth, y * height_ / coarseHeight); // a small map
+            double v = (y + 0.5) / coarseHeight;
+            directions[cell] = fromLatLong((x + 0.5) / coarseWidth, v);
+            solidAngles[cell] = float((2 * PI / coarseWidth) * (PI / coarseHeight) * sin(v * PI));
+        }
+
+    // ... then integrate it with the cosine lobe around each direction of the prefiltered map. Divided
+    // by PI, as the lights' power is (see the Lambert shader)
+    diffuse_.resize(DIFFUSE_WIDTH * DIFFUSE_HEIGHT);
+    for (int y = 0; y < DIFFUSE_HEIGHT; y++)
+        for (int x = 0; x < DIFFUSE_WIDTH; x++) {
+            Vector normal = fromLatLong((x + 0.5) / DIFFUSE_WIDTH, (y + 0.5) / DIFFUSE_HEIGHT);
+            Color sum(0, 0, 0);
+            for (size_t cell = 0; cell < coarse.size(); cell++) {
+                double cosTheta = dot(normal, directions[cell]);
+                if (cosTheta > 0)
+                    sum += coarse[cell] * float(cosTheta * solidAngles[cell]);
+            }
+            diffuse_[y * DIFFUSE_WIDTH + x] = sum / float(PI);
+        }
+}
+
+Color EnvironmentMap::getRadiance(const Vector& dir) const
+{
+    double u, v;
+    toLatLong(dir, u, v);
+    int x = std::min(int(u * width_), width_ - 1);
+    int y = std::min(int(v * height_), height_ - 1);
+    return getPixel(x, y);
+}
+
+Color EnvironmentMap::getDiffuse(const Vector& normal) const
+{
+    // bilinear filtering: the map is coarse. It wraps around in u
+    double u, v;
+    toLatLong(normal, u, v);
+    double fx = u * DIFFUSE_WIDTH - 0.5, fy = v * DIFFUSE_HEIGHT - 0.5;
+    int x = int(floor(fx)), y = int(floor(fy));
+    float tx = float(fx - x), ty = float(fy - y);
+
+    auto texel = [this] (int x, int y) {
+        x = (x + DIFFUSE_WIDTH) % DIFFUSE_WIDTH;
+        y = std::min(std::max(y, 0), DIFFUSE_HEIGHT - 1);
+        return diffuse_[y * DIFFUSE_WIDTH + x];
+    };
+    Color top = texel(x, y) * (1 - tx) + texel(x + 1, y) * tx;
+    Color bottom = texel(x, y + 1) * (1 - tx) + texel(x + 1, y + 1) * tx;
+    return top * (1 - ty) + bottom * ty;
+}
+
+Color EnvironmentMap::sample(double u, double v, Vector& dir, double& pdf) const
+{
+    pdf = 0;
+    if (total_ <= 0) return Color(0, 0, 0);
+
+    // the row, then the pixel in it. What's left of the samples places the direction within the pixel
+    int y = pickInterval(marginalCdf_.data(), height_, v, v);
+    int x = pickInterval(&rowCdfs_[y * (width_ + 1)], width_, u, u);
+
+    double theta = (y + v) / height_ * PI;
+    double sinTheta = sin(theta);
+    if (sinTheta <= 0) return Color(0, 0, 0);
+    dir = fromLatLong((x + u) / width_, (y + v) / height_);
+
+    // the probability of the pixel, spread over its area in (u, v), then mapped to the sphere
+    const Color& radiance = getPixel(x, y);
+    double probability = luminance(radiance) * sin((y + 0.5) / height_ * PI) / total_;
+    pdf = probability * width_ * height_ / (2 * PI * PI * sinTheta);
+    return radiance;
+}
@@ -0,0 +1,51 @@
+/**
+ * @File environment.h
+ * @Brief An HDR environment map, lighting the scene from infinitely far away.
+ */
+#ifndef __ENVIRONMENT_H__
+#define __ENVIRONMENT_H__
+
+#include <vector>
+
+#include "maths/vector.h"
+#include "color/color.h"
+
+/// An environment map in lat-long layout (typically an HDR sky, loaded from EXR). It is what the rays,
+/// which hit nothing, see. It also lights the scene: in GI mode it is sampled with shadow rays, in
+/// directions picked proportionally to its luminance (by a precomputed 2D CDF); otherwise a low-resolution
+/// prefiltered copy gives the diffuse light from it, in place of the constant ambient light
+class EnvironmentMap
+{
+public:
+    static constexpr double DISTANCE = 1e6; //!< where the shadow rays toward the environment end
+
+    bool load(const char* filename); //!< Loads the map from an image. Returns false in the case of an error
+    bool isOK() const { return !radiance_.empty(); }
+    size_t getMemoryUsage() const; //!< of the map, its distribution and its prefiltered copy
+
+    /// the radiance coming from the given (normalized) direction
+    Color getRadiance(const Vector& dir) const;
+    /// the light a white diffuse surface with the given normal reflects, when lit by the whole (unoccluded)
+    /// environment. From the prefiltered copy
+    Color getDiffuse(const Vector& normal) const;
+    /// picks a direction by the 2D sample (u, v), with probability proportional to the luminance. Returns
+    /// the radiance from there, and sets the probability density (over the solid angle) in pdf
+    Color sample(double u, double v, Vector& dir, double& pdf) const;
+
+private:
+    static constexpr int DIFFUSE_WIDTH = 32, DIFFUSE_HEIGHT = 16;
+
+    void buildDistribution();
+    void prefilter();
+    const Color& getPixel(int x, int y) const { return radiance_[y * width_ + x]; }
+
+    int width_ = 0, height_ = 0;
+    std::vector<Color> radiance_;
+    std::vector<float> rowCdfs_;     // width_ + 1 per row: the cumulative luminance * sin(theta) along it, normalized
+    std::vector<float> marginalCdf_; // height_ + 1: the cumulative sums of the rows, normalized
+    std::vector<double> rowSums_;
+    double total_ = 0;
+    std::vector<Color> diffuse_;     // DIFFUSE_WIDTH x DIFFUSE_HEIGHT, in the same layout
+};
+
+#endif // __ENVIRONMENT_H__
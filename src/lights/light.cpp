@@ -0,0 +1,116 @@
+/**
+ * @File light.cpp
+ * @Brief Contains implementations of the light sources and the light selection.
+ */
+#include "light.h"
+
+#include <algorithm>
+
+#include "utils/util.h"
+
+static double maxComponent(const Color& color)
+{
+    return std::max(color.r_, std::max(color.g_, color.b_));
+}
+
+bool Light::setParam(const std::string& name, const ParamValues& values)
+{
+    if (name == "color") return getParam(values, color_);
+    return name == "power" && getParam(values, power_);
+}
+
+void PointLight::getNthSample(int sampleIdx, const Vector& shadePos, Vector& samplePos, Color& sampleColor) const
+{
+    samplePos = position_;
+    sampleColor = color_ * float(power_ / (shadePos - position_).lengthSqr()); // the intensity reduces with 1/dist^2
+}
+
+double PointLight::getMaxContribution(const Vector& point) const
+{
+    return maxComponent(color_) * power_ / (point - position_).lengthSqr();
+}
+
+bool PointLight::setParam(const std::string& name, const ParamValues& values)
+{
+    if (name == "position") return getParam(values, position_);
+    return Light::setParam(name, values);
+}
+
+RectLight::RectLight(const Vector& corner, const Vector& edgeA, const Vector& edgeB, double power,
+                     const Color& color, int xSubd, int ySubd)
+: Light(color, power)
+, corner_(corner)
+, edgeA_(edgeA)
+, edgeB_(edgeB)
+, xSubd_(std::max(xSubd, 1))
+, ySubd_(std::max(ySubd, 1))
+{
+    center_ = corner_ + (edgeA_ + edgeB_) * 0.5;
+    normal_ = edgeA_ ^ edgeB_;
+    area_ = normal_.length();
+    normal_.normalize();
+    halfDiagonal_ = (edgeA_ + edgeB_).length() * 0.5;
+}
+
+void RectLight::getNthSample(int sampleIdx, const Vector& shadePos, Vector& samplePos, Color& sampleColor) const
+{
+    // jittered stratified sampling of the rectangle
+    double a = (sampleIdx % xSubd_ + randomFloat()) / xSubd_;
+    double b = (sampleIdx / xSubd_ + randomFloat()) / ySubd_;
+    samplePos = corner_ + edgeA_ * a + edgeB_ * b;
+
+    Vector fromLight = shadePos - samplePos;
+    double distSqr = fromLight.lengthSqr();
+    double cosTheta = dot(fromLight, normal_) / sqrt(distSqr); // the light is one-sided
+    if (cosTheta <= 0) {
+        sampleColor.makeZero();
+        return;
+    }
+    sampleColor = color_ * float(power_ * cosTheta / (distSqr * getNumSamples()));
+}
+
+double RectLight::getMaxContribution(const Vector& point) const
+{
+    // the whole rectangle is within halfDiagonal_ of its center
+    double distToCenter = (point - center_).length();
+    if (dot(point - center_, normal_) < -halfDiagonal_) return 0; // entirely behind the light
+    double minDist = std::max(distToCenter - halfDiagonal_, 1e-3);
+    return maxComponent(color_) * power_ / sqr(minDist);
+}
+
+int LightList::select(const Vector& point, SelectedLight selected[MAX_SELECTED]) const
+{
+    int maxSampled = std::min(maxSampledLights_, MAX_SELECTED);
+
+    // first pass - cull the lights and find how much the rest can give in total
+    int numSurvived = 0;
+    double totalContribution = 0;
+    for (const auto& light : lights_) {
+        double contribution = light->getMaxContribution(point);
+        if (contribution < cullThreshold_) continue;
+        if (numSurvived < maxSampled) selected[numSurvived] = {light.get(), 1.0f};
+        numSurvived++;
+        totalContribution += contribution;
+    }
+    if (numSurvived <= maxSampled) return numSurvived;
+
+    // too many lights. Pick maxSampled of them (with replacement), with probability proportional to
+    // their contribution, and weight them by 1/(maxSampled * probability) so that the estimate stays unbiased.
+    // Sorted random positions in the contribution "CDF" let us do this in a single pass over the lights
+    double picks[MAX_SELECTED];
+    for (int i = 0; i < maxSampled; i++)
+        picks[i] = (i + randomFloat()) / maxSampled * totalContribution; // stratified, so already sorted
+
+    int numPicked = 0;
+    double cdf = 0;
+    for (const auto& light : lights_) {
+        if (numPicked == maxSampled) break;
+        double contribution = light->getMaxContribution(point);
+        if (contribution < cullThreshold_) continue;
+        cdf += contribution;
+        while (numPicked < maxSampled && picks[numPicked] < cdf) {
+            selected[numPicked++] = {light.get(), float(totalContribution / (maxSampled * contribution))};
+        }
+    }
+    return numPicked;
+}
@@ -0,0 +1,102 @@
+/**
+ * @File light.h
+ * @Brief Contains declarations of the light sources and the scene light list.
+ */
+#ifndef __LIGHT_H__
+#define __LIGHT_H__
+
+#include <memory>
+#include <vector>
+
+#include "maths/vector.h"
+#include "color/color.h"
+#include "utils/params.h"
+
+class Light
+{
+public:
+    Light(const Color& color, double power): color_(color), power_(power) {}
+    virtual ~Light() = default;
+
+    virtual int getNumSamples() const = 0; //!< how many shadow rays are needed to sample the light
+    /// gets the n-th sample of the light as seen from shadePos: the point on the light and
+    /// the light (with the 1/dist^2 falloff and already divided by the number of samples) that reaches shadePos
+    virtual void getNthSample(int sampleIdx, const Vector& shadePos, Vector& samplePos, Color& sampleColor) const = 0;
+    /// an upper bound of the light intensity (any channel) that can reach the given point, ignoring occlusion
+    virtual double getMaxContribution(const Vector& point) const = 0;
+    /// sets a parameter by name (see SceneParams): color, power and the ones of the light type.
+    /// Returns false if there's no such parameter or the values don't fit it
+    virtual bool setParam(const std::string& name, const ParamValues& values);
+
+    Color color_;
+    double power_;
+};
+
+class PointLight : public Light
+{
+public:
+    PointLight(const Vector& position, double power, const Color& color = {1.f, 1.f, 1.f})
+    : Light(color, power)
+    , position_(position) {}
+
+    int getNumSamples() const override { return 1; }
+    void getNthSample(int sampleIdx, const Vector& shadePos, Vector& samplePos, Color& sampleColor) const override;
+    double getMaxContribution(const Vector& point) const override;
+    bool setParam(const std::string& name, const ParamValues& values) override; //!< position, and the common ones
+
+    Vector position_;
+};
+
+/// a one-sided rectangular area light, spanned by two edges from a corner. It emits in the
+/// direction of edgeA ^ edgeB and is sampled with a jittered xSubd x ySubd grid
+class RectLight : public Light
+{
+public:
+    RectLight(const Vector& corner, const Vector& edgeA, const Vector& edgeB, double power,
+              const Color& color = {1.f, 1.f, 1.f}, int xSubd = 2, int ySubd = 2);
+
+    int getNumSamples() const override { return xSubd_ * ySubd_; }
+    void getNthSample(int sampleIdx, const Vector& shadePos, Vector& samplePos, Color& sampleColor) const override;
+    double getMaxContribution(const Vector& point) const override;
+
+private:
+    Vector corner_, edgeA_, edgeB_;
+    Vector center_, normal_;
+    double area_;
+    double halfDiagonal_;
+    int xSubd_, ySubd_;
+};
+
+/// a light chosen for shading a point, along with the weight its contribution must be scaled by
+struct SelectedLight
+{
+    const Light* light_;
+    float weight_;
+};
+
+/// all lights in the scene. For each shading point it culls the lights that cannot contribute
+/// noticeably and, when there are still too many, picks a few of them at random (proportionally
+/// to their possible contribution), so the shadow rays per point stay bounded
+class LightList
+{
+public:
+    static constexpr int MAX_SELECTED = 32;
+
+    void add(std::unique_ptr<Light> light) { lights_.push_back(std::move(light)); }
+    void clear() { lights_.clear(); }
+    size_t size() const { return lights_.size(); }
+    const Light& operator[] (size_t index) const { return *lights_[index]; }
+    Light& operator[] (size_t index) { return *lights_[index]; }
+
+    /// fills `selected` (which has room for MAX_SELECTED entries) with the lights to sample at point.
+    /// Returns the number of selected lights
+    int select(const Vector& point, SelectedLight selected[MAX_SELECTED]) const;
+
+    double cullThreshold_ = 1.0 / 512; // lights that give less than that at a point are skipped
+    int maxSampledLights_ = 8;         // if more lights survive the culling, that many are chosen stochastically
+
+private:
+    std::vector<std::unique_ptr<Light>> lights_;
+};
+
+#endif // __LIGHT_H__
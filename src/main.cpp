@@ -1,26 +1,62 @@
 #include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
 #include <vector>
 
 #include "maths/vector.h"
 #include "utils/util.h"
+#include "utils/sampling.h"
+#include "utils/thread_pool.h"
+#include "utils/file_watcher.h"
+#include "utils/memory.h"
 #include "render/sdl.h"
+#include "render/denoiser.h"
+#include "render/aov.h"
+#include "render/server.h"
+#include "render/tile_cache.h"
 #include "color/color.h"
 #include "scenes/camera.h"
+#include "scenes/scene_params.h"
 #include "shaders/shading.h"
+#include "shaders/procedural.h"
+#include "lights/light.h"
+#include "lights/environment.h"
+#include "accel/tlas.h"
+#include "geometries/mesh.h"
+#include "geometries/leak_test.h"
 
 Camera camera;
 Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE];
 std::vector<Node> nodes;
+Tlas tlas; // the acceleration structure over nodes; update() it after moving things around
 
-Vector lightPosition;
-double lightIntensity;
+LightList lights;
 Color ambientLight = Color(1, 1, 1) * 0.1;
+EnvironmentMap environment; // the background and the light from it; replaces the ambient light if loaded
 
 bool wantAA = true; // anti-aliasing
+bool wantGI = false; // path traced global illumination instead of the constant ambient light
+bool wantWavefront = false; // shade the hits of a tile grouped by shader, instead of ray by ray
+int giPasses = 64;   // in GI mode the image is refined progressively, each pass adds one path per pixel
+bool wantInteractive = false; // navigate the scene with the keyboard and mouse, with previews while moving
+double frameBudgetMs = 50;    // the interactive previews adapt their resolution to render in about that time
+bool wantDenoise = false;     // filter the noise out of the finished frames (see Denoiser), e.g. of a GI render with few passes
+
+std::atomic<bool> cancelRender(false); // when set, render() skips the tiles it hasn't started yet
+std::atomic<int> tilesRendered(0);     // counted by render(), for the progress reports of the render server
+
+Color accumBuffer[VFB_MAX_SIZE][VFB_MAX_SIZE]; // the sum of all GI passes so far
+Denoiser denoiser; // along with its auxiliary buffers, filled in by renderAux()
+AovBuffers aovs;   // filled in by the tile renderers, along with vfb, once resized to the frame
+TileCache tileCache; // which tiles of vfb are up to date, for re-rendering only the ones affected by scene edits
+const char* paramsFile = nullptr; // overrides of the scene's parameters, reloaded on changes in the interactive mode
+SceneParams sceneParams;
 
 #define COUNT_OF(arr) int((sizeof(arr)) / sizeof(arr[0]))
 
-void setupScene() {
+bool setupScene() {
     // camera setup
     camera.position_ = Vector(35, 90, -100);
     camera.yaw_ = 0;
@@ -57,65 +93,297 @@ void setupScene() {
                               std::make_unique<BitmapTexture>("../assets/world.bmp")));
 
 
-    nodes.push_back({std::move(csgObj), std::move(phong)});
-    nodes.push_back({std::move(plane1), std::move(lambert1)});
-    nodes.push_back({std::move(cube), std::move(lambert2)});
-    nodes.push_back({std::move(sphere), std::move(lambert3)});
+    nodes.push_back({std::move(csgObj), std::move(phong), "csg"});
+    nodes.push_back({std::move(plane1), std::move(lambert1), "floor"});
+    nodes.push_back({std::move(cube), std::move(lambert2), "cube"});
+    nodes.push_back({std::move(sphere), std::move(lambert3), "globe"});
 
-    lightPosition = Vector(40, 150, -130);
-    lightIntensity = 35000.0;
+    // lights setup
+    lights.add(std::make_unique<PointLight>(Vector(40, 150, -130), 35000.0));
 
+    tlas.build(nodes);
+    tlas.printStats();
     camera.frameBegin();
+    return true;
+}
+
+/// a glass sphere in front of a mirror: the reflected and refracted rays, and their budget. The block's texture is
+/// a ProceduralTexture graph
+bool setupGlassScene() {
+    camera.position_ = Vector(0, 100, -140);
+    camera.yaw_ = 0;
+    camera.pitch_ = -25;
+    camera.roll_ = 0;
+    camera.fov_ = 90;
+    camera.aspectRatio_ = float(RESX) / float(RESY);
+
+    std::unique_ptr floor (std::make_unique<Lambert>(Color(0, 0, 0),
+                           std::make_unique<BitmapTexture>("../assets/floor.bmp", 100)));
+    std::unique_ptr globe (std::make_unique<Lambert>(Color(0, 0, 0),
+                           std::make_unique<BitmapTexture>("../assets/world.bmp")));
+    // a checker of red and marble-ish noise, as a graph
+    auto marble (std::make_unique<ProceduralTexture>());
+    auto veins = marble->mix(marble->constant(Color(0.2f, 0.2f, 0.3f)), marble->constant(Color(1, 1, 1)),
+                             marble->noise(0.1, 4));
+    marble->setOutput(marble->checker(marble->constant(Color(0.8f, 0.1f, 0.1f)), veins, 2));
+    std::unique_ptr block (std::make_unique<Phong>(10.0, 30.0, Color(0, 0, 0), std::move(marble)));
+
+    nodes.push_back({std::make_unique<Plane>(4.0), std::move(floor), "floor"});
+    nodes.push_back({std::make_unique<Cube>(Vector(0, 30, 110), 60.0), std::make_unique<Reflection>(), "mirror"});
+    nodes.push_back({std::make_unique<Sphere>(Vector(-15, 34, -30), 30.0), std::make_unique<Refraction>(1.5), "glass"});
+    nodes.push_back({std::make_unique<Sphere>(Vector(45, 24, 10), 20.0), std::move(globe), "globe"});
+    nodes.push_back({std::make_unique<Cube>(Vector(-65, 20, 20), 16.0), std::move(block), "block"});
+
+    lights.add(std::make_unique<PointLight>(Vector(-60, 150, -100), 35000.0));
+
+    tlas.build(nodes);
+    tlas.printStats();
+    camera.frameBegin();
+    return true;
 }
 
+/// a ring of copies of one CSG prototype and of one globe, each an Instance with a transform of its own. The copies of
+/// each prototype share its shader, too
+bool setupInstancesScene() {
+    camera.position_ = Vector(0, 85, -45);
+    camera.yaw_ = 0;
+    camera.pitch_ = -40;
+    camera.roll_ = 0;
+    camera.fov_ = 90;
+    camera.aspectRatio_ = float(RESX) / float(RESY);
+
+    auto piece (std::make_shared<CsgMinus>());
+    piece->left_ = std::make_unique<Cube>(Vector(0, 0, 0), 1.0);
+    piece->right_ = std::make_unique<Sphere>(Vector(0, 0, 0), 1.3);
+    std::shared_ptr<Shader> pieceShader (std::make_shared<Phong>(10.0, 30.0, Color(0, 0, 0),
+                                         std::make_unique<CheckerTexture>(Color(0.4f, 0.2f, 0.1f),
+                                                                          Color(0.9f, 0.8f, 0.1f), 2)));
+    auto ball (std::make_shared<Sphere>(Vector(0, 0, 0), 1.0));
+    std::shared_ptr<Shader> ballShader (std::make_shared<Lambert>(Color(0, 0, 0),
+                                        std::make_unique<BitmapTexture>("../assets/world.bmp")));
+
+    const int COUNT = 8;
+    const Vector ringCenter(0, 0, 50);
+    for (int i = 0; i < COUNT; i++) {
+        double angle = 360.0 * i / COUNT;
+        Vector direction(sin(toRadians(angle)), 0, cos(toRadians(angle)));
+
+        auto pieceCopy (std::make_unique<Instance>(piece));
+        double size = 8 + 2 * (i % 3);
+        pieceCopy->scale(size, size, size);
+        pieceCopy->rotate(angle, 20 * i, 0);
+        pieceCopy->translate(ringCenter + direction * 55 + Vector(0, size * 1.8, 0));
+        nodes.push_back({std::move(pieceCopy), pieceShader, "piece" + std::to_string(i)});
+
+        auto ballCopy (std::make_unique<Instance>(ball));
+        ballCopy->scale(6, 6 + 2 * (i % 4), 6);
+        ballCopy->rotate(45 * i, 0, 15 * (i % 3));
+        ballCopy->translate(ringCenter + direction * 30 + Vector(0, 12, 0));
+        nodes.push_back({std::move(ballCopy), ballShader, "ball" + std::to_string(i)});
+    }
+
+    std::unique_ptr floor (std::make_unique<Lambert>(Color(0, 0, 0),
+                           std::make_unique<BitmapTexture>("../assets/floor.bmp", 100)));
+    nodes.push_back({std::make_unique<Plane>(0.0), std::move(floor), "floor"});
+
+    lights.add(std::make_unique<PointLight>(Vector(-40, 150, -60), 35000.0));
+
+    tlas.build(nodes);
+    tlas.printStats();
+    camera.frameBegin();
+    return true;
+}
+
+const char* objFile = nullptr; // the model of the "obj" scene
+
+/// the mesh from objFile on a floor, with the camera and the light placed by its size
+bool setupObjScene() {
+    if (!objFile) {
+        printf("setupObjScene: no .OBJ file given\n");
+        return false;
+    }
+    std::unique_ptr mesh (std::make_unique<Mesh>());
+    if (!mesh->loadFromOBJ(objFile)) return false;
+
+    BBox box;
+    mesh->getBBox(box);
+    Vector center = box.center();
+    double radius = std::max((box.vmax_ - box.vmin_).length() / 2, 1e-6);
+
+    camera.position_ = center + Vector(0, radius, -2.5 * radius);
+    camera.yaw_ = 0;
+    camera.pitch_ = -toDegrees(atan2(1.0, 2.5));
+    camera.roll_ = 0;
+    camera.fov_ = 60;
+    camera.aspectRatio_ = float(RESX) / float(RESY);
+
+    std::unique_ptr floor (std::make_unique<Lambert>(Color(0, 0, 0),
+                           std::make_unique<CheckerTexture>(Color(0.5f, 0.5f, 0.5f), Color(0.8f, 0.8f, 0.8f), 1)));
+    nodes.push_back({std::make_unique<Plane>(box.vmin_.y_), std::move(floor), "floor"});
+    nodes.push_back({std::move(mesh), std::make_unique<Lambert>(Color(0.5f, 0.45f, 0.4f)), "model"});
+
+    // as bright at the model as the light of the default scene is at its objects
+    Vector lightPos = center + Vector(-radius, 3 * radius, -2 * radius);
+    lights.add(std::make_unique<PointLight>(lightPos, 35000.0 * (lightPos - center).lengthSqr() / (150.0 * 150.0)));
+
+    tlas.build(nodes);
+    tlas.printStats();
+    camera.frameBegin();
+    return true;
+}
+
+/// prints how much memory the scene and the frame buffers take. The geometry, shader and texture objects
+/// themselves are counted by the scene arena; what they hold outside of it, by their reportMemory()
+void printMemoryReport()
+{
+    MemoryReport report;
+    const Arena& arena = getSceneArena();
+    report.add(MemoryCategory::PRIMITIVES, arena.getBytes(MemoryCategory::PRIMITIVES));
+    report.add(MemoryCategory::SHADERS, arena.getBytes(MemoryCategory::SHADERS));
+    for (const Node& node : nodes)
+    {
+        node.geometry_->reportMemory(report);
+        if (report.countOnce(node.shader_.get())) node.shader_->reportMemory(report);
+    }
+    report.add(MemoryCategory::ACCELERATION, tlas.getMemoryUsage());
+    report.add(MemoryCategory::TEXTURES, environment.getMemoryUsage());
+    report.add(MemoryCategory::FRAMEBUFFERS, sizeof(vfb) + sizeof(accumBuffer) + aovs.getMemoryUsage() +
+                                             denoiser.getMemoryUsage() + tileCache.getMemoryUsage());
+    report.print();
+    printf("  (scene arena: %.1f KB in blocks)\n", arena.getReserved() / 1024.0);
+}
+
+/// counts the scenes loaded, so that the threads can drop what they cached of the old ones (see ShadowCache)
+std::atomic<int> sceneGeneration(0);
+
+/// the scenes the render server can load, by name
+static const struct { const char* name; bool (*setup)(); } scenes[] = {
+    { "default", setupScene },
+    { "glass", setupGlassScene },
+    { "instances", setupInstancesScene },
+    { "obj", setupObjScene },
+};
+
+/// replaces the scene (nodes, lights and camera) with the one of the given name. Returns false if there's no such scene,
+/// or it can't be set up (e.g. its files are missing)
+bool loadScene(const char* name)
+{
+    for (auto& scene: scenes)
+    {
+        if (strcmp(scene.name, name)) continue;
+        nodes.clear();
+        lights.clear();
+        getSceneArena().reset(); // the old scene's objects are all destroyed by now
+        sceneGeneration++;       // and the nodes the threads' shadow caches point to are gone
+        if (scene.setup()) return true;
+        nodes.clear(); // what got set up of it, e.g. the floor
+        lights.clear();
+        tlas.build(nodes);
+        return false;
+    }
+    return false;
+}
+
+/// Neighbouring shadow rays (the AA samples of a pixel, adjacent pixels) are almost always
+/// blocked by the same object, so each thread remembers the node that blocked its last shadow
+/// ray and tests it before everything else.
+/// CSG nodes are cached as a whole: one of their children blocking the ray doesn't mean
+/// that the result of the boolean operation does. The cached node is forgotten when another scene is loaded
+struct ShadowCache
+{
+    const Node* lastOccluder_ = nullptr;
+    int generation_ = 0;      // the sceneGeneration lastOccluder_ is from
+    // statistics, flushed to the global counters after each tile:
+    long long hits_ = 0;      // blocked rays, resolved by the cached node
+    long long misses_ = 0;    // blocked rays, which needed a search of the other nodes
+    long long visible_ = 0;   // rays that reached the light
+};
+
+thread_local ShadowCache shadowCache;
+std::atomic<long long> shadowCacheHits(0), shadowCacheMisses(0), shadowCacheVisible(0);
+
+static bool blocks(const Node& node, const Ray& ray, double targetDist)
+{
+    IntersectionInfo info;
+    return node.geometry_->intersect(ray, info) && info.distance_ < targetDist; // check if there is object between the
+}                                                                               // light and the point where it started
+
 bool visibilityCheck(const Vector &start, const Vector &end) {
     Ray ray;
     ray.start_ = start;
     ray.dir_ = end - start;
-    ray.dir_.normalize();
 
-    double targetDist = (end - start).length();
+    double targetDist = ray.dir_.length();
+    ray.dir_ /= targetDist;
 
-    for (const auto &node : nodes) {
-        IntersectionInfo info;
-        if (!node.geometry_->intersect(ray, info)) {
-            continue;
-        }
+    if (currentTileDeps) currentTileDeps->addSegment(start, end);
 
-        if (info.distance_ < targetDist) // check if there is object between the
-        {                                // light and the point where it started
-            return false;
-        }
+    if (shadowCache.generation_ != sceneGeneration.load(std::memory_order_relaxed)) {
+        shadowCache.lastOccluder_ = nullptr;
+        shadowCache.generation_ = sceneGeneration.load(std::memory_order_relaxed);
+    }
+    const Node* cached = shadowCache.lastOccluder_;
+    if (cached && blocks(*cached, ray, targetDist)) {
+        if (currentTileDeps) currentTileDeps->addNode(int(cached - nodes.data()));
+        shadowCache.hits_++;
+        return false;
     }
 
+    const Node* occluder = tlas.intersectAny(ray, targetDist, cached); // the cached one is already tested
+    if (occluder) {
+        if (currentTileDeps) currentTileDeps->addNode(int(occluder - nodes.data()));
+        shadowCache.lastOccluder_ = occluder;
+        shadowCache.misses_++;
+        return false;
+    }
+
+    shadowCache.visible_++;
     return true;
 }
 
+static void flushShadowCacheStats()
+{
+    shadowCacheHits += shadowCache.hits_;
+    shadowCacheMisses += shadowCache.misses_;
+    shadowCacheVisible += shadowCache.visible_;
+    shadowCache.hits_ = shadowCache.misses_ = shadowCache.visible_ = 0;
+}
+
+static void printShadowCacheStats()
+{
+    long long blocked = shadowCacheHits + shadowCacheMisses;
+    long long total = blocked + shadowCacheVisible;
+    if (total == 0) return;
+    printf("Shadow rays: %lld, %.1f%% blocked, cached occluder hit rate %.1f%%\n",
+           total,
+           100.0 * blocked / total,
+           blocked ? 100.0 * shadowCacheHits / blocked : 0.0);
+}
+
 Color raytrace(const Ray &ray)
 {
+    if (ray.depth_ > MAX_RAY_DEPTH)
+        return Color(0.f, 0.f, 0.f);
+
     // we use double for vectors, rays and so on and floats for colors
-    const Node *closestNode = nullptr;
-    double closestDist = INF;
     IntersectionInfo closestInfo;
-
-    for (const auto &node : nodes) {
-        IntersectionInfo info;
-        if (!node.geometry_->intersect(ray, info))
-        {
-            continue;
-        }
-
-        if (info.distance_ < closestDist)
-        {
-            closestDist = info.distance_;
-            closestNode = &node;
-            closestInfo = info;
-        }
+    const Node *closestNode = tlas.intersect(ray, closestInfo);
+    if (ray.depth_ == 0)
+        recordAovHit(currentAovSample, closestNode ? &closestInfo : nullptr, closestNode ? int(closestNode - nodes.data()) : 0);
+    if (currentTileDeps)
+    {
+        if (closestNode) currentTileDeps->addNode(int(closestNode - nodes.data()));
+        // the camera rays are covered by the projections of the nodes
+        if (ray.depth_ > 0 && closestNode) currentTileDeps->addSegment(ray.start_, closestInfo.ip_);
+        else if (ray.depth_ > 0) currentTileDeps->unbounded_ = true;
     }
 
     // check if we hit the sky
     if (closestNode == nullptr)
     {
+        // GI bounces off diffuse surfaces don't see the environment; it is sampled directly there
+        if (environment.isOK() && !ray.diffuse_)
+            return environment.getRadiance(ray.dir_);
         return Color(0.f, 0.f, 0.f); // background color
     }
     else
@@ -124,44 +392,608 @@ Color raytrace(const Ray &ray)
     }
 }
 
-void render(int width, int height)
+/// the positions of the samples inside a pixel. Returns their count
+static int getPixelOffsets(const double (*&offsets)[2])
 {
-
-    const double kernel[5][2] = {
+    static const double kernel[5][2] = {
             {0.0, 0.0},
             {0.6, 0.0},
             {0.0, 0.6},
             {0.3, 0.3},
             {0.6, 0.6},
     };
+    static const double noAA[1][2] = {{0.0, 0.0}};
 
-    for (int y = 0; y < height; y++)
+    offsets = wantAA ? kernel : noAA;
+    return wantAA ? COUNT_OF(kernel) : COUNT_OF(noAA);
+}
+
+/// how big a part of its pixel's footprint each camera ray filters the textures over. With many samples per
+/// pixel, each covers a part of it: 1/sqrt(samples), as with a grid of them, but not under 1/8
+static double getFootprintScale(int samplesPerPixel)
+{
+    return std::max(0.125, 1 / sqrt(double(samplesPerPixel)));
+}
+
+/// identifies the pixel for its sample sequence and random stream (see seedRandomGen())
+static inline uint32_t getPixelSeed(int x, int y)
+{
+    return hash32(y * VFB_MAX_SIZE + x);
+}
+
+void renderTile(int xBegin, int yBegin, int xEnd, int yEnd)
+{
+    const double (*offsets)[2];
+    int numOffsets = getPixelOffsets(offsets);
+    double footprintScale = getFootprintScale(numOffsets);
+
+    RayBatch batch; // all rays (with the AA samples) of one row of the tile
+    for (int y = yBegin; y < yEnd; y++)
+    {
+        camera.getScreenRays(y, xBegin, xEnd, offsets, numOffsets, batch);
+
+        int index = 0;
+        for (int x = xBegin; x < xEnd; x++)
+        {
+            Color sum(0, 0, 0);
+            AovSample aov;
+            currentAovSample = aovs.isActive() ? &aov : nullptr;
+            resetRayBudget();
+            seedRandomGen(getPixelSeed(x, y), 0);
+            for (int i = 0; i < numOffsets; i++)
+            {
+                Ray ray = batch[index++];
+                ray.scaleDifferentials(footprintScale);
+                sum += raytrace(ray);
+            }
+            vfb[y][x] = sum / double(numOffsets);
+            if (currentAovSample) aovs.addSample(x, y, aov, numOffsets);
+        }
+    }
+    currentAovSample = nullptr;
+
+    flushShadowCacheStats();
+}
+
+/// renders the tile as a wavefront: first all the rays of the tile are traced to their hits, then the hits
+/// are grouped by shader and each shader shades all of its hits in one go (with their textures sampled
+/// together, and the shadow rays cast together). Secondary rays are still traced one by one.
+/// The secondary rays budget of a pixel is divided evenly between its samples
+void renderTileWavefront(int xBegin, int yBegin, int xEnd, int yEnd)
+{
+    // reused from tile to tile, so that their memory stays allocated (and in cache)
+    struct Wavefront
+    {
+        std::vector<Color> samples;
+        std::vector<ShadeItem> hits, sorted;
+        std::vector<int> hitSample, sortedSample; // which sample each hit is
+        std::vector<int> hitBucket;               // which shader each hit is for, as index in shaders
+        std::vector<Shader*> shaders;             // the different shaders hit
+        std::vector<int> bucketStart;             // where the hits of each shader start in sorted
+        std::vector<int> next;                    // where the next hit of each shader goes in sorted
+        std::vector<Color> results;
+        std::vector<AovSample> aovs;              // per pixel, if the AOVs are on
+    };
+    static thread_local Wavefront wf;
+
+    const double (*offsets)[2];
+    int numOffsets = getPixelOffsets(offsets);
+    double footprintScale = getFootprintScale(numOffsets);
+    int rowSamples = (xEnd - xBegin) * numOffsets;
+
+    wf.samples.assign((yEnd - yBegin) * rowSamples, Color(0.f, 0.f, 0.f)); // the background, unless hit
+    if (aovs.isActive()) wf.aovs.assign((yEnd - yBegin) * (xEnd - xBegin), AovSample());
+    wf.hits.resize(wf.samples.size());
+    wf.hitSample.clear();
+    wf.hitBucket.clear();
+    wf.shaders.clear();
+
+    int numHits = 0, lastBucket = -1;
+    RayBatch batch;
+    for (int y = yBegin; y < yEnd; y++)
     {
+        camera.getScreenRays(y, xBegin, xEnd, offsets, numOffsets, batch);
+        for (int i = 0; i < batch.size_; i++)
+        {
+            ShadeItem& hit = wf.hits[numHits];
+            hit.ray_ = batch[i];
+            hit.ray_.scaleDifferentials(footprintScale);
+            hit.aov_ = aovs.isActive() ? &wf.aovs[(y - yBegin) * (xEnd - xBegin) + i / numOffsets] : nullptr;
+            const Node* node = tlas.intersect(hit.ray_, hit.info_);
+            recordAovHit(hit.aov_, node ? &hit.info_ : nullptr, node ? int(node - nodes.data()) : 0);
+            if (!node)
+            {
+                // the sky, as in raytrace()
+                if (environment.isOK()) wf.samples[(y - yBegin) * rowSamples + i] = environment.getRadiance(hit.ray_.dir_);
+                continue;
+            }
+            if (currentTileDeps) currentTileDeps->addNode(int(node - nodes.data()));
 
+            // neighbouring rays mostly hit the same shader, so try the last one first
+            Shader* shader = node->shader_.get();
+            if (lastBucket < 0 || wf.shaders[lastBucket] != shader)
+            {
+                auto it = std::find(wf.shaders.begin(), wf.shaders.end(), shader);
+                lastBucket = int(it - wf.shaders.begin());
+                if (it == wf.shaders.end()) wf.shaders.push_back(shader);
+            }
+            wf.hitBucket.push_back(lastBucket);
+            wf.hitSample.push_back((y - yBegin) * rowSamples + i);
+            numHits++;
+        }
+    }
+
+    // group the hits by shader (counting sort), keeping them in pixel order inside a group
+    int numBuckets = int(wf.shaders.size());
+    wf.bucketStart.assign(numBuckets + 1, 0);
+    for (int i = 0; i < numHits; i++)
+        wf.bucketStart[wf.hitBucket[i] + 1]++;
+    for (int b = 0; b < numBuckets; b++)
+        wf.bucketStart[b + 1] += wf.bucketStart[b];
+
+    wf.sorted.resize(numHits);
+    wf.sortedSample.resize(numHits);
+    wf.next.assign(wf.bucketStart.begin(), wf.bucketStart.end() - 1);
+    for (int i = 0; i < numHits; i++)
+    {
+        int to = wf.next[wf.hitBucket[i]]++;
+        wf.sorted[to] = wf.hits[i];
+        wf.sortedSample[to] = wf.hitSample[i];
+    }
+
+    // the shaders take the random numbers of the whole tile in turn, so the stream is the tile's (as
+    // identified by its first pixel); the order of the hits in it is fixed by the sorting above
+    seedRandomGen(getPixelSeed(xBegin, yBegin), 0);
+    wf.results.resize(numHits);
+    int rayBudget = std::max(1, MAX_SECONDARY_RAYS / numOffsets);
+    for (int b = 0; b < numBuckets; b++)
+    {
+        int begin = wf.bucketStart[b];
+        wf.shaders[b]->shadeBatch(&wf.sorted[begin], wf.bucketStart[b + 1] - begin, rayBudget, &wf.results[begin]);
+    }
+    for (int i = 0; i < numHits; i++)
+        wf.samples[wf.sortedSample[i]] = wf.results[i];
+
+    int index = 0;
+    for (int y = yBegin; y < yEnd; y++)
+    {
+        for (int x = xBegin; x < xEnd; x++)
+        {
+            Color sum(0, 0, 0);
+            for (int i = 0; i < numOffsets; i++)
+                sum += wf.samples[index++];
+            vfb[y][x] = sum / double(numOffsets);
+            if (aovs.isActive()) aovs.addSample(x, y, wf.aovs[(y - yBegin) * (xEnd - xBegin) + x - xBegin], numOffsets);
+        }
+    }
+
+    flushShadowCacheStats();
+}
+
+/// adds one path per pixel of the tile to the accumulated image. Each path takes its samples
+/// (starting with the position inside the pixel) from the pixel's low-discrepancy sequence
+void renderTileGI(int xBegin, int yBegin, int xEnd, int yEnd, int pass)
+{
+    Sampler& sampler = getSampler();
+    double footprintScale = getFootprintScale(giPasses); // the passes add up to that many samples per pixel
+    for (int y = yBegin; y < yEnd; y++)
+    {
+        for (int x = xBegin; x < xEnd; x++)
+        {
+            sampler.startSample(getPixelSeed(x, y), pass);
+            double u, v;
+            sampler.next2D(u, v);
+
+            AovSample aov;
+            currentAovSample = aovs.isActive() ? &aov : nullptr;
+            resetRayBudget();
+            if (pass == 0) accumBuffer[y][x].makeZero(); // the interactive mode starts over after moving
+            Ray ray = camera.getScreenRay(x + u, y + v);
+            ray.scaleDifferentials(footprintScale);
+            accumBuffer[y][x] += raytrace(ray);
+            vfb[y][x] = accumBuffer[y][x] / float(pass + 1);
+            if (currentAovSample) aovs.addSample(x, y, aov, 1, pass);
+        }
+    }
+    currentAovSample = nullptr;
+
+    flushShadowCacheStats();
+}
+
+/// a quick preview of the tile, for the interactive mode: one ray (without AA) per step x step block of pixels
+void renderTilePreview(int xBegin, int yBegin, int xEnd, int yEnd, int step)
+{
+    for (int y = yBegin; y < yEnd; y += step)
+    {
+        for (int x = xBegin; x < xEnd; x += step)
+        {
+            resetRayBudget();
+            seedRandomGen(getPixelSeed(x, y), 0);
+            Ray ray = camera.getScreenRay(x + step * 0.5, y + step * 0.5);
+            ray.scaleDifferentials(step); // it covers the whole block
+            Color color = raytrace(ray);
+            for (int blockY = y; blockY < std::min(y + step, yEnd); blockY++)
+                for (int blockX = x; blockX < std::min(x + step, xEnd); blockX++)
+                    vfb[blockY][blockX] = color;
+        }
+    }
+
+    flushShadowCacheStats();
+}
+
+/// fills the denoiser's auxiliary buffers: the albedo, normal and depth at the first hit of each pixel,
+/// averaged over the pixel's AA samples (over a 4x4 grid in GI mode, where the samples go anywhere in the
+/// pixel). Only the primary rays are traced, and not shaded
+void renderAux(int width, int height)
+{
+    denoiser.resize(width, height);
+    ThreadPool::instance().parallelFor(height, [&] (int y) {
+        const double (*offsets)[2];
+        int numOffsets = getPixelOffsets(offsets);
+        double grid[16][2];
+        if (wantGI)
+        {
+            for (int i = 0; i < 16; i++)
+            {
+                grid[i][0] = (i % 4 + 0.5) / 4;
+                grid[i][1] = (i / 4 + 0.5) / 4;
+            }
+            offsets = grid;
+            numOffsets = 16;
+        }
         for (int x = 0; x < width; x++)
         {
-            if (wantAA)
+            Color albedo(0, 0, 0);
+            Vector normal(0, 0, 0);
+            double depth = 0;
+            for (int i = 0; i < numOffsets; i++)
             {
-                Color sum(0, 0, 0);
-                for (int i = 0; i < COUNT_OF(kernel); i++)
-                    sum += raytrace(camera.getScreenRay(x + kernel[i][0], y + kernel[i][1]));
-                vfb[y][x] = sum / double(COUNT_OF(kernel));
-            } else {
-                Ray ray = camera.getScreenRay(x, y);
-                vfb[y][x] = raytrace(ray);
+                Ray ray = camera.getScreenRay(x + offsets[i][0], y + offsets[i][1]);
+                ray.scaleDifferentials(getFootprintScale(numOffsets));
+                IntersectionInfo info;
+                const Node* node = tlas.intersect(ray, info);
+                if (node)
+                {
+                    albedo += node->shader_->getAlbedo(info);
+                    normal += faceforward(ray.dir_, info.normal_);
+                    depth += info.distance_;
+                }
+                else
+                {
+                    albedo += Color(1, 1, 1); // the background is taken as it is
+                    normal += -ray.dir_;
+                    depth += EnvironmentMap::DISTANCE;
+                }
             }
+            if (normal.lengthSqr() > 0) normal.normalize();
+            denoiser.setAux(x, y, albedo / float(numOffsets), normal, depth / numOffsets);
         }
+    });
+}
+
+/// renders the frame (or, in GI mode, the given pass of it) with all threads, tile by tile. With a previewStep,
+/// renders a preview at that reduced resolution instead. Stops early if cancelRender gets set.
+/// If tileCache is enabled, the full quality frames (without GI) record in it what their tiles depend on.
+/// An incremental render then only renders again the tiles marked dirty since, and keeps the rest of vfb
+void render(int width, int height, int pass = 0, int previewStep = 0, bool incremental = false)
+{
+    int tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+    int tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+
+    bool recording = tileCache.isEnabled() && !previewStep && !wantGI;
+    if (recording) tileCache.resize(tilesX, tilesY, int(nodes.size()));
+    if (!incremental || !recording) tileCache.invalidateAll(); // vfb gets all of it anew
+
+    ThreadPool::instance().parallelFor(tilesX * tilesY, [&] (int tile) {
+        if (cancelRender || (recording && !tileCache.isDirty(tile))) return;
+        int x = (tile % tilesX) * TILE_SIZE;
+        int y = (tile / tilesX) * TILE_SIZE;
+        int xEnd = std::min(x + TILE_SIZE, width);
+        int yEnd = std::min(y + TILE_SIZE, height);
+        if (recording) currentTileDeps = &tileCache.startTile(tile);
+        if (previewStep)
+            renderTilePreview(x, y, xEnd, yEnd, previewStep);
+        else if (wantGI)
+            renderTileGI(x, y, xEnd, yEnd, pass);
+        else if (wantWavefront)
+            renderTileWavefront(x, y, xEnd, yEnd);
+        else
+            renderTile(x, y, xEnd, yEnd);
+        if (recording)
+        {
+            currentTileDeps = nullptr;
+            tileCache.finishTile(tile);
+        }
+        tilesRendered++;
+    });
+}
+
+/// saves the rendered image, along with the AOVs if they are on (which needs an EXR file)
+static void saveImage(const char* filename, int width, int height)
+{
+    bool saved;
+    if (aovs.isActive() && extensionUpper(filename) == "EXR")
+    {
+        saved = aovs.saveEXR(filename, vfb);
+    }
+    else
+    {
+        if (aovs.isActive()) printf("The AOVs can only be saved in EXR files, saving just the image\n");
+        Bitmap image;
+        image.generateEmptyImage(width, height);
+        for (int y = 0; y < height; y++)
+            for (int x = 0; x < width; x++)
+                image.setPixel(x, y, vfb[y][x]);
+        saved = image.saveImage(filename);
     }
+    if (!saved) printf("Cannot save %s\n", filename);
+}
+
+/// compares the rendered image to a reference render (e.g. a golden image saved by an earlier version, with
+/// the same options), in 8-bit levels, as they are in a BMP file. Returns true if no channel of any pixel
+/// differs by more than `tolerance` levels. With the renders being deterministic, 0 is for bit-identical
+static bool compareWithReference(const char* filename, int width, int height, int tolerance)
+{
+    Bitmap reference;
+    if (!reference.loadImage(filename) || !reference.isOK())
+    {
+        printf("Cannot load the reference image %s\n", filename);
+        return false;
+    }
+    if (reference.getWidth() != width || reference.getHeight() != height)
+    {
+        printf("Reference %s is %dx%d, the render is %dx%d\n", filename, reference.getWidth(),
+               reference.getHeight(), width, height);
+        return false;
+    }
+
+    int maxDiff = 0, numDiffering = 0;
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            unsigned rendered = vfb[y][x].toRGB32(), expected = reference.getPixel(x, y).toRGB32();
+            int diff = 0;
+            for (int shift = 0; shift < 24; shift += 8)
+                diff = std::max(diff, abs(int((rendered >> shift) & 0xff) - int((expected >> shift) & 0xff)));
+            if (diff > 0) numDiffering++;
+            maxDiff = std::max(maxDiff, diff);
+        }
+    }
+    bool matches = maxDiff <= tolerance;
+    printf("Compared to %s: %d pixels differ, by up to %d levels (tolerance %d): %s\n", filename, numDiffering,
+           maxDiff, tolerance, matches ? "MATCH" : "MISMATCH");
+    return matches;
+}
+
+/// The interactive mode: the camera moves with WASD (Q/E down and up, shift for faster), turns by dragging
+/// with the left mouse button, and zooms with the wheel. Frames are rendered in the background, so that the
+/// input keeps being handled. While moving, they are previews at a reduced resolution, chosen so that a frame
+/// takes about frameBudgetMs. Once the camera stops, the image is refined up to the full quality (all passes,
+/// in GI mode), unless the camera moves again, which abandons the refinement frame at once. Saving the
+/// parameters file (--params) does the same: the changes are applied and the frame starts over. If they
+/// only affect a part of the last full quality frame (without GI), just the tiles of that part are rendered again
+static void runInteractive()
+{
+    const int MAX_PREVIEW_STEP = 16;
+
+    SdlObject& sdl = SdlObject::instance();
+    int width = sdl.frameWidth(), height = sdl.frameHeight();
+
+    int movingStep = 4;     // the preview step while moving, adapted to the frame budget
+    int step = movingStep;  // of the frame being rendered (0 for the full quality)
+    int pass = 0;           // of the full quality frame, in GI mode
+    bool moving = true;     // whether the frame being rendered is a preview for a moving camera
+    bool refined = false;   // whether the image is final
+    bool incremental = false; // whether the frame only renders the tiles affected by the last edits
+    std::atomic<bool> frameDone(false);
+    std::thread worker;
+    Uint32 frameStart = 0;
+
+    auto startFrame = [&] {
+        cancelRender = false;
+        frameDone = false;
+        frameStart = SDL_GetTicks();
+        worker = std::thread([&frameDone, width, height, pass, step, incremental] {
+            render(width, height, pass, step, incremental);
+            if (wantDenoise && !step && !cancelRender)
+            {
+                if (pass == 0) renderAux(width, height); // the camera has moved since the last full quality frame
+                denoiser.denoise(vfb);
+            }
+            frameDone = true;
+        });
+    };
+
+    double pendingYaw = 0, pendingPitch = 0, pendingFov = 0; // the input that isn't applied to the camera yet
+    Vector pendingMove(0, 0, 0);
+    Uint32 lastTicks = SDL_GetTicks();
+    FileWatcher paramsWatcher;
+    bool paramsChanged = false;
+    if (paramsFile && paramsWatcher.watch(paramsFile)) tileCache.enable(); // the scene will get edited
+
+    camera.frameBegin();
+    startFrame();
+    while (true)
+    {
+        UserInput input;
+        sdl.getInput(input);
+        if (input.quit) break;
+
+        Uint32 now = SDL_GetTicks();
+        double speed = (input.fast ? 200 : 50) * (now - lastTicks) / 1000.0; // units per second
+        lastTicks = now;
+        pendingMove += Vector(input.moveRight, input.moveUp, input.moveForward) * speed;
+        pendingYaw -= input.mouseX * 0.2;
+        pendingPitch -= input.mouseY * 0.2;
+        pendingFov -= input.wheel * 5;
+        paramsChanged |= paramsWatcher.hasChanged();
+        bool cameraMoved = pendingMove.lengthSqr() > 0 || pendingYaw || pendingPitch || pendingFov;
+        bool changed = cameraMoved || paramsChanged;
+
+        if (worker.joinable() && frameDone)
+        {
+            worker.join();
+            double elapsedMs = SDL_GetTicks() - frameStart;
+            sdl.displayVFB(vfb);
+
+            char title[64];
+            if (step) snprintf(title, sizeof(title), "Raytracer - preview 1/%d", step);
+            else if (wantGI) snprintf(title, sizeof(title), "Raytracer - pass %d/%d", pass + 1, giPasses);
+            else snprintf(title, sizeof(title), "Raytracer");
+            sdl.setTitle(title);
+
+            if (moving) // a halved step takes about 4 times as long
+            {
+                if (elapsedMs > frameBudgetMs && movingStep < MAX_PREVIEW_STEP) movingStep *= 2;
+                else if (elapsedMs * 4 < frameBudgetMs && movingStep > 1) movingStep /= 2;
+                moving = false;
+            }
+
+            // the next refinement: a finer preview, then the full quality
+            if (step > 1) step /= 2;
+            else if (step == 1) step = 0;
+            else if (wantGI && pass + 1 < giPasses) pass++;
+            else refined = true;
+        }
+        else if (worker.joinable() && changed && !moving)
+        {
+            // a preview while moving is short and gets finished; a refinement is abandoned
+            cancelRender = true;
+            worker.join();
+        }
+
+        if (worker.joinable()) {
+            SDL_Delay(1);
+        } else if (changed) {
+            SceneChanges edits;
+            if (paramsChanged)
+            {
+                Uint32 loadStart = SDL_GetTicks();
+                int count = sceneParams.load(paramsFile, nodes, tlas, lights, camera, &edits);
+                if (count >= 0) printf("Reloaded %s: %d changes in %ums\n", paramsFile, count, SDL_GetTicks() - loadStart);
+                paramsChanged = false;
+            }
+            camera.rotate(pendingYaw, pendingPitch);
+            camera.move(pendingMove.x_, pendingMove.y_, pendingMove.z_);
+            camera.fov_ = std::min(170.0, std::max(10.0, camera.fov_ + pendingFov));
+            camera.frameBegin();
+            pendingYaw = pendingPitch = pendingFov = 0;
+            pendingMove.makeZero();
+
+            tileCache.invalidate(edits, nodes, camera);
+            pass = 0;
+            refined = false;
+            // denoising goes over the whole image, so it needs all of it rendered anew
+            incremental = !cameraMoved && !wantGI && !wantDenoise && tileCache.countDirty() * 2 < tileCache.numTiles();
+            if (incremental)
+            {
+                step = 0;
+                moving = false;
+            }
+            else
+            {
+                step = movingStep;
+                moving = true;
+            }
+            startFrame();
+        } else if (!refined) {
+            incremental = false;
+            startFrame();
+        } else {
+            SDL_Delay(10); // nothing to do until the user does something
+        }
+    }
+
+    cancelRender = true;
+    if (worker.joinable()) worker.join();
 }
 
 int main(int argc, char **argv)
 {
-    setupScene();
+    const char* serverSocket = nullptr;
+    const char* saveFile = nullptr; // the final image (and the AOVs, if any) goes there
+    const char* referenceFile = nullptr; // the final image is compared to it, for regression tests
+    int tolerance = 0;                   // of the comparison, in 8-bit levels
+    long long leakTestRays = 0;
+    const char* sceneName = "default"; // one of scenes[]
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--gi")) wantGI = true;
+        if (!strcmp(argv[i], "--no-aa")) wantAA = false;
+        if (!strcmp(argv[i], "--wavefront")) wantWavefront = true;
+        if (!strcmp(argv[i], "--passes") && i + 1 < argc) giPasses = std::max(1, atoi(argv[++i]));
+        if (!strcmp(argv[i], "--env") && i + 1 < argc) environment.load(argv[++i]);
+        if (!strcmp(argv[i], "--interactive")) wantInteractive = true;
+        if (!strcmp(argv[i], "--frame-ms") && i + 1 < argc) frameBudgetMs = std::max(1.0, atof(argv[++i]));
+        if (!strcmp(argv[i], "--server") && i + 1 < argc) serverSocket = argv[++i];
+        if (!strcmp(argv[i], "--denoise")) wantDenoise = true;
+        if (!strcmp(argv[i], "--aov") && i + 1 < argc && !aovs.enable(argv[++i])) return 1;
+        if (!strcmp(argv[i], "--save") && i + 1 < argc) saveFile = argv[++i];
+        if (!strcmp(argv[i], "--params") && i + 1 < argc) paramsFile = argv[++i];
+        if (!strcmp(argv[i], "--scene") && i + 1 < argc) sceneName = argv[++i];
+        if (!strcmp(argv[i], "--obj") && i + 1 < argc)
+        {
+            objFile = argv[++i];
+            sceneName = "obj";
+        }
+        if (!strcmp(argv[i], "--leak-test") && i + 1 < argc) leakTestRays = std::max(1LL, atoll(argv[++i]));
+        if (!strcmp(argv[i], "--threads") && i + 1 < argc) ThreadPool::setNumThreads(std::max(1, atoi(argv[++i])));
+        if (!strcmp(argv[i], "--compare") && i + 1 < argc)
+        {
+            referenceFile = argv[++i];
+            if (i + 1 < argc && argv[i + 1][0] != '-') tolerance = std::max(0, atoi(argv[++i]));
+        }
+    }
+
+    if (leakTestRays) // a self-check of the intersection code; no scene, no window
+        return runLeakTest(leakTestRays) ? 0 : 1;
+
+    if (serverSocket) // no window: the jobs' images go to the clients
+        return runServer(serverSocket) ? 0 : 1;
+
+    if (!loadScene(sceneName))
+    {
+        printf("Cannot load the scene `%s'\n", sceneName);
+        return 1;
+    }
+    if (paramsFile && sceneParams.load(paramsFile, nodes, tlas, lights, camera) < 0 && !wantInteractive)
+        return 1; // in the interactive mode, the file may still get written
     SdlObject &sdl = SdlObject::instance();
+    if (wantInteractive)
+    {
+        printMemoryReport();
+        runInteractive();
+        return 0;
+    }
+    aovs.resize(sdl.frameWidth(), sdl.frameHeight()); // only the enabled ones get allocated
+    if (wantDenoise) denoiser.resize(sdl.frameWidth(), sdl.frameHeight()); // ahead of renderAux(), for the report
+    printMemoryReport();
     Uint32 startTicks = SDL_GetTicks();
-    render(sdl.frameWidth(), sdl.frameHeight());
+    if (wantDenoise) renderAux(sdl.frameWidth(), sdl.frameHeight());
+    if (wantGI)
+    {
+        for (int pass = 0; pass < giPasses; pass++)
+        {
+            render(sdl.frameWidth(), sdl.frameHeight(), pass);
+            sdl.displayVFB(vfb); // show the progress
+            printf("\rGI pass %d/%d", pass + 1, giPasses);
+            fflush(stdout);
+        }
+        printf("\n");
+        if (wantDenoise) denoiser.denoise(vfb);
+    }
+    else
+    {
+        render(sdl.frameWidth(), sdl.frameHeight());
+        if (wantDenoise) denoiser.denoise(vfb);
+    }
     Uint32 elapsedMs = SDL_GetTicks() - startTicks;
     printf("Render took %.2lfs\n", elapsedMs / 1000.0);
+    printShadowCacheStats();
+    if (saveFile) saveImage(saveFile, sdl.frameWidth(), sdl.frameHeight());
+    if (referenceFile) // a regression test: no waiting for the user
+        return compareWithReference(referenceFile, sdl.frameWidth(), sdl.frameHeight(), tolerance) ? 0 : 1;
     sdl.displayVFB(vfb);
     sdl.waitForUserExit();
     return 0;
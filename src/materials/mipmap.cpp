@@ -0,0 +1,112 @@
+/**
+ * @File mipmap.cpp
+ * @Brief Building and sampling the MIP maps.
+ */
+#include "mipmap.h"
+
+#include <math.h>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "utils/memory.h"
+
+/// the coordinate, wrapped around into [0, size)
+static inline int wrap(int coord, int size)
+{
+    coord %= size;
+    return coord < 0 ? coord + size : coord;
+}
+
+MipMap::MipMap(const Bitmap& image)
+{
+    if (!image.isOK() || image.getWidth() <= 0 || image.getHeight() <= 0) return;
+
+    Level full;
+    full.width_ = image.getWidth();
+    full.height_ = image.getHeight();
+    full.texels_.resize(full.width_ * full.height_);
+    for (int y = 0; y < full.height_; y++)
+        for (int x = 0; x < full.width_; x++)
+            full.texels_[y * full.width_ + x] = image.getPixel(x, y);
+    levels_.push_back(std::move(full));
+
+    while (levels_.back().width_ > 1 || levels_.back().height_ > 1) {
+        // each texel averages a 2x2 block of the previous level (or a 2x1 one, once a side is down to 1 texel).
+        // Of an odd side, the last texels are left out
+        const Level& prev = levels_.back();
+        int scaleX = prev.width_ > 1 ? 2 : 1, scaleY = prev.height_ > 1 ? 2 : 1;
+        Level level;
+        level.width_ = prev.width_ / scaleX;
+        level.height_ = prev.height_ / scaleY;
+        level.texels_.resize(level.width_ * level.height_);
+        for (int y = 0; y < level.height_; y++) {
+            for (int x = 0; x < level.width_; x++) {
+                Color sum(0, 0, 0);
+                for (int dy = 0; dy < scaleY; dy++)
+                    for (int dx = 0; dx < scaleX; dx++)
+                        sum += prev.at(x * scaleX + dx, y * scaleY + dy);
+                level.texels_[y * level.width_ + x] = sum / float(scaleX * scaleY);
+            }
+        }
+        levels_.push_back(std::move(level));
+    }
+}
+
+size_t MipMap::getMemoryUsage() const
+{
+    size_t bytes = vectorBytes(levels_);
+    for (const Level& level : levels_) bytes += vectorBytes(level.texels_);
+    return bytes;
+}
+
+Color MipMap::getTexel(int x, int y) const
+{
+    if (levels_.empty()) return Color(0, 0, 0);
+    const Level& full = levels_[0];
+    return full.at(wrap(x, full.width_), wrap(y, full.height_));
+}
+
+Color MipMap::bilinear(const Level& level, double x, double y) const
+{
+    // to the level's texels, whose centers are at +0.5
+    x = x * level.width_ / levels_[0].width_ - 0.5;
+    y = y * level.height_ / levels_[0].height_ - 0.5;
+    double x0 = floor(x), y0 = floor(y);
+    float fx = float(x - x0), fy = float(y - y0);
+    int left = wrap(int(x0), level.width_), right = left + 1 < level.width_ ? left + 1 : 0;
+    int top = wrap(int(y0), level.height_), bottom = top + 1 < level.height_ ? top + 1 : 0;
+    return (level.at(left, top) * (1 - fx) + level.at(right, top) * fx) * (1 - fy) +
+           (level.at(left, bottom) * (1 - fx) + level.at(right, bottom) * fx) * fy;
+}
+
+Color MipMap::sample(double x, double y, double size) const
+{
+    if (levels_.empty()) return Color(0, 0, 0);
+
+    // level L has texels 2^L wide
+    int last = int(levels_.size()) - 1;
+    double level = size > 1 ? log2(size) : 0;
+    if (level >= last) return bilinear(levels_[last], x, y);
+    int lower = int(level);
+    float t = float(level - lower);
+    Color result = bilinear(levels_[lower], x, y);
+    if (t > 0) result = result * (1 - t) + bilinear(levels_[lower + 1], x, y) * t;
+    return result;
+}
+
+std::shared_ptr<const MipMap> loadCachedMipMap(const char* filename)
+{
+    static std::mutex mutex;
+    static std::map<std::string, std::shared_ptr<const MipMap>> cache;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = cache.find(filename);
+    if (it != cache.end()) return it->second;
+
+    Bitmap image; // only needed until it's copied into the MIP map
+    image.loadImage(filename);
+    auto built = std::make_shared<MipMap>(image);
+    if (built->isOK()) cache[filename] = built; // the failures are retried next time
+    return built;
+}
@@ -0,0 +1,51 @@
+/**
+ * @File mipmap.h
+ * @Brief A texture image along with its prefiltered, downscaled versions, for filtered texture lookups.
+ */
+#ifndef __MIPMAP_H__
+#define __MIPMAP_H__
+
+#include <memory>
+#include <vector>
+
+#include "bitmap.h"
+
+/// A MIP map: the image, and versions of it halved again and again, down to 1x1, each averaging the texels
+/// of the one before. A lookup covering many texels (e.g. a distant, tiled floor) then costs the same as
+/// one covering a single texel, and gives their average instead of an arbitrary one of them. The image
+/// repeats in both directions
+class MipMap
+{
+public:
+    explicit MipMap(const Bitmap& image); //!< copies the image and builds the smaller levels
+    int getWidth() const { return levels_.empty() ? 0 : levels_[0].width_; }
+    int getHeight() const { return levels_.empty() ? 0 : levels_[0].height_; }
+    bool isOK() const { return !levels_.empty(); }
+    size_t getMemoryUsage() const; //!< of all the levels
+
+    /// the texel of the full image at the given position (wrapped around). Black if the image is empty
+    Color getTexel(int x, int y) const;
+    /// the image around (x, y) (in texels of the full image), filtered over `size` texels: interpolated
+    /// bilinearly in the two levels nearest to that size, and linearly between them (trilinear filtering)
+    Color sample(double x, double y, double size) const;
+
+private:
+    struct Level
+    {
+        int width_, height_;
+        std::vector<Color> texels_;
+
+        const Color& at(int x, int y) const { return texels_[y * width_ + x]; } //!< no wrapping
+    };
+
+    Color bilinear(const Level& level, double x, double y) const; //!< x and y in texels of the full image
+
+    std::vector<Level> levels_; // the full image first
+};
+
+/// loads the image file and builds its MIP map, or returns the one already built from the same file. They
+/// stay loaded until the program exits, so that rebuilding a scene (e.g. for the next job of the render
+/// server) doesn't read its textures again. Check isOK() for errors
+std::shared_ptr<const MipMap> loadCachedMipMap(const char* filename);
+
+#endif // __MIPMAP_H__
@@ -0,0 +1,114 @@
+/**
+ * @File bbox.h
+ * @Brief defines the BBox class (an axis-aligned bounding box)
+ */
+#ifndef __BBOX_H__
+#define __BBOX_H__
+
+#include <algorithm>
+
+#include "vector.h"
+#include "ray.h"
+
+struct BBox {
+    Vector vmin_, vmax_;
+
+    BBox() = default;
+    BBox(const Vector& vmin, const Vector& vmax): vmin_(vmin), vmax_(vmax) {}
+
+    /// makes an "inverted" box, which becomes valid after the first add()
+    void makeEmpty()
+    {
+        vmin_.set(+INF, +INF, +INF);
+        vmax_.set(-INF, -INF, -INF);
+    }
+
+    bool isEmpty() const { return vmin_.x_ > vmax_.x_; }
+
+    /// extends the box to contain the given point
+    void add(const Vector& point)
+    {
+        vmin_.set(std::min(vmin_.x_, point.x_), std::min(vmin_.y_, point.y_), std::min(vmin_.z_, point.z_));
+        vmax_.set(std::max(vmax_.x_, point.x_), std::max(vmax_.y_, point.y_), std::max(vmax_.z_, point.z_));
+    }
+
+    /// extends the box to contain another box
+    void add(const BBox& other)
+    {
+        vmin_.set(std::min(vmin_.x_, other.vmin_.x_), std::min(vmin_.y_, other.vmin_.y_), std::min(vmin_.z_, other.vmin_.z_));
+        vmax_.set(std::max(vmax_.x_, other.vmax_.x_), std::max(vmax_.y_, other.vmax_.y_), std::max(vmax_.z_, other.vmax_.z_));
+    }
+
+    bool inside(const Vector& point) const
+    {
+        return vmin_.x_ <= point.x_ && point.x_ <= vmax_.x_ &&
+               vmin_.y_ <= point.y_ && point.y_ <= vmax_.y_ &&
+               vmin_.z_ <= point.z_ && point.z_ <= vmax_.z_;
+    }
+
+    /// whether the two boxes have a common point
+    bool overlaps(const BBox& other) const
+    {
+        return vmin_.x_ <= other.vmax_.x_ && other.vmin_.x_ <= vmax_.x_ &&
+               vmin_.y_ <= other.vmax_.y_ && other.vmin_.y_ <= vmax_.y_ &&
+               vmin_.z_ <= other.vmax_.z_ && other.vmin_.z_ <= vmax_.z_;
+    }
+
+    Vector center() const { return (vmin_ + vmax_) * 0.5; }
+
+    int longestAxis() const
+    {
+        Vector size = vmax_ - vmin_;
+        if (size.x_ >= size.y_ && size.x_ >= size.z_) return 0;
+        return size.y_ >= size.z_ ? 1 : 2;
+    }
+
+    double surfaceArea() const
+    {
+        if (isEmpty()) return 0;
+        Vector size = vmax_ - vmin_;
+        return 2 * (size.x_ * size.y_ + size.y_ * size.z_ + size.z_ * size.x_);
+    }
+
+    /// slab test of a ray (given with the reciprocals of its direction components) against the box.
+    /// Returns true if the ray enters the box before maxDist; tNear is where (0 if the start is inside)
+    bool intersect(const Vector& start, const Vector& invDir, double maxDist, double& tNear) const
+    {
+        double tMin = 0, tMax = maxDist;
+        for (int axis = 0; axis < 3; axis++) {
+            double t1 = (vmin_[axis] - start[axis]) * invDir[axis];
+            double t2 = (vmax_[axis] - start[axis]) * invDir[axis];
+            if (t1 > t2) std::swap(t1, t2);
+            // written so that NaNs (0 * inf, for a ray lying in a slab plane) don't reject the box
+            tMin = t1 > tMin ? t1 : tMin;
+            tMax = t2 < tMax ? t2 : tMax;
+            if (tMin > tMax) return false;
+        }
+        tNear = tMin;
+        return true;
+    }
+
+    /// the same test for the whole line of the ray, both in front of and behind its start
+    bool testLine(const Vector& start, const Vector& invDir) const
+    {
+        double tMin = -INF, tMax = INF;
+        for (int axis = 0; axis < 3; axis++) {
+            double t1 = (vmin_[axis] - start[axis]) * invDir[axis];
+            double t2 = (vmax_[axis] - start[axis]) * invDir[axis];
+            if (t1 > t2) std::swap(t1, t2);
+            tMin = t1 > tMin ? t1 : tMin;
+            tMax = t2 < tMax ? t2 : tMax;
+            if (tMin > tMax) return false;
+        }
+        return true;
+    }
+
+    bool testIntersect(const Ray& ray) const
+    {
+        Vector invDir(1.0 / ray.dir_.x_, 1.0 / ray.dir_.y_, 1.0 / ray.dir_.z_);
+        double tNear;
+        return intersect(ray.start_, invDir, INF, tNear);
+    }
+};
+
+#endif // __BBOX_H__
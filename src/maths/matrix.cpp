@@ -86,3 +86,11 @@ Matrix inverseMatrix(const Matrix& m)
 	return result;
 }
 
+Matrix transposeMatrix(const Matrix& m)
+{
+	Matrix result;
+	for (int i = 0; i < 3; i++)
+		for (int j = 0; j < 3; j++)
+			result.m_[i][j] = m.m_[j][i];
+	return result;
+}
@@ -6,10 +6,70 @@
 #define RAY_H
 
 #include "vector.h"
+#include "utils/constants.h"
+
+/// how the start and the direction of a ray change from one pixel to the next, in x and in y. The rays of
+/// the neighbouring pixels are (start + dStartDx, dir + dDirDx) and so on. Where they hit the surface tells
+/// how big the pixel's footprint is there, e.g. how much of a texture it covers
+struct RayDifferentials {
+    Vector dStartDx_, dStartDy_;
+    Vector dDirDx_, dDirDy_;
+};
 
 struct Ray {
     Vector start_;
     Vector dir_; //!< normed!
+    int depth_ = 0;             //!< 0 for camera rays, +1 for each reflection/refraction
+    float contribution_ = 1.f;  //!< how much of the light this ray brings reaches the pixel
+    bool inside_ = false;       //!< true if the ray travels inside a refractive object
+    bool diffuse_ = false;      //!< a GI bounce off a diffuse surface: the environment it may reach is sampled separately
+    bool hasDifferentials_ = false; //!< whether differentials_ is set; without them the textures are point sampled
+    RayDifferentials differentials_;
+
+    /// sets the differentials of a camera ray, whose direction was normalized from one `dirLength` long, which
+    /// changes by pixelDx and pixelDy from one pixel to the next. The start is the same for all pixels
+    void setCameraDifferentials(double dirLength, const Vector& pixelDx, const Vector& pixelDy)
+    {
+        double invLength = 1 / dirLength;
+        hasDifferentials_ = true;
+        differentials_.dStartDx_.makeZero();
+        differentials_.dStartDy_.makeZero();
+        // the derivatives of the normalization
+        differentials_.dDirDx_ = (pixelDx - dir_ * dot(dir_, pixelDx)) * invLength;
+        differentials_.dDirDy_ = (pixelDy - dir_ * dot(dir_, pixelDy)) * invLength;
+    }
+
+    /// scales the footprint, e.g. by 1/sqrt(samples) when a pixel is covered by many samples, each of which
+    /// only needs to filter its share of it
+    void scaleDifferentials(double scale)
+    {
+        differentials_.dStartDx_ *= scale;
+        differentials_.dStartDy_ *= scale;
+        differentials_.dDirDx_ *= scale;
+        differentials_.dDirDy_ *= scale;
+    }
+};
+
+/// A batch of rays sharing one start point, with the directions kept in
+/// structure-of-arrays layout so they can be generated and normalized in bulk
+struct RayBatch {
+    static constexpr int MAX_SIZE = TILE_SIZE * MAX_AA_SAMPLES;
+
+    Vector start_;
+    double dirX_[MAX_SIZE], dirY_[MAX_SIZE], dirZ_[MAX_SIZE]; //!< normed!
+    int size_ = 0;
+    // for the differentials: the camera's view direction (the directions are normalized from ones which
+    // are 1 long along it) and how they change from pixel to pixel
+    Vector forward_, pixelDx_, pixelDy_;
+
+    Ray operator[] (int index) const
+    {
+        Ray ray;
+        ray.start_ = start_;
+        ray.dir_ = Vector(dirX_[index], dirY_[index], dirZ_[index]);
+        ray.setCameraDifferentials(1 / dot(ray.dir_, forward_), pixelDx_, pixelDy_);
+        return ray;
+    }
 };
 
 
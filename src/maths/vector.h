@@ -71,6 +71,16 @@ public:
 		scale(newLength / length());
 	}
 
+	inline const double& operator[] (int index) const
+	{
+		return (&x_)[index];
+	}
+
+	inline double& operator[] (int index)
+	{
+		return (&x_)[index];
+	}
+
 	double x_, y_, z_;
 
 };
@@ -136,6 +146,20 @@ inline Vector reflect(Vector in, const Vector& norm)
 	return in;
 }
 
+/// refracts the (normalized) incoming direction through a surface with the given normal, facing the
+/// incoming ray. ior is the ratio of the indices of refraction (n1 / n2). Returns a zero vector in the
+/// case of total internal reflection
+inline Vector refract(const Vector& in, const Vector& norm, double ior)
+{
+	double NdotI = dot(in, norm);
+	double k = 1 - (ior * ior) * (1 - NdotI * NdotI);
+	if (k < 0.0) // total internal reflection
+		return Vector(0, 0, 0);
+	Vector out = ior * in - (ior * NdotI + sqrt(k)) * norm;
+	out.normalize();
+	return out;
+}
+
 inline Vector faceforward(const Vector& ray, const Vector& norm)
 {
 	if (dot(ray, norm) < 0) return norm;
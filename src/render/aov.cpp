@@ -0,0 +1,124 @@
+/**
+ * @File aov.cpp
+ * @Brief Filling and saving the AOV buffers.
+ */
+#include "aov.h"
+
+#include <stdio.h>
+#include <sstream>
+
+#include <OpenEXR/ImfOutputFile.h>
+#include <OpenEXR/ImfChannelList.h>
+#include <OpenEXR/ImfFrameBuffer.h>
+#include <OpenEXR/ImfHeader.h>
+#include <OpenEXR/Iex.h>
+
+#include "utils/memory.h"
+
+thread_local AovSample* currentAovSample = nullptr;
+
+const AovBuffers::Layout AovBuffers::LAYOUTS[COUNT] = {
+    { "depth",   1, { "Z" } },
+    { "normal",  3, { "X", "Y", "Z" } },
+    { "uv",      2, { "U", "V" } },
+    { "id",      1, { "id" } },
+    { "direct",  3, { "R", "G", "B" } },
+    { "ambient", 3, { "R", "G", "B" } },
+};
+
+bool AovBuffers::enable(const std::string& names)
+{
+    std::istringstream list(names);
+    std::string name;
+    while (std::getline(list, name, ',')) {
+        if (name == "all") {
+            enabled_ = (1u << COUNT) - 1;
+            continue;
+        }
+        int type = 0;
+        while (type < COUNT && name != LAYOUTS[type].name_) type++;
+        if (type == COUNT) {
+            printf("Unknown AOV %s\n", name.c_str());
+            return false;
+        }
+        enabled_ |= 1u << type;
+    }
+    return true;
+}
+
+void AovBuffers::resize(int width, int height)
+{
+    width_ = width;
+    height_ = height;
+    for (int type = 0; type < COUNT; type++)
+        if (isEnabled(Type(type))) data_[type].assign(width * height * LAYOUTS[type].channels_, 0);
+}
+
+size_t AovBuffers::getMemoryUsage() const
+{
+    size_t bytes = 0;
+    for (const auto& data : data_) bytes += vectorBytes(data);
+    return bytes;
+}
+
+void AovBuffers::addSample(int x, int y, const AovSample& sample, int numRays, int pass)
+{
+    if (pass == 0) {
+        if (isEnabled(DEPTH)) getPixel(DEPTH, x, y)[0] = float(sample.depth_);
+        if (isEnabled(NORMAL)) {
+            float* normal = getPixel(NORMAL, x, y);
+            for (int i = 0; i < 3; i++) normal[i] = float(sample.normal_[i]);
+        }
+        if (isEnabled(UV)) {
+            getPixel(UV, x, y)[0] = float(sample.u_);
+            getPixel(UV, x, y)[1] = float(sample.v_);
+        }
+        if (isEnabled(OBJECT_ID)) getPixel(OBJECT_ID, x, y)[0] = float(sample.objectId_);
+    }
+
+    // a running average over the passes
+    auto average = [this, x, y, numRays, pass] (Type type, const Color& sum) {
+        float* pixel = getPixel(type, x, y);
+        for (int i = 0; i < 3; i++)
+            pixel[i] += (sum[i] / numRays - pixel[i]) / (pass + 1);
+    };
+    if (isEnabled(DIRECT)) average(DIRECT, sample.direct_);
+    if (isEnabled(AMBIENT)) average(AMBIENT, sample.ambient_);
+}
+
+bool AovBuffers::saveEXR(const char* filename, Color image[VFB_MAX_SIZE][VFB_MAX_SIZE]) const
+{
+    std::vector<float> rgb(width_ * height_ * 3);
+    for (int y = 0; y < height_; y++)
+        for (int x = 0; x < width_; x++)
+            for (int i = 0; i < 3; i++)
+                rgb[(y * width_ + x) * 3 + i] = image[y][x][i];
+
+    try {
+        Imf::Header header(width_, height_);
+        Imf::FrameBuffer frameBuffer;
+        auto addChannel = [&] (const std::string& name, const float* first, int stride) {
+            header.channels().insert(name, Imf::Channel(Imf::FLOAT));
+            frameBuffer.insert(name, Imf::Slice(Imf::FLOAT, (char*) first,
+                                                sizeof(float) * stride, sizeof(float) * stride * width_));
+        };
+
+        static const char* RGB[3] = { "R", "G", "B" };
+        for (int i = 0; i < 3; i++) addChannel(RGB[i], &rgb[i], 3);
+
+        for (int type = 0; type < COUNT; type++) {
+            if (!isEnabled(Type(type))) continue;
+            const Layout& layout = LAYOUTS[type];
+            for (int i = 0; i < layout.channels_; i++)
+                addChannel(std::string(layout.name_) + "." + layout.channelNames_[i], &data_[type][i], layout.channels_);
+        }
+
+        Imf::OutputFile file(filename, header);
+        file.setFrameBuffer(frameBuffer);
+        file.writePixels(height_);
+    }
+    catch (Iex::BaseExc& ex) {
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,86 @@
+/**
+ * @File aov.h
+ * @Brief Arbitrary output variables: extra per-pixel buffers (depth, normals, light components...) for compositing.
+ */
+#ifndef __AOV_H__
+#define __AOV_H__
+
+#include <string>
+#include <vector>
+
+#include "maths/vector.h"
+#include "color/color.h"
+#include "geometries/geometry.h"
+#include "utils/constants.h"
+
+/// what one pixel gives to the AOVs. The geometry comes from the pixel's first camera ray (unfiltered,
+/// so that e.g. the object IDs stay exact); the light components are summed over all of them
+struct AovSample
+{
+    bool geometrySet_ = false;  //!< the first camera ray is traced, and set the fields below
+    double depth_ = 0;          //!< the distance to the first hit; 0 for the background
+    Vector normal_ = Vector(0, 0, 0);
+    double u_ = 0, v_ = 0;
+    int objectId_ = 0;          //!< the index of the node hit, plus 1; 0 for the background
+    Color direct_ = Color(0, 0, 0);  //!< the light from the light sources, reflected by the first hits
+    Color ambient_ = Color(0, 0, 0); //!< the rest of the light they reflect (ambient, environment, GI)
+};
+
+/// the AOV sample of the pixel the thread is tracing the camera rays of. raytrace() and the shaders add to
+/// it what they find for the rays of depth 0. Null while the AOVs are off
+extern thread_local AovSample* currentAovSample;
+
+/// records the first hit of a camera ray (info is null if it hit nothing)
+inline void recordAovHit(AovSample* sample, const IntersectionInfo* info, int objectId)
+{
+    if (!sample || sample->geometrySet_) return;
+    sample->geometrySet_ = true;
+    if (!info) return;
+    sample->depth_ = info->distance_;
+    sample->normal_ = info->normal_;
+    sample->u_ = info->u_;
+    sample->v_ = info->v_;
+    sample->objectId_ = objectId + 1;
+}
+
+/// The AOV buffers of a frame, filled along with the image (without any additional rays). Only the
+/// enabled ones are allocated. They are saved together with the image, as one multi-channel EXR, where
+/// each AOV is a layer (e.g. "normal.X", "normal.Y", "normal.Z"), as compositing programs expect
+class AovBuffers
+{
+public:
+    enum Type { DEPTH, NORMAL, UV, OBJECT_ID, DIRECT, AMBIENT, COUNT };
+
+    /// enables the AOVs in the comma separated list of names (depth, normal, uv, id, direct, ambient),
+    /// or all of them. Returns false for an unknown name
+    bool enable(const std::string& names);
+    /// allocates the enabled buffers for the frame size. Until then the AOVs are inactive
+    void resize(int width, int height);
+    bool isActive() const { return enabled_ && width_ > 0; }
+    size_t getMemoryUsage() const; //!< of the buffers
+
+    /// stores the pixel's sample, whose light components are the sums of numRays camera rays. In GI mode,
+    /// each pass adds its sample to the average of the earlier ones (the geometry is from pass 0)
+    void addSample(int x, int y, const AovSample& sample, int numRays, int pass = 0);
+
+    /// saves the image (RGB) and the AOVs into an EXR file. Returns false in the case of an error
+    bool saveEXR(const char* filename, Color image[VFB_MAX_SIZE][VFB_MAX_SIZE]) const;
+
+private:
+    struct Layout
+    {
+        const char* name_;          // of the AOV, and of its layer in the EXR file
+        int channels_;
+        const char* channelNames_[3];
+    };
+    static const Layout LAYOUTS[COUNT];
+
+    bool isEnabled(Type type) const { return (enabled_ >> type) & 1; }
+    float* getPixel(Type type, int x, int y) { return &data_[type][(y * width_ + x) * LAYOUTS[type].channels_]; }
+
+    unsigned enabled_ = 0; // a bit per Type
+    int width_ = 0, height_ = 0;
+    std::vector<float> data_[COUNT]; // the channels of each pixel together
+};
+
+#endif // __AOV_H__
@@ -0,0 +1,109 @@
+/**
+ * @File denoiser.cpp
+ * @Brief Implementation of the a-trous denoiser.
+ */
+#include "denoiser.h"
+
+#include <algorithm>
+#include <math.h>
+
+#include "utils/memory.h"
+#include "utils/thread_pool.h"
+
+static const float ALBEDO_MIN = 0.01f; // the darker albedo channels would blow the noise up when divided by
+
+static inline float luminance(const Color& color)
+{
+    return color.r_ * 0.299f + color.g_ * 0.587f + color.b_ * 0.114f;
+}
+
+void Denoiser::resize(int width, int height)
+{
+    width_ = width;
+    height_ = height;
+    albedo_.assign(width * height, Color(1, 1, 1));
+    normal_.assign(width * height, Vector(0, 0, 0));
+    depth_.assign(width * height, 0);
+    lighting_[0].resize(width * height);
+    lighting_[1].resize(width * height);
+}
+
+size_t Denoiser::getMemoryUsage() const
+{
+    return vectorBytes(albedo_) + vectorBytes(normal_) + vectorBytes(depth_) + vectorBytes(lighting_[0]) +
+           vectorBytes(lighting_[1]);
+}
+
+void Denoiser::denoise(Color image[VFB_MAX_SIZE][VFB_MAX_SIZE])
+{
+    ThreadPool& pool = ThreadPool::instance();
+    auto demodulated = [] (const Color& color, const Color& albedo) {
+        return Color(color.r_ / std::max(albedo.r_, ALBEDO_MIN),
+                     color.g_ / std::max(albedo.g_, ALBEDO_MIN),
+                     color.b_ / std::max(albedo.b_, ALBEDO_MIN));
+    };
+
+    pool.parallelFor(height_, [&] (int y) {
+        for (int x = 0; x < width_; x++)
+            lighting_[0][y * width_ + x] = demodulated(image[y][x], albedo_[y * width_ + x]);
+    });
+
+    // the color differences that stop the filter shrink with each pass, as the noise does
+    int current = 0;
+    float colorSigma = colorSigma_;
+    for (int i = 0; i < iterations_; i++) {
+        filterPass(lighting_[current].data(), lighting_[1 - current].data(), 1 << i, colorSigma);
+        current = 1 - current;
+        colorSigma *= 0.5f;
+    }
+
+    pool.parallelFor(height_, [&] (int y) {
+        for (int x = 0; x < width_; x++) {
+            const Color& albedo = albedo_[y * width_ + x];
+            const Color& lighting = lighting_[current][y * width_ + x];
+            image[y][x] = Color(lighting.r_ * std::max(albedo.r_, ALBEDO_MIN),
+                                lighting.g_ * std::max(albedo.g_, ALBEDO_MIN),
+                                lighting.b_ * std::max(albedo.b_, ALBEDO_MIN));
+        }
+    });
+}
+
+void Denoiser::filterPass(const Color* in, Color* out, int step, float colorSigma) const
+{
+    static const float KERNEL[5] = { 1 / 16.f, 1 / 4.f, 3 / 8.f, 1 / 4.f, 1 / 16.f };
+
+    ThreadPool::instance().parallelFor(height_, [&] (int y) {
+        for (int x = 0; x < width_; x++) {
+            const int center = y * width_ + x;
+            const float centerLuminance = luminance(in[center]);
+            const float colorScale = 1 / (colorSigma * (centerLuminance + 0.01f));
+            const float depthScale = 1 / (depthSigma_ * std::max(depth_[center], 1e-3f));
+            const float albedoScale = 1 / albedoSigma_;
+            const Color& centerAlbedo = albedo_[center];
+
+            Color sum(0, 0, 0);
+            float weightSum = 0;
+            for (int dy = -2; dy <= 2; dy++) {
+                int sy = y + dy * step;
+                if (sy < 0 || sy >= height_) continue;
+                for (int dx = -2; dx <= 2; dx++) {
+                    int sx = x + dx * step;
+                    if (sx < 0 || sx >= width_) continue;
+                    const int other = sy * width_ + sx;
+
+                    const Color& albedo = albedo_[other];
+                    float albedoDistance = fabsf(albedo.r_ - centerAlbedo.r_) + fabsf(albedo.g_ - centerAlbedo.g_)
+                                         + fabsf(albedo.b_ - centerAlbedo.b_);
+                    float cosine = float(std::max(0.0, dot(normal_[center], normal_[other])));
+                    float weight = KERNEL[dy + 2] * KERNEL[dx + 2] * powf(cosine, normalPower_)
+                                 * expf(-fabsf(luminance(in[other]) - centerLuminance) * colorScale
+                                        - fabsf(depth_[other] - depth_[center]) * depthScale
+                                        - albedoDistance * albedoScale);
+                    sum += in[other] * weight;
+                    weightSum += weight;
+                }
+            }
+            out[center] = weightSum > 0 ? sum / weightSum : in[center];
+        }
+    });
+}
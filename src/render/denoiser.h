@@ -0,0 +1,49 @@
+/**
+ * @File denoiser.h
+ * @Brief An edge-aware denoiser for low-sample renders, guided by auxiliary buffers.
+ */
+#ifndef __DENOISER_H__
+#define __DENOISER_H__
+
+#include <vector>
+
+#include "maths/vector.h"
+#include "color/color.h"
+#include "utils/constants.h"
+
+/// An a-trous wavelet filter (Dammertz et al. 2010): a few passes of a 5x5 B3-spline kernel, spread twice
+/// as wide each pass, which stop at edges in the auxiliary buffers the renderer fills in: the albedo, the
+/// normal and the depth at the first hit of each pixel. The image is divided by the albedo before the
+/// filtering and multiplied back after it, so that only the lighting gets smoothed, not the textures
+class Denoiser
+{
+public:
+    void resize(int width, int height); //!< sets the frame size, which the auxiliary buffers are for
+    void setAux(int x, int y, const Color& albedo, const Vector& normal, double depth)
+    {
+        int index = y * width_ + x;
+        albedo_[index] = albedo;
+        normal_[index] = normal;
+        depth_[index] = float(depth);
+    }
+    /// filters the image (the frame's part of it), in place, with all threads
+    void denoise(Color image[VFB_MAX_SIZE][VFB_MAX_SIZE]);
+    size_t getMemoryUsage() const; //!< of the auxiliary and the pass buffers
+
+    int iterations_ = 4;        // the filter reaches 2^iterations_ pixels away
+    float colorSigma_ = 0.5f;   // how different (relative to the brightness) the lighting at two pixels may be
+    float normalPower_ = 64;    // how quickly the weight falls with the angle between the normals
+    float depthSigma_ = 0.05f;  // how different (relative to the depth) the depths may be
+    float albedoSigma_ = 0.3f;  // how different the albedos may be (the sum of the channels' differences)
+
+private:
+    void filterPass(const Color* in, Color* out, int step, float colorSigma) const;
+
+    int width_ = 0, height_ = 0;
+    std::vector<Color> albedo_;
+    std::vector<Vector> normal_;
+    std::vector<float> depth_;
+    std::vector<Color> lighting_[2]; // ping-pong buffers for the passes
+};
+
+#endif // __DENOISER_H__
@@ -91,6 +91,44 @@ void SdlObject::waitForUserExit(void)
     }
 }
 
+/// gathers the events pending since the last call (the mouse drags add up), and which movement keys are held
+void SdlObject::getInput(UserInput& input)
+{
+    SDL_Event ev;
+    while (SDL_PollEvent(&ev)) {
+        switch (ev.type) {
+            case SDL_QUIT:
+                input.quit = true;
+                break;
+            case SDL_KEYDOWN:
+                if (ev.key.keysym.sym == SDLK_ESCAPE) input.quit = true;
+                break;
+            case SDL_MOUSEMOTION:
+                if (ev.motion.state & SDL_BUTTON_LMASK) {
+                    input.mouseX += ev.motion.xrel;
+                    input.mouseY += ev.motion.yrel;
+                }
+                break;
+            case SDL_MOUSEWHEEL:
+                input.wheel += ev.wheel.y;
+                break;
+            default:
+                break;
+        }
+    }
+
+    const Uint8* keys = SDL_GetKeyboardState(nullptr);
+    input.moveForward = keys[SDL_SCANCODE_W] - keys[SDL_SCANCODE_S];
+    input.moveRight = keys[SDL_SCANCODE_D] - keys[SDL_SCANCODE_A];
+    input.moveUp = keys[SDL_SCANCODE_E] - keys[SDL_SCANCODE_Q];
+    input.fast = keys[SDL_SCANCODE_LSHIFT] != 0;
+}
+
+void SdlObject::setTitle(const char* title)
+{
+    if (window_) SDL_SetWindowTitle(window_, title);
+}
+
 /// returns the frame width
 int SdlObject::frameWidth(void)
 {
@@ -8,6 +8,16 @@
 #include <SDL2/SDL.h>
 #include "color/color.h"
 
+/// what the user does, for the interactive mode (see SdlObject::getInput())
+struct UserInput
+{
+    bool quit = false;
+    int mouseX = 0, mouseY = 0;   //!< how far the mouse was dragged with the left button (pixels)
+    int wheel = 0;                //!< the mouse wheel clicks, away from the user is positive
+    int moveRight = 0, moveUp = 0, moveForward = 0; //!< -1, 0 or +1 for the movement keys held (WASD, Q/E)
+    bool fast = false;            //!< shift is held
+};
+
 class SdlObject
 {
 public:
@@ -22,6 +32,8 @@ public:
     void closeGraphics(void);
     void displayVFB(Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE]); //!< displays the VFB (Virtual framebuffer) to the real one.
     void waitForUserExit(void); //!< Pause. Wait until the user closes the application
+    void getInput(UserInput& input); //!< Gets the events since the last call and the keys held now, without waiting
+    void setTitle(const char* title); //!< Sets the window title
     int frameWidth(void); //!< returns the frame width (pixels)
     int frameHeight(void); //!< returns the frame height (pixels)
 
@@ -0,0 +1,451 @@
+/**
+ * @File server.cpp
+ * @Brief Implementation of the render server: the socket protocol and the job scheduling.
+ */
+#include "server.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "color/color.h"
+#include "render/denoiser.h"
+#include "materials/bitmap.h"
+#include "scenes/camera.h"
+#include "utils/constants.h"
+
+extern Camera camera;
+extern Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE];
+extern Color accumBuffer[VFB_MAX_SIZE][VFB_MAX_SIZE];
+extern bool wantAA;
+extern bool wantGI;
+extern bool wantDenoise;
+extern Denoiser denoiser;
+extern int giPasses;
+extern std::atomic<bool> cancelRender;
+extern std::atomic<int> tilesRendered;
+
+void render(int width, int height, int pass, int previewStep, bool incremental);
+void renderAux(int width, int height);
+bool loadScene(const char* name);
+void printMemoryReport();
+
+/// a job, as submitted, and how far its rendering got
+struct RenderJob
+{
+    enum State { QUEUED, RUNNING, PAUSED, DONE, CANCELLED, FAILED };
+    enum CameraField { POSITION = 1, YAW = 2, PITCH = 4, ROLL = 8, FOV = 16 };
+
+    int id_ = 0;
+    int priority_ = 0;
+    std::string scene_ = "default";
+    Camera camera_;              // the fields in cameraFields_ override the scene's camera
+    unsigned cameraFields_ = 0;
+    bool gi_ = false, aa_ = true;
+    int passes_ = 1;             // 1 without GI
+    bool denoise_ = false;       // the final image
+
+    State state_ = QUEUED;
+    int passesDone_ = 0;
+    bool cancelRequested_ = false;
+    std::vector<Color> image_;   // RESX x RESY, after the first pass
+    std::vector<Color> accum_;   // the sum of the GI passes so far, to resume the job after another one ran
+};
+
+static const char* stateName(RenderJob::State state)
+{
+    static const char* names[] = { "queued", "running", "paused", "done", "cancelled", "failed" };
+    return names[state];
+}
+
+class RenderServer
+{
+public:
+    bool start(const char* socketPath);
+    void run(); //!< renders the jobs, until a client asks for a shutdown
+
+private:
+    static constexpr int MAX_FINISHED_JOBS = 64; // older ones are forgotten, along with their images
+
+    struct Client
+    {
+        int fd_;
+        std::string input_; // what's received, up to the end of the last complete line
+    };
+
+    void ioLoop();
+    std::string handleCommand(const std::string& line);
+    std::string submit(std::istringstream& args);
+    RenderJob* findJob(int id);   // lock held
+    RenderJob* pickJob();         // lock held: the one to render next, if any
+    void forgetFinishedJobs();    // lock held
+    void renderPass(RenderJob& job);
+
+    std::string socketPath_;
+    int listenFd_ = -1;
+    std::thread ioThread_;
+
+    std::mutex mutex_; // guards everything below
+    std::condition_variable wakeUp_; // signaled when a job is submitted, or on shutdown
+    std::map<int, std::unique_ptr<RenderJob>> jobs_; // by id, so oldest first
+    int nextId_ = 1;
+    RenderJob* running_ = nullptr;
+    bool shuttingDown_ = false;
+    bool defaultGI_ = false, defaultAA_ = true, defaultDenoise_ = false;
+    int defaultPasses_ = 1;
+
+    // used by the render loop only (forgetFinishedJobs() included)
+    std::string loadedScene_;
+    Camera sceneCamera_;
+    const RenderJob* accumOwner_ = nullptr; // whose GI passes accumBuffer holds
+};
+
+bool RenderServer::start(const char* socketPath)
+{
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        printf("The socket path %s is too long\n", socketPath);
+        return false;
+    }
+    strcpy(address.sun_path, socketPath);
+
+    listenFd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketPath); // left over from a server that didn't exit cleanly
+    if (listenFd_ < 0 || bind(listenFd_, (sockaddr*) &address, sizeof(address)) < 0 || listen(listenFd_, 16) < 0) {
+        printf("Cannot listen on %s: %s\n", socketPath, strerror(errno));
+        if (listenFd_ >= 0) close(listenFd_);
+        return false;
+    }
+    socketPath_ = socketPath;
+
+    // the command line flags become the defaults of the jobs
+    defaultGI_ = wantGI;
+    defaultAA_ = wantAA;
+    defaultDenoise_ = wantDenoise;
+    defaultPasses_ = giPasses;
+
+    ioThread_ = std::thread([this] { ioLoop(); });
+    printf("Render server listening on %s\n", socketPath);
+    return true;
+}
+
+void RenderServer::run()
+{
+    while (true)
+    {
+        RenderJob* job;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            wakeUp_.wait(lock, [this] { return shuttingDown_ || pickJob(); });
+            if (shuttingDown_) break;
+            job = pickJob();
+            job->state_ = RenderJob::RUNNING;
+            running_ = job;
+            cancelRender = false;
+        }
+
+        renderPass(*job);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        running_ = nullptr;
+        if (job->state_ == RenderJob::FAILED || job->cancelRequested_) {
+            if (!job->cancelRequested_) printf("Job %d: there's no scene %s\n", job->id_, job->scene_.c_str());
+            else job->state_ = RenderJob::CANCELLED;
+            job->image_ = std::vector<Color>();
+            job->accum_ = std::vector<Color>();
+            forgetFinishedJobs();
+        } else if (job->passesDone_ == job->passes_) {
+            job->state_ = RenderJob::DONE;
+            job->accum_ = std::vector<Color>();
+            forgetFinishedJobs();
+        } else {
+            job->state_ = RenderJob::PAUSED; // until picked again, right away unless something more important came
+        }
+    }
+
+    ioThread_.join();
+}
+
+void RenderServer::renderPass(RenderJob& job)
+{
+    if (job.scene_ != loadedScene_) {
+        if (!loadScene(job.scene_.c_str())) {
+            loadedScene_.clear(); // the old one may be gone, if the new one failed to set up
+            std::lock_guard<std::mutex> lock(mutex_);
+            job.state_ = RenderJob::FAILED;
+            return;
+        }
+        printMemoryReport();
+        loadedScene_ = job.scene_;
+        sceneCamera_ = camera;
+    }
+
+    camera = sceneCamera_;
+    if (job.cameraFields_ & RenderJob::POSITION) camera.position_ = job.camera_.position_;
+    if (job.cameraFields_ & RenderJob::YAW) camera.yaw_ = job.camera_.yaw_;
+    if (job.cameraFields_ & RenderJob::PITCH) camera.pitch_ = job.camera_.pitch_;
+    if (job.cameraFields_ & RenderJob::ROLL) camera.roll_ = job.camera_.roll_;
+    if (job.cameraFields_ & RenderJob::FOV) camera.fov_ = job.camera_.fov_;
+    camera.frameBegin();
+    wantGI = job.gi_;
+    wantAA = job.aa_;
+    giPasses = job.passes_; // the texture footprints shrink with the samples all of the job's passes add up to
+
+    // resuming after another job's passes: bring back this one's
+    if (job.gi_ && job.passesDone_ > 0 && accumOwner_ != &job)
+        for (int y = 0; y < RESY; y++)
+            std::copy(&job.accum_[y * RESX], &job.accum_[y * RESX] + RESX, accumBuffer[y]);
+    accumOwner_ = nullptr;
+
+    tilesRendered = 0;
+    render(RESX, RESY, job.passesDone_, 0, false);
+    if (cancelRender) return;
+
+    if (job.gi_) {
+        job.accum_.resize(RESX * RESY);
+        for (int y = 0; y < RESY; y++)
+            std::copy(accumBuffer[y], accumBuffer[y] + RESX, &job.accum_[y * RESX]);
+        accumOwner_ = &job;
+    }
+    if (job.denoise_ && job.passesDone_ + 1 == job.passes_) {
+        renderAux(RESX, RESY);
+        denoiser.denoise(vfb);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    job.image_.resize(RESX * RESY);
+    for (int y = 0; y < RESY; y++)
+        std::copy(vfb[y], vfb[y] + RESX, &job.image_[y * RESX]);
+    job.passesDone_++;
+}
+
+RenderJob* RenderServer::findJob(int id)
+{
+    auto it = jobs_.find(id);
+    return it == jobs_.end() ? nullptr : it->second.get();
+}
+
+RenderJob* RenderServer::pickJob()
+{
+    RenderJob* best = nullptr;
+    for (auto& entry: jobs_) {
+        RenderJob* job = entry.second.get();
+        if (job->state_ != RenderJob::QUEUED && job->state_ != RenderJob::PAUSED) continue;
+        if (!best || job->priority_ > best->priority_) best = job;
+    }
+    return best;
+}
+
+void RenderServer::forgetFinishedJobs()
+{
+    int finished = 0;
+    for (auto& entry: jobs_)
+        if (entry.second->state_ >= RenderJob::DONE) finished++;
+
+    for (auto it = jobs_.begin(); finished > MAX_FINISHED_JOBS && it != jobs_.end(); ) {
+        if (it->second->state_ >= RenderJob::DONE) {
+            if (accumOwner_ == it->second.get()) accumOwner_ = nullptr;
+            it = jobs_.erase(it);
+            finished--;
+        } else {
+            ++it;
+        }
+    }
+}
+
+void RenderServer::ioLoop()
+{
+    std::vector<Client> clients;
+    std::vector<pollfd> fds;
+    while (true)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (shuttingDown_) break;
+        }
+
+        fds.assign(1, {listenFd_, POLLIN, 0});
+        for (auto& client: clients) fds.push_back({client.fd_, POLLIN, 0});
+        if (poll(fds.data(), fds.size(), 100) <= 0) continue; // a timeout, to notice the shutdown
+
+        // backwards, so that the indices in fds stay valid while clients are removed
+        for (int i = int(clients.size()) - 1; i >= 0; i--)
+        {
+            if (!fds[i + 1].revents) continue;
+            Client& client = clients[i];
+            char buffer[4096];
+            ssize_t received = read(client.fd_, buffer, sizeof(buffer));
+            if (received <= 0) {
+                close(client.fd_);
+                clients.erase(clients.begin() + i);
+                continue;
+            }
+            client.input_.append(buffer, received);
+
+            size_t end;
+            while ((end = client.input_.find('\n')) != std::string::npos) {
+                std::string reply = handleCommand(client.input_.substr(0, end)) + "\n";
+                client.input_.erase(0, end + 1);
+                send(client.fd_, reply.data(), reply.size(), MSG_NOSIGNAL);
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listenFd_, nullptr, nullptr);
+            if (fd >= 0) clients.push_back({fd, ""});
+        }
+    }
+
+    for (auto& client: clients) close(client.fd_);
+    close(listenFd_);
+    unlink(socketPath_.c_str());
+}
+
+std::string RenderServer::handleCommand(const std::string& line)
+{
+    std::istringstream args(line);
+    std::string command;
+    args >> command;
+    if (command == "SUBMIT") return submit(args);
+
+    if (command == "SHUTDOWN") {
+        std::lock_guard<std::mutex> lock(mutex_);
+        shuttingDown_ = true;
+        cancelRender = true;
+        wakeUp_.notify_all();
+        return "OK";
+    }
+
+    if (command != "STATUS" && command != "CANCEL" && command != "RESULT")
+        return "ERROR unknown command " + command;
+
+    int id;
+    if (!(args >> id)) return "ERROR expected a job id";
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    RenderJob* job = findJob(id);
+    if (!job) return "ERROR no job " + std::to_string(id);
+
+    if (command == "STATUS") {
+        // the running pass counts by its finished tiles
+        double passes = job->passesDone_;
+        if (job == running_) {
+            int tiles = ((RESX + TILE_SIZE - 1) / TILE_SIZE) * ((RESY + TILE_SIZE - 1) / TILE_SIZE);
+            passes += double(tilesRendered) / tiles;
+        }
+        char reply[64];
+        snprintf(reply, sizeof(reply), "OK %s %d", stateName(job->state_), std::min(100, int(passes * 100 / job->passes_)));
+        return reply;
+    }
+
+    if (command == "CANCEL") {
+        if (job->state_ >= RenderJob::DONE) return std::string("ERROR the job is ") + stateName(job->state_);
+        job->cancelRequested_ = true;
+        if (job == running_) {
+            cancelRender = true; // the render loop finishes the cancellation
+        } else {
+            job->state_ = RenderJob::CANCELLED;
+            job->image_ = std::vector<Color>();
+            job->accum_ = std::vector<Color>();
+        }
+        return "OK";
+    }
+
+    // RESULT
+    std::string filename;
+    if (!(args >> filename)) return "ERROR expected a file name";
+    if (job->state_ != RenderJob::DONE) return std::string("ERROR the job is ") + stateName(job->state_);
+
+    Bitmap bitmap;
+    bitmap.generateEmptyImage(RESX, RESY);
+    for (int y = 0; y < RESY; y++)
+        for (int x = 0; x < RESX; x++)
+            bitmap.setPixel(x, y, job->image_[y * RESX + x]);
+    lock.unlock();
+
+    if (!bitmap.saveImage(filename.c_str())) return "ERROR cannot save " + filename;
+    return "OK";
+}
+
+std::string RenderServer::submit(std::istringstream& args)
+{
+    auto job = std::make_unique<RenderJob>();
+    job->gi_ = defaultGI_;
+    job->aa_ = defaultAA_;
+    job->denoise_ = defaultDenoise_;
+    int passes = defaultPasses_;
+
+    std::string arg;
+    while (args >> arg) {
+        size_t equals = arg.find('=');
+        if (equals == std::string::npos) return "ERROR expected name=value, got " + arg;
+        std::string name = arg.substr(0, equals);
+        const char* value = arg.c_str() + equals + 1;
+
+        if (name == "priority") {
+            job->priority_ = atoi(value);
+        } else if (name == "scene") {
+            job->scene_ = value;
+        } else if (name == "pos") {
+            Vector& pos = job->camera_.position_;
+            if (sscanf(value, "%lf,%lf,%lf", &pos.x_, &pos.y_, &pos.z_) != 3) return "ERROR expected pos=X,Y,Z";
+            job->cameraFields_ |= RenderJob::POSITION;
+        } else if (name == "yaw") {
+            job->camera_.yaw_ = atof(value);
+            job->cameraFields_ |= RenderJob::YAW;
+        } else if (name == "pitch") {
+            job->camera_.pitch_ = atof(value);
+            job->cameraFields_ |= RenderJob::PITCH;
+        } else if (name == "roll") {
+            job->camera_.roll_ = atof(value);
+            job->cameraFields_ |= RenderJob::ROLL;
+        } else if (name == "fov") {
+            job->camera_.fov_ = atof(value);
+            job->cameraFields_ |= RenderJob::FOV;
+        } else if (name == "gi") {
+            job->gi_ = atoi(value) != 0;
+        } else if (name == "aa") {
+            job->aa_ = atoi(value) != 0;
+        } else if (name == "denoise") {
+            job->denoise_ = atoi(value) != 0;
+        } else if (name == "passes") {
+            passes = std::max(1, atoi(value));
+        } else {
+            return "ERROR unknown setting " + name;
+        }
+    }
+    job->passes_ = job->gi_ ? passes : 1;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    job->id_ = nextId_++;
+    int id = job->id_;
+    jobs_[id] = std::move(job);
+    wakeUp_.notify_all();
+    return "OK " + std::to_string(id);
+}
+
+bool runServer(const char* socketPath)
+{
+    RenderServer server;
+    if (!server.start(socketPath)) return false;
+    server.run();
+    return true;
+}
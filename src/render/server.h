@@ -0,0 +1,29 @@
+/**
+ * @File server.h
+ * @Brief A resident render server, taking render jobs over a local socket.
+ */
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+/// Runs the render server until a client sends SHUTDOWN. Clients connect to a Unix domain socket at
+/// socketPath and send text commands, one per line. Each command gets a one-line reply, which starts
+/// with OK or ERROR:
+///
+///     SUBMIT [priority=N] [scene=NAME] [pos=X,Y,Z] [yaw=A] [pitch=A] [roll=A] [fov=A]
+///            [gi=0|1] [passes=N] [aa=0|1] [denoise=0|1]
+///                         -> OK <job id>. The camera settings left out are the scene's, the rest come
+///                            from the command line
+///     STATUS <id>         -> OK <queued|running|paused|done|cancelled|failed> <percent done>
+///     CANCEL <id>         -> OK. A running job stops after the tiles being rendered
+///     RESULT <id> <file>  -> OK, once the job is done: its image is saved to file (BMP or EXR, by the extension)
+///     SHUTDOWN            -> OK, then the server exits
+///
+/// e.g. from a shell: echo "SUBMIT priority=2 pos=0,60,-150 gi=1 passes=16" | socat - UNIX-CONNECT:/tmp/raytracer.sock
+///
+/// The jobs run one at a time on the whole thread pool, the highest priority first (the oldest of them
+/// on a tie). A GI job yields to a higher priority one between its passes (it is paused) and later
+/// resumes where it stopped; the other jobs are a single frame. The scene stays loaded from job to job
+/// and the textures are cached, so the jobs only pay for the rendering. A job fails if its scene doesn't exist. Returns false if the socket cannot be set up
+bool runServer(const char* socketPath);
+
+#endif // __SERVER_H__
@@ -0,0 +1,114 @@
+/**
+ * @File tile_cache.cpp
+ * @Brief Invalidating the tiles that a scene edit affects.
+ */
+#include "tile_cache.h"
+
+#include <math.h>
+#include <algorithm>
+
+#include "utils/constants.h"
+#include "utils/memory.h"
+
+thread_local TileDeps* currentTileDeps = nullptr;
+
+void TileCache::resize(int tilesX, int tilesY, int numNodes)
+{
+    if (tilesX == tilesX_ && tilesY == tilesY_ && numNodes == numNodes_) return;
+    tilesX_ = tilesX;
+    tilesY_ = tilesY;
+    numNodes_ = numNodes;
+    tiles_.assign(tilesX * tilesY, TileDeps());
+    dirty_.assign(tilesX * tilesY, true);
+}
+
+TileDeps& TileCache::startTile(int tile)
+{
+    TileDeps& deps = tiles_[tile];
+    deps.nodes_.assign(numNodes_, false);
+    for (BBox& box: deps.secondary_) box.makeEmpty();
+    deps.unbounded_ = false;
+    dirty_[tile] = true; // until it's finished
+    return deps;
+}
+
+int TileCache::countDirty() const
+{
+    return int(std::count(dirty_.begin(), dirty_.end(), true));
+}
+
+size_t TileCache::getMemoryUsage() const
+{
+    size_t bytes = vectorBytes(tiles_) + vectorBytes(dirty_);
+    for (const TileDeps& deps : tiles_) bytes += deps.nodes_.capacity() / 8; // a bit each
+    return bytes;
+}
+
+void TileCache::invalidateAll()
+{
+    std::fill(dirty_.begin(), dirty_.end(), true);
+}
+
+void TileCache::invalidate(const SceneChanges& changes, const std::vector<Node>& nodes, const Camera& camera)
+{
+    // the lights reach about everything, and a new camera sees everything differently
+    if (changes.lights || changes.camera || int(nodes.size()) != numNodes_) {
+        invalidateAll();
+        return;
+    }
+    for (int node: changes.shaded)
+        invalidateShader(node);
+    for (int node: changes.moved)
+        invalidateMove(node, *nodes[node].geometry_, camera);
+}
+
+void TileCache::invalidateShader(int node)
+{
+    for (int tile = 0; tile < numTiles(); tile++)
+        if (tiles_[tile].nodes_[node]) dirty_[tile] = true;
+}
+
+void TileCache::invalidateMove(int node, const Geometry& geometry, const Camera& camera)
+{
+    // where it was: the tiles whose rays hit it
+    invalidateShader(node);
+
+    BBox box;
+    if (!geometry.getBBox(box)) {
+        invalidateAll(); // unbounded, it's seen everywhere
+        return;
+    }
+
+    // where it is: the tiles its projection covers, by the projection of its box's corners...
+    double xMin = INF, yMin = INF, xMax = -INF, yMax = -INF;
+    for (int corner = 0; corner < 8; corner++) {
+        Vector point((corner & 1) ? box.vmax_.x_ : box.vmin_.x_,
+                     (corner & 2) ? box.vmax_.y_ : box.vmin_.y_,
+                     (corner & 4) ? box.vmax_.z_ : box.vmin_.z_);
+        double x, y;
+        if (!camera.project(point, x, y)) { // around or behind the camera, where it may cover any part of the screen
+            invalidateAll();
+            return;
+        }
+        xMin = std::min(xMin, x);
+        yMin = std::min(yMin, y);
+        xMax = std::max(xMax, x);
+        yMax = std::max(yMax, y);
+    }
+    // (a pixel's samples are inside of it, and a pixel's worth of margin covers the rounding)
+    double width = tilesX_ * TILE_SIZE, height = tilesY_ * TILE_SIZE;
+    auto tileOf = [] (double pixel, double size) { return int(floor(std::min(size, std::max(-1.0, pixel)) / TILE_SIZE)); };
+    int tileXBegin = std::max(0, tileOf(xMin - 1, width)), tileXEnd = std::min(tileOf(xMax + 1, width), tilesX_ - 1);
+    int tileYBegin = std::max(0, tileOf(yMin - 1, height)), tileYEnd = std::min(tileOf(yMax + 1, height), tilesY_ - 1);
+    for (int tileY = tileYBegin; tileY <= tileYEnd; tileY++)
+        for (int tileX = tileXBegin; tileX <= tileXEnd; tileX++)
+            dirty_[tileY * tilesX_ + tileX] = true;
+
+    // ... and the tiles whose other rays go through it
+    for (int tile = 0; tile < numTiles(); tile++) {
+        const TileDeps& deps = tiles_[tile];
+        if (deps.unbounded_) dirty_[tile] = true;
+        for (const BBox& piece: deps.secondary_)
+            if (!piece.isEmpty() && piece.overlaps(box)) dirty_[tile] = true;
+    }
+}
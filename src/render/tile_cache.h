@@ -0,0 +1,85 @@
+/**
+ * @File tile_cache.h
+ * @Brief Tracks what each tile of the image depends on, so that scene edits only re-render the affected tiles.
+ */
+#ifndef __TILE_CACHE_H__
+#define __TILE_CACHE_H__
+
+#include <vector>
+
+#include "maths/bbox.h"
+#include "shaders/shading.h"
+#include "scenes/camera.h"
+#include "scenes/scene_params.h"
+
+/// what the rays of one tile depended on, when it was last rendered
+struct TileDeps
+{
+    /// the segments are bounded piece by piece: their first quarters together, and so on. With the segments
+    /// of a tile mostly going the same way (e.g. towards a light), that is much tighter than a single box
+    static const int SEGMENT_PIECES = 4;
+
+    std::vector<bool> nodes_;  //!< by node index: hit by some ray of the tile, or blocked one of its shadow rays
+    BBox secondary_[SEGMENT_PIECES]; //!< bound the segments of the tile's secondary and shadow rays
+    bool unbounded_ = false;   //!< some secondary ray hit nothing, so it may have gone anywhere
+
+    void addNode(int index) { nodes_[index] = true; }
+    void addSegment(const Vector& from, const Vector& to)
+    {
+        Vector step = (to - from) / SEGMENT_PIECES, point = from;
+        secondary_[0].add(from);
+        for (int i = 1; i < SEGMENT_PIECES; i++) {
+            point += step;
+            secondary_[i - 1].add(point);
+            secondary_[i].add(point);
+        }
+        secondary_[SEGMENT_PIECES - 1].add(to);
+    }
+};
+
+/// the dependencies of the tile the thread is rendering. raytrace() and the shadow rays add to them.
+/// Null while not recording
+extern thread_local TileDeps* currentTileDeps;
+
+/// Which tiles of vfb still show the scene as it is. The full quality (non-GI) renders record, for each
+/// tile, the nodes its rays hit and the space its secondary rays went through. After an edit, a tile only
+/// needs rendering again if it hit one of the changed nodes, or if a moved node's new place is where its
+/// camera rays (checked by the node's projection on the screen) or its secondary rays go. The rest of the
+/// image stays as it is
+class TileCache
+{
+public:
+    /// starts the recording, by the full quality renders. It costs a little for each ray, so it's only
+    /// worth it where the scene gets edited between frames
+    void enable() { enabled_ = true; }
+    bool isEnabled() const { return enabled_; }
+
+    /// for a frame of that many tiles, with that many nodes in the scene. Marks everything dirty if they changed
+    void resize(int tilesX, int tilesY, int numNodes);
+
+    /// starts recording the dependencies of the tile, which is about to be rendered
+    TileDeps& startTile(int tile);
+    /// the tile is rendered, and up to date
+    void finishTile(int tile) { dirty_[tile] = false; }
+    bool isDirty(int tile) const { return dirty_[tile]; }
+    int countDirty() const;
+    int numTiles() const { return int(dirty_.size()); }
+    size_t getMemoryUsage() const; //!< of the dependencies and the flags
+
+    /// vfb no longer holds the last full quality frame (e.g. a preview went over it), or everything changed
+    void invalidateAll();
+    /// marks the tiles that the changes affect. The camera must be the one the tiles were rendered with,
+    /// unless it's among the changes
+    void invalidate(const SceneChanges& changes, const std::vector<Node>& nodes, const Camera& camera);
+
+private:
+    void invalidateShader(int node);
+    void invalidateMove(int node, const Geometry& geometry, const Camera& camera);
+
+    bool enabled_ = false;
+    int tilesX_ = 0, tilesY_ = 0, numNodes_ = 0;
+    std::vector<TileDeps> tiles_;
+    std::vector<char> dirty_; // by tile; char rather than bool, as the threads write to different tiles at once
+};
+
+#endif // __TILE_CACHE_H__
@@ -7,6 +7,8 @@
 #include "utils/util.h"
 #include "utils/constants.h"
 
+#include <algorithm>
+
 
 void Camera::frameBegin()
 {
@@ -35,19 +37,88 @@ void Camera::frameBegin()
     topLeft_    += position_;  // the milimeter list aka the view matrix
     topRight_   += position_;  // is moved around the camera with it
     bottomLeft_ += position_;
+
+    toTopLeft_ = topLeft_ - position_;
+    dx_ = (topRight_ - topLeft_) / RESX;
+    dy_ = (bottomLeft_ - topLeft_) / RESY;
+    forward_ = toTopLeft_ + (dx_ * RESX + dy_ * RESY) * 0.5;
 }
 
-Ray Camera::getScreenRay(double xScreen, double yScreen)
+void Camera::move(double right, double up, double forward)
 {
-    // the beginning of the view matrix shown in lecture 4
-    Vector throughPoint = // startPoint + diff between beg end    * num between 0 1
-                                topLeft_ + (topRight_ - topLeft_) * (xScreen / RESX)
-                                         + (bottomLeft_ - topLeft_) * (yScreen / RESY);
+    Matrix rotation = rotationAroundZ(toRadians(roll_)) *
+                      rotationAroundX(toRadians(pitch_)) *
+                      rotationAroundY(toRadians(yaw_));
+    position_ += Vector(right, up, forward) * rotation;
+}
+
+void Camera::rotate(double yawDelta, double pitchDelta)
+{
+    yaw_ += yawDelta;
+    pitch_ = std::min(89.0, std::max(-89.0, pitch_ + pitchDelta));
+}
+
+bool Camera::setParam(const std::string& name, const ParamValues& values)
+{
+    if (name == "position") return getParam(values, position_);
+    if (name == "yaw") return getParam(values, yaw_);
+    if (name == "pitch") return getParam(values, pitch_);
+    if (name == "roll") return getParam(values, roll_);
+    return name == "fov" && getParam(values, fov_);
+}
 
+Ray Camera::getScreenRay(double xScreen, double yScreen) const
+{
+    // the beginning of the view matrix shown in lecture 4
     Ray ray;
-    ray.dir_ = throughPoint - position_;
-    ray.dir_.normalize(); // directions must be normalized
+    ray.dir_ = toTopLeft_ + dx_ * xScreen + dy_ * yScreen;
+    double length = ray.dir_.length();
+    ray.dir_ /= length; // directions must be normalized
     ray.start_ = position_;
+    ray.setCameraDifferentials(length, dx_, dy_);
     return ray;
 }
 
+bool Camera::project(const Vector& point, double& xScreen, double& yScreen) const
+{
+    // the screen is at distance 1 along the view direction, and dx_ and dy_ are perpendicular to it
+    double distance = dot(point - position_, forward_);
+    if (distance < 1e-9) return false;
+
+    Vector onScreen = (point - position_) / distance - toTopLeft_;
+    xScreen = dot(onScreen, dx_) / dx_.lengthSqr();
+    yScreen = dot(onScreen, dy_) / dy_.lengthSqr();
+    return true;
+}
+
+void Camera::getScreenRays(int y, int xBegin, int xEnd, const double offsets[][2], int numOffsets, RayBatch& batch) const
+{
+    batch.start_ = position_;
+    batch.size_ = (xEnd - xBegin) * numOffsets;
+    batch.forward_ = forward_;
+    batch.pixelDx_ = dx_;
+    batch.pixelDy_ = dy_;
+
+    // first pass - the unnormalized directions, each computed from the cached pixel steps
+    int index = 0;
+    for (int x = xBegin; x < xEnd; x++) {
+        for (int i = 0; i < numOffsets; i++, index++) {
+            Vector dir = toTopLeft_ + dx_ * (x + offsets[i][0]) + dy_ * (y + offsets[i][1]);
+            batch.dirX_[index] = dir.x_;
+            batch.dirY_[index] = dir.y_;
+            batch.dirZ_[index] = dir.z_;
+        }
+    }
+
+    // second pass - normalize everything at once. There are no dependencies between
+    // iterations, so the compiler turns this into packed sqrt/div/mul instructions
+    double* __restrict dirX = batch.dirX_;
+    double* __restrict dirY = batch.dirY_;
+    double* __restrict dirZ = batch.dirZ_;
+    for (int i = 0; i < batch.size_; i++) {
+        double multiplier = 1.0 / sqrt(dirX[i] * dirX[i] + dirY[i] * dirY[i] + dirZ[i] * dirZ[i]);
+        dirX[i] *= multiplier;
+        dirY[i] *= multiplier;
+        dirZ[i] *= multiplier;
+    }
+}
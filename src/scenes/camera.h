@@ -8,12 +8,28 @@
 #include "maths/vector.h"
 #include "maths/matrix.h"
 #include "maths/ray.h"
+#include "utils/params.h"
 
 class Camera
 {
 public:
     void frameBegin(); // called before rendering to setup everything and be ready to render (some caching might be done)
-    Ray getScreenRay(double xScreen, double yScreen);
+    Ray getScreenRay(double xScreen, double yScreen) const;
+
+    /// generates the rays through pixels [xBegin..xEnd) of row y, one per (x + offsets[i]) sample.
+    /// The rays of pixel x occupy indices (x - xBegin) * numOffsets ... + numOffsets - 1 of the batch
+    void getScreenRays(int y, int xBegin, int xEnd, const double offsets[][2], int numOffsets, RayBatch& batch) const;
+    /// the inverse of getScreenRay(): where on the screen (in pixels) the point is seen. Returns false
+    /// if it's not in front of the camera
+    bool project(const Vector& point, double& xScreen, double& yScreen) const;
+
+    /// moves the camera along its own axes: to the right, up and forward. Call frameBegin() afterwards
+    void move(double right, double up, double forward);
+    /// turns the camera (angles in degrees), keeping it from looking straight up or down. Call frameBegin() afterwards
+    void rotate(double yawDelta, double pitchDelta);
+    /// sets a parameter by name (see SceneParams): position, yaw, pitch, roll or fov. Returns false if there's
+    /// no such parameter or the values don't fit it. Call frameBegin() afterwards
+    bool setParam(const std::string& name, const ParamValues& values);
 
 
 //private:
@@ -25,6 +41,9 @@ public:
 private:
     Vector topLeft_, topRight_, bottomLeft_;  // the view matrix(the milimeter paper) coords, inconvenient to be manually set
     Matrix rotation_;
+    Vector toTopLeft_;          // direction from the camera to the top left corner of the screen
+    Vector dx_, dy_;            // screen-space steps of one pixel, cached in frameBegin()
+    Vector forward_;            // the view direction, to the center of the screen (which is 1 away)
 };
 
 // y is up/down, z is forward/backward and x is left/right as in Maya studio
@@ -0,0 +1,112 @@
+/**
+ * @File scene_params.cpp
+ * @Brief Parsing and applying the scene parameters file.
+ */
+#include "scene_params.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fstream>
+
+/// removes the spaces at both ends
+static std::string trim(const std::string& text)
+{
+    size_t begin = text.find_first_not_of(" \t\r");
+    if (begin == std::string::npos) return "";
+    return text.substr(begin, text.find_last_not_of(" \t\r") - begin + 1);
+}
+
+/// the numbers in the text, separated by spaces or commas. Returns false if there's something else
+static bool parseValues(const std::string& text, ParamValues& values)
+{
+    values.clear();
+    const char* at = text.c_str();
+    while (true) {
+        while (*at == ' ' || *at == '\t' || *at == ',') at++;
+        if (!*at) return !values.empty();
+        char* end;
+        values.push_back(strtod(at, &end));
+        if (end == at) return false;
+        at = end;
+    }
+}
+
+int SceneParams::load(const char* filename, std::vector<Node>& nodes, Tlas& tlas, LightList& lights, Camera& camera,
+                      SceneChanges* changes)
+{
+    std::ifstream file(filename);
+    if (!file) {
+        printf("Cannot read %s\n", filename);
+        return -1;
+    }
+
+    int changed = 0;
+    bool geometryChanged = false, cameraChanged = false;
+    std::string line;
+    for (int lineNumber = 1; std::getline(file, line); lineNumber++) {
+        line = trim(line.substr(0, line.find('#')));
+        if (line.empty()) continue;
+
+        size_t equals = line.find('=');
+        ParamValues values;
+        if (equals == std::string::npos || !parseValues(line.substr(equals + 1), values)) {
+            printf("%s:%d: expected <object>.<parameter> = <values>\n", filename, lineNumber);
+            continue;
+        }
+        std::string name = trim(line.substr(0, equals));
+        std::string text = trim(line.substr(equals + 1));
+        auto it = applied_.find(name);
+        if (it != applied_.end() && it->second == text) continue; // as before
+
+        int node = -1;
+        Target target = apply(name, values, nodes, lights, camera, node);
+        if (target == NOTHING) {
+            printf("%s:%d: cannot set %s\n", filename, lineNumber, name.c_str());
+            continue;
+        }
+        applied_[name] = text;
+        changed++;
+        geometryChanged |= target == GEOMETRY;
+        cameraChanged |= target == CAMERA;
+
+        if (!changes) continue;
+        if (target == GEOMETRY) changes->moved.push_back(node);
+        if (target == LIGHT) changes->lights = true;
+        if (target == CAMERA) changes->camera = true;
+        if (target == SHADER) // it may be shared
+            for (int i = 0; i < int(nodes.size()); i++)
+                if (nodes[i].shader_ == nodes[node].shader_) changes->shaded.push_back(i);
+    }
+
+    if (geometryChanged) tlas.update();
+    if (cameraChanged) camera.frameBegin();
+    return changed;
+}
+
+SceneParams::Target SceneParams::apply(const std::string& name, const ParamValues& values,
+                                       std::vector<Node>& nodes, LightList& lights, Camera& camera, int& node)
+{
+    size_t dot = name.find('.');
+    if (dot == std::string::npos) return NOTHING;
+    std::string object = name.substr(0, dot), param = name.substr(dot + 1);
+
+    if (object == "camera")
+        return camera.setParam(param, values) ? CAMERA : NOTHING;
+
+    if (object.compare(0, 5, "light") == 0 && object.size() > 5) {
+        size_t index = strtoul(object.c_str() + 5, nullptr, 10);
+        if (index >= lights.size()) return NOTHING;
+        return lights[index].setParam(param, values) ? LIGHT : NOTHING;
+    }
+
+    for (node = 0; node < int(nodes.size()); node++) {
+        if (nodes[node].name_ != object) continue;
+        std::string partParam;
+        if (stripParamPrefix(param, "geometry", partParam))
+            return nodes[node].geometry_->setParam(partParam, values) ? GEOMETRY : NOTHING;
+        if (stripParamPrefix(param, "shader", partParam))
+            return nodes[node].shader_->setParam(partParam, values) ? SHADER : NOTHING;
+        return NOTHING;
+    }
+    return NOTHING;
+}
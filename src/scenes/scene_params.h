@@ -0,0 +1,62 @@
+/**
+ * @File scene_params.h
+ * @Brief Overrides of the scene's parameters from a text file, which can be reloaded while rendering.
+ */
+#ifndef __SCENE_PARAMS_H__
+#define __SCENE_PARAMS_H__
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "shaders/shading.h"
+#include "lights/light.h"
+#include "scenes/camera.h"
+#include "accel/tlas.h"
+
+/// what a load() changed, so that only the parts of the image which depend on it need rendering again
+struct SceneChanges
+{
+    std::vector<int> shaded;  //!< indices of the nodes whose shader changed (all of those which share it)
+    std::vector<int> moved;   //!< indices of the nodes whose geometry changed
+    bool lights = false;      //!< some light changed
+    bool camera = false;      //!< the camera changed
+};
+
+/// Sets parameters of the scene's objects from a text file, one per line:
+///
+///     <object>.<parameter> = <values>
+///
+/// The objects are the nodes, by name (with their geometry and shader), the lights (light0, light1...
+/// in the order they were added) and the camera. The values are one number, or three (for vectors and
+/// colors), separated by spaces or commas; '#' starts a comment. e.g.
+///
+///     csg.shader.specularExponent = 60
+///     csg.shader.texture.color1 = 1 0 0
+///     csg.geometry.right.radius = 40
+///     globe.geometry.center = 45 75 -30
+///     light0.power = 50000
+///     camera.fov = 90
+///
+/// A reload only applies the lines that changed, in place: the shaders and lights are just updated (the
+/// textures stay loaded), and moved geometry only gets the top-level structure refitted. A line that is
+/// removed leaves its parameter as it is
+class SceneParams
+{
+public:
+    /// reads the file and applies what changed since the last load. It must not run during rendering.
+    /// Returns how many parameters changed, or -1 if the file cannot be read. What changed is added to `changes`, if given
+    int load(const char* filename, std::vector<Node>& nodes, Tlas& tlas, LightList& lights, Camera& camera,
+             SceneChanges* changes = nullptr);
+
+private:
+    enum Target { NOTHING, SHADER, GEOMETRY, LIGHT, CAMERA };
+    /// sets the parameter. Returns what it belongs to (and the node's index in `node`, for a node's part),
+    /// or NOTHING if there's no such parameter
+    Target apply(const std::string& name, const ParamValues& values,
+                 std::vector<Node>& nodes, LightList& lights, Camera& camera, int& node);
+
+    std::map<std::string, std::string> applied_; // the parameters set so far, with their values as written
+};
+
+#endif // __SCENE_PARAMS_H__
@@ -0,0 +1,250 @@
+/**
+ * @File procedural.cpp
+ * @Brief Compiling and sampling procedural textures.
+ */
+#include "procedural.h"
+
+#include <algorithm>
+#include <stdint.h>
+
+static inline float intensityOf(const Color& c)
+{
+    return (c.r_ + c.g_ + c.b_) / 3;
+}
+
+static inline bool sameColor(const Color& a, const Color& b)
+{
+    return a.r_ == b.r_ && a.g_ == b.g_ && a.b_ == b.b_;
+}
+
+/// a pseudo-random value in [0..1] for each point of the integer lattice
+static inline float latticeValue(int x, int y)
+{
+    uint32_t h = uint32_t(x) * 374761393u + uint32_t(y) * 668265263u;
+    h = (h ^ (h >> 13)) * 1274126177u;
+    h ^= h >> 16;
+    return (h & 0xffffff) * (1.0f / 0xffffff);
+}
+
+/// the lattice values, smoothly interpolated
+static float valueNoise(double u, double v)
+{
+    double fx = floor(u), fy = floor(v);
+    int x = int(fx), y = int(fy);
+    float tx = float(u - fx), ty = float(v - fy);
+    tx = tx * tx * (3 - 2 * tx);
+    ty = ty * ty * (3 - 2 * ty);
+
+    float bottom = latticeValue(x, y) + (latticeValue(x + 1, y) - latticeValue(x, y)) * tx;
+    float top = latticeValue(x, y + 1) + (latticeValue(x + 1, y + 1) - latticeValue(x, y + 1)) * tx;
+    return bottom + (top - bottom) * ty;
+}
+
+ProceduralTexture::NodeRef ProceduralTexture::addNode(const Node& node)
+{
+    nodes_.push_back(node);
+    return NodeRef(nodes_.size() - 1);
+}
+
+ProceduralTexture::NodeRef ProceduralTexture::constant(const Color& color)
+{
+    return addNode({CONSTANT, {-1, -1, -1}, 0, 0, color});
+}
+
+ProceduralTexture::NodeRef ProceduralTexture::checker(NodeRef color1, NodeRef color2, double size)
+{
+    return addNode({CHECKER, {color1, color2, -1}, size / 7, 0, Color(0, 0, 0)});
+}
+
+ProceduralTexture::NodeRef ProceduralTexture::noise(double frequency, int octaves)
+{
+    return addNode({NOISE, {-1, -1, -1}, frequency, std::max(octaves, 1), Color(0, 0, 0)});
+}
+
+ProceduralTexture::NodeRef ProceduralTexture::gradient(NodeRef from, NodeRef to, double period, bool alongV)
+{
+    return addNode({GRADIENT, {from, to, -1}, 1 / period, alongV ? 1 : 0, Color(0, 0, 0)});
+}
+
+ProceduralTexture::NodeRef ProceduralTexture::mix(NodeRef a, NodeRef b, NodeRef factor)
+{
+    return addNode({MIX, {a, b, factor}, 0, 0, Color(0, 0, 0)});
+}
+
+ProceduralTexture::NodeRef ProceduralTexture::multiply(NodeRef a, NodeRef b)
+{
+    return addNode({MULTIPLY, {a, b, -1}, 0, 0, Color(0, 0, 0)});
+}
+
+ProceduralTexture::NodeRef ProceduralTexture::add(NodeRef a, NodeRef b)
+{
+    return addNode({ADD, {a, b, -1}, 0, 0, Color(0, 0, 0)});
+}
+
+void ProceduralTexture::setOutput(NodeRef output)
+{
+    // fold the constants: a node with only constant inputs becomes a constant itself, and some nodes
+    // turn out to be equal to one of their inputs (e.g. a multiplication by white). The inputs of a
+    // node always come before it, so one pass in order suffices
+    std::vector<Node> nodes(nodes_.begin(), nodes_.begin() + output + 1);
+    std::vector<int> alias(nodes.size());
+    for (int i = 0; i <= output; i++) {
+        Node& node = nodes[i];
+        alias[i] = i;
+        for (int& input: node.inputs_)
+            if (input >= 0) input = alias[input];
+
+        auto constantAt = [&nodes] (int input) { return nodes[input].type_ == CONSTANT; };
+        auto valueAt = [&nodes] (int input) { return nodes[input].value_; };
+        const int a = node.inputs_[0], b = node.inputs_[1], factor = node.inputs_[2];
+        switch (node.type_) {
+            case CHECKER:
+            case GRADIENT:
+                if (a == b || (constantAt(a) && constantAt(b) && sameColor(valueAt(a), valueAt(b))))
+                    alias[i] = a;
+                break;
+            case MIX:
+                if (a == b) {
+                    alias[i] = a;
+                } else if (constantAt(factor)) {
+                    float t = intensityOf(valueAt(factor));
+                    if (t == 0) alias[i] = a;
+                    else if (t == 1) alias[i] = b;
+                    else if (constantAt(a) && constantAt(b))
+                        node = {CONSTANT, {-1, -1, -1}, 0, 0, valueAt(a) + (valueAt(b) - valueAt(a)) * t};
+                }
+                break;
+            case MULTIPLY:
+                if (constantAt(a) && constantAt(b))
+                    node = {CONSTANT, {-1, -1, -1}, 0, 0, valueAt(a) * valueAt(b)};
+                else if (constantAt(a) && sameColor(valueAt(a), Color(1, 1, 1)))
+                    alias[i] = b;
+                else if (constantAt(b) && sameColor(valueAt(b), Color(1, 1, 1)))
+                    alias[i] = a;
+                break;
+            case ADD:
+                if (constantAt(a) && constantAt(b))
+                    node = {CONSTANT, {-1, -1, -1}, 0, 0, valueAt(a) + valueAt(b)};
+                else if (constantAt(a) && sameColor(valueAt(a), Color(0, 0, 0)))
+                    alias[i] = b;
+                else if (constantAt(b) && sameColor(valueAt(b), Color(0, 0, 0)))
+                    alias[i] = a;
+                break;
+            default:
+                break;
+        }
+    }
+    output = alias[output];
+
+    // keep only the nodes the output depends on
+    std::vector<bool> used(nodes.size(), false);
+    used[output] = true;
+    for (int i = output; i >= 0; i--)
+        if (used[i])
+            for (int input: nodes[i].inputs_)
+                if (input >= 0) used[input] = true;
+
+    std::vector<int> index(nodes.size(), -1);
+    program_.clear();
+    for (int i = 0; i <= output; i++) {
+        if (!used[i]) continue;
+        Node node = nodes[i];
+        for (int& input: node.inputs_)
+            if (input >= 0) input = index[input];
+        index[i] = int(program_.size());
+        program_.push_back(node);
+    }
+}
+
+void ProceduralTexture::evaluate(const ShadeItem* items, int count, Color* colors) const
+{
+    // a buffer of results per node. The output goes directly to colors
+    thread_local std::vector<Color> buffers;
+    if (buffers.size() < program_.size() * BATCH_SIZE)
+        buffers.resize(program_.size() * BATCH_SIZE);
+
+    const int last = int(program_.size()) - 1;
+    for (int n = 0; n <= last; n++) {
+        const Node& node = program_[n];
+        Color* out = n == last ? colors : &buffers[n * BATCH_SIZE];
+
+        // the inputs are read with a step: 1 through the results of a node, 0 for a constant
+        const Color* in[3] = {nullptr, nullptr, nullptr};
+        int steps[3] = {0, 0, 0};
+        for (int k = 0; k < 3; k++) {
+            int input = node.inputs_[k];
+            if (input < 0) continue;
+            in[k] = isConstant(input) ? &program_[input].value_ : &buffers[input * BATCH_SIZE];
+            steps[k] = isConstant(input) ? 0 : 1;
+        }
+
+        switch (node.type_) {
+            case CONSTANT:
+                if (n == last) std::fill(colors, colors + count, node.value_);
+                break;
+            case CHECKER:
+                for (int i = 0; i < count; i++) {
+                    float part2 = checkerCoverage(items[i].info_, node.param_);
+                    const Color& color1 = in[0][i * steps[0]];
+                    const Color& color2 = in[1][i * steps[1]];
+                    out[i] = part2 == 0 ? color1 : part2 == 1 ? color2 : color1 * (1 - part2) + color2 * part2;
+                }
+                break;
+            case NOISE:
+                for (int i = 0; i < count; i++) {
+                    double frequency = node.param_;
+                    float sum = 0, amplitude = 1, total = 0;
+                    for (int octave = 0; octave < node.intParam_; octave++) {
+                        sum += amplitude * valueNoise(items[i].info_.u_ * frequency, items[i].info_.v_ * frequency);
+                        total += amplitude;
+                        amplitude *= 0.5f;
+                        frequency *= 2;
+                    }
+                    float value = sum / total;
+                    out[i] = Color(value, value, value);
+                }
+                break;
+            case GRADIENT:
+                for (int i = 0; i < count; i++) {
+                    double t = (node.intParam_ ? items[i].info_.v_ : items[i].info_.u_) * node.param_;
+                    t -= floor(t);
+                    const Color& from = in[0][i * steps[0]];
+                    out[i] = from + (in[1][i * steps[1]] - from) * float(t);
+                }
+                break;
+            case MIX:
+                for (int i = 0; i < count; i++) {
+                    const Color& a = in[0][i * steps[0]];
+                    out[i] = a + (in[1][i * steps[1]] - a) * intensityOf(in[2][i * steps[2]]);
+                }
+                break;
+            case MULTIPLY:
+                for (int i = 0; i < count; i++)
+                    out[i] = in[0][i * steps[0]] * in[1][i * steps[1]];
+                break;
+            case ADD:
+                for (int i = 0; i < count; i++)
+                    out[i] = in[0][i * steps[0]] + in[1][i * steps[1]];
+                break;
+        }
+    }
+}
+
+void ProceduralTexture::sampleBatch(const ShadeItem* items, int count, Color* colors)
+{
+    if (program_.empty()) { // no output set
+        std::fill(colors, colors + count, Color(0, 0, 0));
+        return;
+    }
+    for (int start = 0; start < count; start += BATCH_SIZE)
+        evaluate(items + start, std::min(BATCH_SIZE, count - start), colors + start);
+}
+
+Color ProceduralTexture::sample(const IntersectionInfo& info)
+{
+    ShadeItem item;
+    item.info_ = info;
+    Color color;
+    sampleBatch(&item, 1, &color);
+    return color;
+}
@@ -0,0 +1,71 @@
+/**
+ * @File procedural.h
+ * @Brief A procedural texture, built as a graph of pattern and operation nodes.
+ */
+#ifndef __PROCEDURAL_H__
+#define __PROCEDURAL_H__
+
+#include <vector>
+
+#include "shading.h"
+
+/// A procedural texture: a graph of nodes, each of which makes a color from the u v coords of the hit
+/// and the colors of its input nodes. Nodes are added with the functions below (inputs first), then
+/// setOutput() folds the constant parts of the graph and drops the unused nodes. The rest is evaluated
+/// over batches of samples, one node at a time, so the choice of node is made once per batch.
+///
+/// e.g. a checker of red and marble-ish noise:
+///     auto tex = std::make_unique<ProceduralTexture>();
+///     auto marble = tex->mix(tex->constant(Color(0.2f, 0.2f, 0.3f)), tex->constant(Color(1, 1, 1)), tex->noise(0.1, 4));
+///     tex->setOutput(tex->checker(tex->constant(Color(1, 0, 0)), marble, 2));
+class ProceduralTexture: public Texture
+{
+public:
+    using NodeRef = int; //!< a node of this texture's graph
+
+    NodeRef constant(const Color& color);
+    /// the same pattern as CheckerTexture's, box filtered over the pixel's footprint the same way
+    NodeRef checker(NodeRef color1, NodeRef color2, double size = 1);
+    /// value noise in [0..1] (as grey), with features of about 1/frequency. Each octave adds half
+    /// as strong noise at twice the frequency
+    NodeRef noise(double frequency, int octaves = 1);
+    /// a gradient along u (or v), repeated every `period` units
+    NodeRef gradient(NodeRef from, NodeRef to, double period = 1, bool alongV = false);
+    /// blends from a to b by the intensity of factor
+    NodeRef mix(NodeRef a, NodeRef b, NodeRef factor);
+    NodeRef multiply(NodeRef a, NodeRef b);
+    NodeRef add(NodeRef a, NodeRef b);
+
+    /// sets the node whose color is the texture's, and compiles the graph for sampling
+    void setOutput(NodeRef node);
+
+    Color sample(const IntersectionInfo& info) override;
+    void sampleBatch(const ShadeItem* items, int count, Color* colors) override;
+    void reportMemory(MemoryReport& report) const override //!< the graph
+    {
+        report.add(MemoryCategory::SHADERS, vectorBytes(nodes_) + vectorBytes(program_));
+    }
+
+private:
+    static constexpr int BATCH_SIZE = 64;
+
+    enum NodeType { CONSTANT, CHECKER, NOISE, GRADIENT, MIX, MULTIPLY, ADD };
+
+    struct Node
+    {
+        NodeType type_;
+        int inputs_[3];
+        double param_;  // folded at creation: the checker's cells per unit, the noise's frequency, the gradient's 1/period
+        int intParam_;  // the noise's octaves, the gradient's axis (0 for u, 1 for v)
+        Color value_;   // for CONSTANT
+    };
+
+    NodeRef addNode(const Node& node);
+    bool isConstant(int node) const { return program_[node].type_ == CONSTANT; }
+    void evaluate(const ShadeItem* items, int count, Color* colors) const;
+
+    std::vector<Node> nodes_;   // as added
+    std::vector<Node> program_; // the compiled graph, in evaluation order; the last one is the output
+};
+
+#endif // __PROCEDURAL_H__
@@ -3,85 +3,504 @@
  * @Brief Contains implementations of shader classes
  */
 #include "shading.h"
+#include "lights/light.h"
+#include "lights/environment.h"
+#include "utils/sampling.h"
+#include "render/aov.h"
 
-extern Vector lightPosition;
-extern double lightIntensity;
+#include <algorithm>
+#include <vector>
+
+extern LightList lights;
 extern Color ambientLight;
+extern EnvironmentMap environment;
+extern bool wantGI;
 
 bool visibilityCheck(const Vector& start, const Vector& end);
+Color raytrace(const Ray& ray);
+
+// secondary rays, which would bring less than that to the pixel, are subject to Russian roulette
+constexpr float RUSSIAN_ROULETTE_THRESHOLD = 0.1f;
+
+static thread_local int rayBudget = MAX_SECONDARY_RAYS;
+
+void resetRayBudget(int budget)
+{
+    rayBudget = budget;
+}
+
+/// the differentials of a ray reflected (for eta == 0) or refracted (from the direction `dir`, with eta the ratio
+/// of the indices of refraction) at the hit of parent, with normal facing parent. The surface is taken as flat
+/// there: its curvature doesn't spread (or focus) the neighbouring rays any further. Returns false if the hit
+/// has no differentials
+static bool getSecondaryDifferentials(const Ray& parent, const IntersectionInfo& info, const Vector& normal,
+                                      double eta, const Vector& dir, RayDifferentials& differentials)
+{
+    if (!info.hasDifferentials_) return false;
+    differentials.dStartDx_ = info.dpdx_;
+    differentials.dStartDy_ = info.dpdy_;
+    const Vector& dDirDx = parent.differentials_.dDirDx_;
+    const Vector& dDirDy = parent.differentials_.dDirDy_;
+    if (eta == 0) { // dir = parentDir - 2 * dot(parentDir, normal) * normal
+        differentials.dDirDx_ = dDirDx - normal * (2 * dot(dDirDx, normal));
+        differentials.dDirDy_ = dDirDy - normal * (2 * dot(dDirDy, normal));
+        return true;
+    }
+    // dir = eta * parentDir + mu * normal, where mu = eta * cosIn - cosOut; the derivatives of that
+    double cosIn = -dot(parent.dir_, normal), cosOut = -dot(dir, normal);
+    if (cosOut < 1e-6) return false; // at the critical angle, where they change without bound
+    double dMuDCosIn = eta - eta * eta * cosIn / cosOut;
+    differentials.dDirDx_ = dDirDx * eta - normal * (dMuDCosIn * dot(dDirDx, normal));
+    differentials.dDirDy_ = dDirDy * eta - normal * (dMuDCosIn * dot(dDirDy, normal));
+    return true;
+}
+
+/// traces a secondary ray from a surface hit by parent, which carries `weight` of the light arriving
+/// there. The ray tree is bounded by the maximal depth and the per-pixel budget; branches bringing
+/// little to the pixel are randomly cut, while the ones that survive are amplified accordingly, so
+/// on average the result stays the same. The ray gets the differentials, if given
+static Color traceSecondary(const Ray& parent, const Vector& start, const Vector& dir, float weight, bool inside,
+                            bool diffuse = false, const RayDifferentials* differentials = nullptr)
+{
+    Ray ray;
+    ray.start_ = start;
+    ray.dir_ = dir;
+    ray.depth_ = parent.depth_ + 1;
+    ray.contribution_ = parent.contribution_ * weight;
+    ray.inside_ = inside;
+    ray.diffuse_ = diffuse;
+    if (differentials) {
+        ray.hasDifferentials_ = true;
+        ray.differentials_ = *differentials;
+    }
+
+    if (ray.depth_ > MAX_RAY_DEPTH || rayBudget <= 0 || ray.contribution_ <= 0)
+        return Color(0.f, 0.f, 0.f);
+
+    float amplify = 1.f;
+    if (ray.contribution_ < RUSSIAN_ROULETTE_THRESHOLD) {
+        float survival = ray.contribution_ / RUSSIAN_ROULETTE_THRESHOLD;
+        if (randomFloat() >= survival)
+            return Color(0.f, 0.f, 0.f);
+        amplify = 1.f / survival;
+        ray.contribution_ = RUSSIAN_ROULETTE_THRESHOLD;
+    }
+
+    rayBudget--;
+    return raytrace(ray) * (weight * amplify);
+}
+
+/// goes through all (selected) light samples for the point, evaluating the brdf for each one with the
+/// direction to the light. Calls visit(lightPos, reflected) for the samples which the brdf reflects
+template <typename BRDF, typename Visit>
+static void forEachLightSample(const IntersectionInfo& info, BRDF&& brdf, Visit&& visit)
+{
+    SelectedLight selected[LightList::MAX_SELECTED];
+    int numSelected = lights.select(info.ip_, selected);
+
+    for (int i = 0; i < numSelected; i++) {
+        const Light& light = *selected[i].light_;
+        for (int sample = 0; sample < light.getNumSamples(); sample++) {
+            Vector lightPos;
+            Color lightColor;
+            light.getNthSample(sample, info.ip_, lightPos, lightColor);
+
+            Vector toLight = lightPos - info.ip_;
+            toLight.normalize();
+            Color reflected = brdf(toLight) * lightColor;
+            if (reflected.intensity() <= 0)
+                continue;
+
+            visit(lightPos, reflected * selected[i].weight_);
+        }
+    }
+}
+
+/// sums the light reaching the point from all (selected) light samples, as reflected by the given brdf.
+/// The brdf gets the direction to the light and is evaluated first, so no shadow rays are cast for
+/// samples it doesn't reflect anyway
+template <typename BRDF>
+Color getLightContribution(const IntersectionInfo& info, BRDF&& brdf)
+{
+    Color result(0.f, 0.f, 0.f);
+    forEachLightSample(info, brdf, [&] (const Vector& lightPos, const Color& reflected) {
+        if (visibilityCheck(info.offsetStart(lightPos - info.ip_), lightPos))
+            result += reflected;
+    });
+    return result;
+}
+
+/// a shadow ray of a batch, with the light it brings to its item if nothing blocks it
+struct ShadowQuery
+{
+    Vector start, end;
+    Color light;
+    int item;
+};
+
+/// the scratch buffers of the batched shading, per thread: reused from batch to batch, so that their memory
+/// stays allocated. Only the wavefront's shadeBatch() calls use them; the secondary rays are shaded one by one
+struct BatchScratch
+{
+    std::vector<ShadowQuery> queries;
+    std::vector<Color> diffuse;
+};
+static thread_local BatchScratch batchScratch;
 
-double getLightContribution(const IntersectionInfo& info)  // calculates the amount of light
-{                                                          // that gets to the point
+/// the batched getLightContribution(): the light samples of all items are evaluated first (with
+/// brdf(i, toLight) for items[i]), then all the shadow rays are cast in one go. Sets results[i]
+template <typename BRDF>
+static void getLightContributions(const ShadeItem* items, int count, BRDF&& brdf, Color* results)
+{
+    std::vector<ShadowQuery>& queries = batchScratch.queries;
+    queries.clear();
+    for (int i = 0; i < count; i++) {
+        const IntersectionInfo& info = items[i].info_;
+        results[i] = Color(0.f, 0.f, 0.f);
+        forEachLightSample(info,
+                           [&] (const Vector& toLight) { return brdf(i, toLight); },
+                           [&] (const Vector& lightPos, const Color& reflected) {
+                               queries.push_back({info.offsetStart(lightPos - info.ip_), lightPos, reflected, i});
+                           });
+    }
+
+    for (const ShadowQuery& query : queries)
+        if (visibilityCheck(query.start, query.end))
+            results[query.item] += query.light;
+}
+
+/// in GI mode, the light coming to the point from the other surfaces: traced with one bounce ray,
+/// distributed as the cosine. Then the cosine and the pdf cancel out, leaving only the diffuse color
+/// (the direct lighting considers the light power as already divided by PI)
+static Color getIndirectDiffuse(const Ray& ray, const IntersectionInfo& info, const Color& diffuse)
+{
+    float albedo = std::max(diffuse.r_, std::max(diffuse.g_, diffuse.b_));
+    if (albedo <= 0)
+        return Color(0.f, 0.f, 0.f);
+
+    Vector normal = faceforward(ray.dir_, info.normal_);
+    double u, v;
+    getSampler().next2D(u, v);
+    Vector dir = cosineHemisphereSample(normal, u, v);
+
+    return traceSecondary(ray, info.offsetStart(dir), dir, albedo, ray.inside_, true) * diffuse / albedo;
+}
 
-    double distanceToLightSqr = (info.ip_ - lightPosition).lengthSqr();  // the distance to the light ^2
+/// in GI mode, the light coming to the point directly from the environment map: one shadow ray, in a
+/// direction picked proportionally to the map's luminance
+static Color getEnvironmentLight(const Ray& ray, const IntersectionInfo& info, const Color& diffuse)
+{
+    Vector normal = faceforward(ray.dir_, info.normal_);
+    double u, v;
+    getSampler().next2D(u, v);
+    Vector dir;
+    double pdf;
+    Color radiance = environment.sample(u, v, dir, pdf);
 
-    if(!visibilityCheck(info.ip_ + info.normal_ * 1e-6, lightPosition))
-        return 0;
-    else
-        return lightIntensity/distanceToLightSqr; // by taking away from light the intensity reduces with 1/dist^2
+    double cosTheta = dot(dir, normal);
+    if (pdf <= 0 || cosTheta <= 0)
+        return Color(0.f, 0.f, 0.f);
+    if (!visibilityCheck(info.offsetStart(dir), info.ip_ + dir * EnvironmentMap::DISTANCE))
+        return Color(0.f, 0.f, 0.f);
+    return diffuse * radiance * float(cosTheta / (PI * pdf));
+}
 
+/// adds the light components of a camera ray's hit to its pixel's AOVs
+static inline void recordAovLight(AovSample* sample, const Ray& ray, const Color& direct, const Color& ambient)
+{
+    if (!sample || ray.depth_ > 0) return;
+    sample->direct_ += direct;
+    sample->ambient_ += ambient;
+}
 
+/// the light, coming to the point from elsewhere than the light sources
+static Color getAmbient(const Ray& ray, const IntersectionInfo& info, const Color& diffuse)
+{
+    if (wantGI) {
+        Color result = getIndirectDiffuse(ray, info, diffuse);
+        if (environment.isOK())
+            result += getEnvironmentLight(ray, info, diffuse);
+        return result;
+    }
+    if (environment.isOK())
+        return environment.getDiffuse(faceforward(ray.dir_, info.normal_)) * diffuse;
+    return ambientLight * diffuse; // used for better looking shadow
 }
 
 Color Lambert::shade(const Ray& ray, IntersectionInfo& info)
 {
     Color diffuse = texture_ ? texture_->sample(info) : color_;
 
-    Vector v1 = info.normal_;
-    Vector v2 = lightPosition - info.ip_;
-    v2.normalize();
+    Color fromLights = getLightContribution(info, [&] (const Vector& toLight) {
+        double lambertCoeff = dot(info.normal_, toLight); // take the angle between the light and the normal
+        return lambertCoeff > 0 ? diffuse * float(lambertCoeff) : Color(0.f, 0.f, 0.f);
+    });
+
+    Color ambient = getAmbient(ray, info, diffuse);
+    recordAovLight(currentAovSample, ray, fromLights, ambient);
+    return ambient + fromLights;
+}
+
+void Shader::shadeBatch(ShadeItem* items, int count, int rayBudget, Color* results)
+{
+    AovSample* pixelAov = currentAovSample;
+    for (int i = 0; i < count; i++) {
+        resetRayBudget(rayBudget);
+        currentAovSample = items[i].aov_;
+        results[i] = shade(items[i].ray_, items[i].info_);
+    }
+    currentAovSample = pixelAov;
+}
+
+/// the diffuse colors at the items' hits: from the texture, if there's one. In the thread's scratch buffer
+static const Color* getDiffuseColors(Texture* texture, const Color& color, const ShadeItem* items, int count)
+{
+    std::vector<Color>& diffuse = batchScratch.diffuse;
+    diffuse.assign(count, color);
+    if (texture)
+        texture->sampleBatch(items, count, diffuse.data());
+    return diffuse.data();
+}
 
-    double lambertCoeff = dot(v1, v2);              // take the angle between the light and the normal and the light
+void Lambert::shadeBatch(ShadeItem* items, int count, int rayBudget, Color* results)
+{
+    const Color* diffuse = getDiffuseColors(texture_.get(), color_, items, count);
+
+    getLightContributions(items, count, [&] (int i, const Vector& toLight) {
+        double lambertCoeff = dot(items[i].info_.normal_, toLight);
+        return lambertCoeff > 0 ? diffuse[i] * float(lambertCoeff) : Color(0.f, 0.f, 0.f);
+    }, results);
 
-    return ambientLight * diffuse + // used for better looking shadow
-           diffuse * lambertCoeff * getLightContribution(info);
+    for (int i = 0; i < count; i++) {
+        resetRayBudget(rayBudget);
+        Color ambient = getAmbient(items[i].ray_, items[i].info_, diffuse[i]);
+        recordAovLight(items[i].aov_, items[i].ray_, results[i], ambient);
+        results[i] = ambient + results[i];
+    }
+}
+
+bool Lambert::setParam(const std::string& name, const ParamValues& values)
+{
+    std::string textureParam;
+    if (stripParamPrefix(name, "texture", textureParam)) return texture_ && texture_->setParam(textureParam, values);
+    return name == "color" && getParam(values, color_);
 }
 
 Color Phong::shade(const Ray &ray, IntersectionInfo &info)
 {
     Color diffuse = texture_ ? texture_->sample(info) : color_;
+    Vector toCamera = -ray.dir_;
 
-    Vector v1 = info.normal_;
-    Vector v2 = lightPosition - info.ip_;
-    v2.normalize();
-    double fromLight = getLightContribution(info);
+    Color fromLights = getLightContribution(info, [&] (const Vector& toLight) {
+        double lambertCoeff = dot(info.normal_, toLight); // take the angle between the light and the normal
+        if (lambertCoeff <= 0) return Color(0.f, 0.f, 0.f);
 
-    double lambertCoeff = dot(v1, v2);              // take the angle between the light and the normal and the light
+        Vector r = reflect(-toLight, info.normal_);
+        double cosGamma = dot(toCamera, r);
+        double phongCoeff = cosGamma > 0 ? pow(cosGamma, specularExponent_) :  0;
 
-    Vector r = reflect(info.ip_ - lightPosition, info.normal_);
-    Vector toCamera = -ray.dir_;
-    double cosGamma = dot(toCamera, r);
-    double phongCoeff = cosGamma > 0 ? pow(cosGamma, specularExponent_) :  0;
+        return diffuse * float(lambertCoeff + phongCoeff * specularMultiplier_);
+    });
 
-    return ambientLight * diffuse +
-           diffuse * (lambertCoeff * fromLight + phongCoeff * specularMultiplier_ * fromLight);
+    Color ambient = getAmbient(ray, info, diffuse);
+    recordAovLight(currentAovSample, ray, fromLights, ambient);
+    return ambient + fromLights;
+}
+
+void Phong::shadeBatch(ShadeItem* items, int count, int rayBudget, Color* results)
+{
+    const Color* diffuse = getDiffuseColors(texture_.get(), color_, items, count);
+
+    getLightContributions(items, count, [&] (int i, const Vector& toLight) {
+        const IntersectionInfo& info = items[i].info_;
+        double lambertCoeff = dot(info.normal_, toLight);
+        if (lambertCoeff <= 0) return Color(0.f, 0.f, 0.f);
+
+        Vector r = reflect(-toLight, info.normal_);
+        double cosGamma = dot(-items[i].ray_.dir_, r);
+        double phongCoeff = cosGamma > 0 ? pow(cosGamma, specularExponent_) :  0;
+
+        return diffuse[i] * float(lambertCoeff + phongCoeff * specularMultiplier_);
+    }, results);
+
+    for (int i = 0; i < count; i++) {
+        resetRayBudget(rayBudget);
+        Color ambient = getAmbient(items[i].ray_, items[i].info_, diffuse[i]);
+        recordAovLight(items[i].aov_, items[i].ray_, results[i], ambient);
+        results[i] = ambient + results[i];
+    }
+}
+
+bool Phong::setParam(const std::string& name, const ParamValues& values)
+{
+    std::string textureParam;
+    if (stripParamPrefix(name, "texture", textureParam)) return texture_ && texture_->setParam(textureParam, values);
+    if (name == "specularMultiplier") return getParam(values, specularMultiplier_);
+    if (name == "specularExponent") return getParam(values, specularExponent_);
+    return name == "color" && getParam(values, color_);
+}
+
+Color Reflection::shade(const Ray& ray, IntersectionInfo& info)
+{
+    Vector normal = faceforward(ray.dir_, info.normal_);
+    Vector reflected = reflect(ray.dir_, normal);
+
+    RayDifferentials differentials;
+    bool hasDifferentials = getSecondaryDifferentials(ray, info, normal, 0, reflected, differentials);
+    return traceSecondary(ray, info.offsetStart(reflected), reflected, float(multiplier_), ray.inside_, false,
+                          hasDifferentials ? &differentials : nullptr);
+}
+
+bool Reflection::setParam(const std::string& name, const ParamValues& values)
+{
+    return name == "multiplier" && getParam(values, multiplier_);
+}
+
+/// Schlick's approximation of the reflected fraction of the light. cosTheta is taken on the
+/// side of the less dense medium
+static double fresnel(double cosTheta, double ior)
+{
+    double r0 = sqr((ior - 1) / (ior + 1));
+    return r0 + (1 - r0) * pow(1 - cosTheta, 5);
+}
+
+Color Refraction::shade(const Ray& ray, IntersectionInfo& info)
+{
+    // the normals of some geometries always face the ray, so whether we enter or leave the
+    // object is tracked by the ray itself
+    Vector normal = faceforward(ray.dir_, info.normal_);
+    double eta = ray.inside_ ? ior_ : 1.0 / ior_;
+    Vector refracted = refract(ray.dir_, normal, eta);
+
+    double reflectedPart = 1.0; // total internal reflection
+    if (refracted.lengthSqr() > 0) {
+        double cosTheta = ray.inside_ ? -dot(refracted, normal) : -dot(ray.dir_, normal);
+        reflectedPart = fresnel(cosTheta, ior_);
+    }
+
+    Color result(0.f, 0.f, 0.f);
+    RayDifferentials differentials;
+    if (reflectedPart < 1.0) {
+        bool hasDifferentials = getSecondaryDifferentials(ray, info, normal, eta, refracted, differentials);
+        result += traceSecondary(ray, info.offsetStart(refracted), refracted,
+                                 float((1 - reflectedPart) * multiplier_), !ray.inside_, false,
+                                 hasDifferentials ? &differentials : nullptr);
+    }
+    Vector reflected = reflect(ray.dir_, normal);
+    bool hasDifferentials = getSecondaryDifferentials(ray, info, normal, 0, reflected, differentials);
+    result += traceSecondary(ray, info.offsetStart(reflected), reflected,
+                             float(reflectedPart * multiplier_), ray.inside_, false,
+                             hasDifferentials ? &differentials : nullptr);
+    return result;
+}
+
+bool Refraction::setParam(const std::string& name, const ParamValues& values)
+{
+    if (name == "ior") return getParam(values, ior_);
+    return name == "multiplier" && getParam(values, multiplier_);
+}
+
+/// the integral of the pattern 0, 1, 0, 1... (1 on the cells with odd floor(x)) from 0 to x
+static double oddCellsIntegral(double x)
+{
+    double pairs = floor(x / 2);
+    return pairs + std::max(0.0, x - 2 * pairs - 1);
+}
+
+/// the average of the same pattern over the given width around x
+static double oddCellsAverage(double x, double width)
+{
+    return (oddCellsIntegral(x + width / 2) - oddCellsIntegral(x - width / 2)) / width;
+}
+
+float checkerCoverage(const IntersectionInfo& info, double cellsPerUnit)
+{
+    // the footprint's extent (a box around the point, in cells); under a thousandth of a cell it's a point
+    const double MIN_WIDTH = 1e-3;
+    double width = 0, height = 0;
+    if (info.hasDifferentials_) {
+        width = std::max(fabs(info.dudx_), fabs(info.dudy_)) * cellsPerUnit;
+        height = std::max(fabs(info.dvdx_), fabs(info.dvdy_)) * cellsPerUnit;
+    }
+    if (width < MIN_WIDTH && height < MIN_WIDTH) {
+        int x = (int) floor(info.u_ * cellsPerUnit);
+        int y = (int) floor(info.v_ * cellsPerUnit);
+
+        return ((x + y) & 1) ? 1.f : 0.f;
+    }
+
+    // the second color is where exactly one of x and y is odd. The box filter is separable, so with the averages
+    // of the +1 (even) / -1 (odd) patterns of x and y, that's 1/2 - 1/2 * their product
+    double evenOddX = 1 - 2 * oddCellsAverage(info.u_ * cellsPerUnit, std::max(width, MIN_WIDTH));
+    double evenOddY = 1 - 2 * oddCellsAverage(info.v_ * cellsPerUnit, std::max(height, MIN_WIDTH));
+    return float(0.5 - 0.5 * evenOddX * evenOddY);
 }
 
 Color CheckerTexture::sample(const IntersectionInfo &info)
 {
-    int x = (int) floor(info.u_ * scaling_ / 7);
-    int y = (int) floor(info.v_ * scaling_ / 7);
+    float part2 = checkerCoverage(info, cellsPerUnit_);
+    if (part2 == 0) return color1_;
+    if (part2 == 1) return color2_;
+    return color1_ * (1 - part2) + color2_ * part2;
+}
+
+void Texture::sampleBatch(const ShadeItem* items, int count, Color* colors)
+{
+    for (int i = 0; i < count; i++)
+        colors[i] = sample(items[i].info_);
+}
 
-    return  ((x + y) % 2 == 0) ? color1_ : color2_;
+void CheckerTexture::sampleBatch(const ShadeItem* items, int count, Color* colors)
+{
+    for (int i = 0; i < count; i++)
+        colors[i] = CheckerTexture::sample(items[i].info_); // not a virtual call
+}
+
+bool CheckerTexture::setParam(const std::string& name, const ParamValues& values)
+{
+    if (name == "color1") return getParam(values, color1_);
+    if (name == "color2") return getParam(values, color2_);
+    double size;
+    if (name != "size" || !getParam(values, size)) return false;
+    cellsPerUnit_ = size / 7;
+    return true;
 }
 
 BitmapTexture::BitmapTexture(const std::string& filename, double scale)
-: bitmap_(std::make_unique<Bitmap>())
+: mipmap_(loadCachedMipMap(filename.c_str()))
 , scaling_(1/scale)
 {
-    bitmap_->loadImage(filename.c_str());
 }
 
 Color BitmapTexture::sample(const IntersectionInfo &info)
 {
-    int x = (int) floor(info.u_ * scaling_ * bitmap_->getWidth());
-    int y = (int) floor(info.v_ * scaling_ * bitmap_->getHeight());
-    // 0 <= x < bitmap.width
-    // 0 <= y < bitmap.height
-    x = (x % bitmap_->getWidth());
-    y = (y % bitmap_->getHeight());
-    if (x < 0) x += bitmap_->getWidth();
-    if (y < 0) y += bitmap_->getHeight();
+    double texelsPerU = scaling_ * mipmap_->getWidth(), texelsPerV = scaling_ * mipmap_->getHeight();
+    double x = info.u_ * texelsPerU;
+    double y = info.v_ * texelsPerV;
+    if (!info.hasDifferentials_)
+        return mipmap_->getTexel((int) floor(x), (int) floor(y));
+
+    // the footprint's longer side, in texels
+    double size = sqrt(std::max(sqr(info.dudx_ * texelsPerU) + sqr(info.dvdx_ * texelsPerV),
+                                sqr(info.dudy_ * texelsPerU) + sqr(info.dvdy_ * texelsPerV)));
+    return mipmap_->sample(x, y, size);
+}
+
+void BitmapTexture::sampleBatch(const ShadeItem* items, int count, Color* colors)
+{
+    for (int i = 0; i < count; i++)
+        colors[i] = BitmapTexture::sample(items[i].info_);
+}
 
-    return bitmap_->getPixel(x, y);
+bool BitmapTexture::setParam(const std::string& name, const ParamValues& values)
+{
+    double scaling;
+    if (name != "scaling" || !getParam(values, scaling) || scaling == 0) return false;
+    scaling_ = 1 / scaling;
+    return true;
+}
+
+void BitmapTexture::reportMemory(MemoryReport& report) const
+{
+    if (report.countOnce(mipmap_.get())) report.add(MemoryCategory::TEXTURES, sizeof(MipMap) + mipmap_->getMemoryUsage());
 }
@@ -9,37 +9,70 @@
 #include "geometries/geometry.h"
 #include "color/color.h"
 #include "materials/bitmap.h"
+#include "materials/mipmap.h"
+
+struct AovSample;
+
+/// a ray hit, waiting to be shaded together with others of the same shader (see Shader::shadeBatch)
+struct ShadeItem
+{
+    Ray ray_;
+    IntersectionInfo info_;
+    AovSample* aov_ = nullptr; // of the pixel, for a camera ray while the AOVs are on
+};
 
 class Texture
 {
 public:
     virtual ~Texture() = default;
+
+    /// the textures live in the scene's arena, like the shaders
+    static void* operator new(size_t size) { return getSceneArena().allocate(size, MemoryCategory::SHADERS); }
+    static void operator delete(void*) {}
+
     virtual Color sample(const IntersectionInfo& info) = 0;
+    /// samples the texture at all the items' hits: colors[i] for items[i]
+    virtual void sampleBatch(const ShadeItem* items, int count, Color* colors);
+    /// sets a parameter by name (see SceneParams). Returns false if there's no such parameter or the values don't fit
+    virtual bool setParam(const std::string& name, const ParamValues& values) { return false; }
+    /// adds the memory the texture holds outside of itself (e.g. its image) to the report
+    virtual void reportMemory(MemoryReport& report) const {}
 };
 
+/// a checkerboard in the u v coords. Where the pixel's footprint is known, it is box filtered (in closed form),
+/// so that the far away cells, which get smaller than the pixels, blend into their average instead of aliasing
 class CheckerTexture: public Texture
 {
 public:
-    CheckerTexture(const Color& c1, const Color& c2, size_t size = 1): color1_(c1), color2_(c2), scaling_(size) {}
+    CheckerTexture(const Color& c1, const Color& c2, size_t size = 1): color1_(c1), color2_(c2), cellsPerUnit_(size / 7.0) {}
     ~CheckerTexture() override = default;
     Color sample(const IntersectionInfo& info) override;
-
+    void sampleBatch(const ShadeItem* items, int count, Color* colors) override;
+    bool setParam(const std::string& name, const ParamValues& values) override; //!< color1, color2, size
 
 private:
     Color color1_;
     Color color2_;
-    size_t scaling_;
+    double cellsPerUnit_; // the size, over 7 (the size of a cell in u v units)
 };
 
+/// how much of a checkerboard's second color is in the pixel's footprint around the hit (see CheckerTexture):
+/// 0 or 1 for a point, in between for a footprint over several cells
+float checkerCoverage(const IntersectionInfo& info, double cellsPerUnit);
+
+/// an image, repeated over the u v plane. Where the pixel's footprint is known, it is filtered over it (see MipMap)
 class BitmapTexture: public Texture
 {
 public:
     BitmapTexture(const std::string& filename, double scaling = 1.0);
     ~BitmapTexture() = default;
     Color sample(const IntersectionInfo& info) override;
+    void sampleBatch(const ShadeItem* items, int count, Color* colors) override;
+    bool setParam(const std::string& name, const ParamValues& values) override; //!< scaling
+    void reportMemory(MemoryReport& report) const override; //!< the image, once for all the textures sharing it
 
 private:
-    std::unique_ptr<Bitmap> bitmap_;
+    std::shared_ptr<const MipMap> mipmap_; // shared with the other textures from the same file
     double scaling_;
 };
 
@@ -48,7 +81,22 @@ class Shader
 public:
 
     virtual ~Shader() = default;
+
+    /// the shaders live in the scene's arena (see getSceneArena()), and are freed with it
+    static void* operator new(size_t size) { return getSceneArena().allocate(size, MemoryCategory::SHADERS); }
+    static void operator delete(void*) {}
+
     virtual Color shade(const Ray& ray, IntersectionInfo& info) = 0;
+    /// shades all the items: results[i] for items[i]. Each item may trace up to rayBudget secondary rays.
+    /// The default calls shade() for each; shaders override it to go through the items stage by stage
+    virtual void shadeBatch(ShadeItem* items, int count, int rayBudget, Color* results);
+    /// the color of the surface at the hit, for the denoiser. White for the shaders without one (e.g. mirrors)
+    virtual Color getAlbedo(const IntersectionInfo& info) { return Color(1, 1, 1); }
+    /// sets a parameter by name (see SceneParams), e.g. "color" or "texture.size" for the texture's.
+    /// Returns false if there's no such parameter or the values don't fit it
+    virtual bool setParam(const std::string& name, const ParamValues& values) { return false; }
+    /// adds the memory the shader holds outside of itself (e.g. its texture) to the report
+    virtual void reportMemory(MemoryReport& report) const {}
 };
 
 class Lambert : public Shader
@@ -61,6 +109,10 @@ public:
 
     ~Lambert() override = default;
     Color shade(const Ray& ray, IntersectionInfo& info) override;
+    void shadeBatch(ShadeItem* items, int count, int rayBudget, Color* results) override;
+    Color getAlbedo(const IntersectionInfo& info) override { return texture_ ? texture_->sample(info) : color_; }
+    bool setParam(const std::string& name, const ParamValues& values) override; //!< color, texture.*
+    void reportMemory(MemoryReport& report) const override { if (texture_) texture_->reportMemory(report); }
 
 private:
     Color color_; // used if the texture is null
@@ -78,6 +130,11 @@ public:
 
     ~Phong() override = default;
     Color shade(const Ray& ray, IntersectionInfo& info) override;
+    void shadeBatch(ShadeItem* items, int count, int rayBudget, Color* results) override;
+    Color getAlbedo(const IntersectionInfo& info) override { return texture_ ? texture_->sample(info) : color_; }
+    /// specularMultiplier, specularExponent, color, texture.*
+    bool setParam(const std::string& name, const ParamValues& values) override;
+    void reportMemory(MemoryReport& report) const override { if (texture_) texture_->reportMemory(report); }
 
     double specularMultiplier_; // defines how bright the flashes will be
     double specularExponent_;   // defines how fine the flashes will be
@@ -87,11 +144,45 @@ private:
     std::unique_ptr<Texture> texture_;
 };
 
+/// a perfect mirror
+class Reflection : public Shader
+{
+public:
+    Reflection(double multiplier = 0.98): multiplier_(multiplier) {}
+
+    ~Reflection() override = default;
+    Color shade(const Ray& ray, IntersectionInfo& info) override;
+    bool setParam(const std::string& name, const ParamValues& values) override; //!< multiplier
+
+    double multiplier_; // how much of the light is reflected
+};
+
+/// a transparent, refracting material (e.g. glass or water), which also reflects some of
+/// the light, according to the Fresnel equations
+class Refraction : public Shader
+{
+public:
+    Refraction(double ior, double multiplier = 0.95)
+    : ior_(ior)
+    , multiplier_(multiplier) {}
+
+    ~Refraction() override = default;
+    Color shade(const Ray& ray, IntersectionInfo& info) override;
+    bool setParam(const std::string& name, const ParamValues& values) override; //!< ior, multiplier
+
+    double ior_;        // index of refraction of the material (1.0 is air, 1.33 is water, 1.5 is glass)
+    double multiplier_; // how much of the light passes through (or gets reflected by) the surface
+};
+
+/// sets how many reflected/refracted rays the current thread may still trace for the current pixel
+void resetRayBudget(int budget = MAX_SECONDARY_RAYS);
+
 struct Node
 {
     //Node(std::unique_ptr<Geometry> geometry, std::unique_ptr<Shader> shader): geometry_(geometry.get()), shader_(shader.get()) {}
     std::unique_ptr<Geometry> geometry_;
-    std::unique_ptr<Shader> shader_;
+    std::shared_ptr<Shader> shader_; // many nodes (e.g. instances of one prototype) may share a shader
+    std::string name_;               // for SceneParams, e.g. "floor"
 };
 
 
@@ -5,10 +5,16 @@
 #ifndef __CONSTANTS_H__
 #define __CONSTANTS_H__
 
+#include <limits>
+
 constexpr const int VFB_MAX_SIZE = 1920;
 constexpr const int RESX = 640;
 constexpr const int RESY = 480;
+constexpr const int TILE_SIZE = 32;       // the frame is rendered in square tiles of that many pixels
+constexpr const int MAX_AA_SAMPLES = 8;   // upper limit of the anti-aliasing kernel size
+constexpr const int MAX_RAY_DEPTH = 10;   // reflections/refractions deeper than that are not traced
+constexpr const int MAX_SECONDARY_RAYS = 64; // budget of reflected/refracted rays per pixel
 constexpr const double PI = 3.141592653589793238;
-constexpr const long long unsigned INF = 18446744073709551615U;
+constexpr const double INF = std::numeric_limits<double>::infinity();
 
 #endif // __CONSTANTS_H__
@@ -0,0 +1,50 @@
+/**
+ * @File file_watcher.cpp
+ * @Brief Implementation of the FileWatcher, over inotify.
+ */
+#include "file_watcher.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <sys/inotify.h>
+#include <unistd.h>
+
+FileWatcher::~FileWatcher()
+{
+    if (fd_ >= 0) close(fd_);
+}
+
+bool FileWatcher::watch(const char* filename)
+{
+    std::string path(filename);
+    size_t slash = path.rfind('/');
+    std::string directory = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+    name_ = slash == std::string::npos ? path : path.substr(slash + 1);
+
+    fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd_ < 0 || inotify_add_watch(fd_, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        printf("Cannot watch %s: %s\n", filename, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool FileWatcher::hasChanged()
+{
+    if (fd_ < 0) return false;
+
+    // the events are variable-sized: a header, then the file name
+    alignas(inotify_event) char buffer[4096];
+    bool changed = false;
+    ssize_t length;
+    while ((length = read(fd_, buffer, sizeof(buffer))) > 0) {
+        for (char* at = buffer; at < buffer + length; ) {
+            const inotify_event* event = (const inotify_event*) at;
+            if (event->len && name_ == event->name) changed = true;
+            at += sizeof(inotify_event) + event->len;
+        }
+    }
+    return changed;
+}
@@ -0,0 +1,29 @@
+/**
+ * @File file_watcher.h
+ * @Brief Notices when a file gets written, without polling it (inotify).
+ */
+#ifndef __FILE_WATCHER_H__
+#define __FILE_WATCHER_H__
+
+#include <string>
+
+/// Watches one file for changes. The file's directory is what's watched, so that the editors which save
+/// by writing a new file and renaming it over the old one are noticed too
+class FileWatcher
+{
+public:
+    FileWatcher() = default;
+    FileWatcher(const FileWatcher&) = delete;
+    FileWatcher& operator=(const FileWatcher&) = delete;
+    ~FileWatcher();
+
+    bool watch(const char* filename); //!< starts watching the file. Returns false in the case of an error
+    /// returns whether the file was written since the last call. Doesn't wait
+    bool hasChanged();
+
+private:
+    int fd_ = -1;
+    std::string name_; // without the directory, as the events report it
+};
+
+#endif // __FILE_WATCHER_H__
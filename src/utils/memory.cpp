@@ -0,0 +1,89 @@
+/**
+ * @File memory.cpp
+ * @Brief Implementation of the scene arena and the memory report.
+ */
+#include "memory.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// every allocation is aligned as well as the heap would do it
+static constexpr size_t ALIGNMENT = alignof(max_align_t);
+
+void* Arena::allocate(size_t size, MemoryCategory category)
+{
+    size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    std::lock_guard<std::mutex> lock(mutex_);
+    bytes_[int(category)] += size;
+
+    if (size > BLOCK_SIZE / 4) {
+        // a big one gets a block of its own; the one being filled stays so
+        char* block = static_cast<char*>(malloc(size));
+        blocks_.push_back(block);
+        reserved_ += size;
+        return block;
+    }
+    if (size > remaining_) {
+        current_ = static_cast<char*>(malloc(BLOCK_SIZE));
+        remaining_ = BLOCK_SIZE;
+        blocks_.push_back(current_);
+        reserved_ += BLOCK_SIZE;
+    }
+    void* result = current_;
+    current_ += size;
+    remaining_ -= size;
+    return result;
+}
+
+void Arena::reset()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (char* block : blocks_) free(block);
+    blocks_.clear();
+    current_ = nullptr;
+    remaining_ = 0;
+    reserved_ = 0;
+    for (size_t& bytes : bytes_) bytes = 0;
+}
+
+size_t Arena::getBytes(MemoryCategory category) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return bytes_[int(category)];
+}
+
+size_t Arena::getReserved() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return reserved_;
+}
+
+Arena& getSceneArena()
+{
+    // never destroyed: the global scene (e.g. the nodes in main.cpp) is destroyed at exit after the statics
+    // of this file would be, and its objects are in the arena
+    static Arena* arena = new Arena;
+    return *arena;
+}
+
+size_t MemoryReport::getTotal() const
+{
+    size_t total = 0;
+    for (size_t bytes : bytes_) total += bytes;
+    return total;
+}
+
+/// prints the size with the unit that fits it best
+static void printBytes(const char* name, size_t bytes)
+{
+    if (bytes >= 1024 * 1024) printf("  %-13s %8.1f MB\n", name, bytes / (1024.0 * 1024.0));
+    else printf("  %-13s %8.1f KB\n", name, bytes / 1024.0);
+}
+
+void MemoryReport::print() const
+{
+    static const char* const names[] = { "primitives", "acceleration", "shaders", "textures", "framebuffers" };
+    printf("Memory: %.1f MB\n", getTotal() / (1024.0 * 1024.0));
+    for (int category = 0; category < int(MemoryCategory::COUNT); category++)
+        printBytes(names[category], bytes_[category]);
+}
@@ -0,0 +1,81 @@
+/**
+ * @File memory.h
+ * @Brief The arena the scene objects are allocated from, and the report of how much memory a scene takes.
+ */
+#ifndef __MEMORY_H__
+#define __MEMORY_H__
+
+#include <stddef.h>
+#include <mutex>
+#include <set>
+#include <vector>
+
+/// what some memory is used for, in the MemoryReport
+enum class MemoryCategory
+{
+    PRIMITIVES,   // the geometries and their arrays (e.g. the triangles of a mesh)
+    ACCELERATION, // the BVHs, the compiled CSG programs
+    SHADERS,      // the shaders and the textures, without the images
+    TEXTURES,     // the images of the textures and the environment
+    FRAMEBUFFERS, // the frame, the accumulated GI passes, the AOVs, the denoiser's and the tile cache's buffers
+    COUNT
+};
+
+/// A region allocator for the objects which live as long as the scene: the allocations are carved out of big
+/// blocks, one after the other, and never freed one by one; reset() frees all of the blocks at once. Saves the
+/// per-object overhead of the heap and keeps a scene's objects together, instead of scattered between those of
+/// the previous scenes. Thread-safe. Counts the bytes allocated in each category
+class Arena
+{
+public:
+    static constexpr size_t BLOCK_SIZE = 64 * 1024;
+
+    Arena() = default;
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    ~Arena() { reset(); }
+
+    void* allocate(size_t size, MemoryCategory category);
+    /// frees all the memory. Destroy the objects allocated from the arena before
+    void reset();
+
+    size_t getBytes(MemoryCategory category) const; //!< allocated since the last reset(), in the category
+    size_t getReserved() const; //!< the size of all the blocks
+
+private:
+    mutable std::mutex mutex_;
+    std::vector<char*> blocks_;   // all of them, to free; the bigger allocations get their own
+    char* current_ = nullptr;     // the free part of the block being filled
+    size_t remaining_ = 0;        // its size
+    size_t reserved_ = 0;         // the size of all the blocks
+    size_t bytes_[int(MemoryCategory::COUNT)] = {};
+};
+
+/// the arena of the current scene. The geometries, the shaders and the textures are allocated from it (see their
+/// operator new); loadScene() destroys them and then resets it
+Arena& getSceneArena();
+
+/// How much memory a scene takes, by category. Filled in by the parts of the scene (see e.g.
+/// Geometry::reportMemory()); those shared by several others (a mesh by its instances, the image of a texture by
+/// all of the textures loaded from that file) are counted once
+class MemoryReport
+{
+public:
+    void add(MemoryCategory category, size_t bytes) { bytes_[int(category)] += bytes; }
+    /// returns true the first time it is called for the part, after which the part should add its memory
+    bool countOnce(const void* part) { return counted_.insert(part).second; }
+
+    size_t getBytes(MemoryCategory category) const { return bytes_[int(category)]; }
+    size_t getTotal() const;
+    void print() const;
+
+private:
+    size_t bytes_[int(MemoryCategory::COUNT)] = {};
+    std::set<const void*> counted_;
+};
+
+/// the memory a vector holds (its capacity, not just its size)
+template <typename T>
+size_t vectorBytes(const std::vector<T>& vec) { return vec.capacity() * sizeof(T); }
+
+#endif // __MEMORY_H__
@@ -0,0 +1,55 @@
+/**
+ * @File params.h
+ * @Brief Helpers for setting the parameters of scene objects by name (see SceneParams).
+ */
+#ifndef __PARAMS_H__
+#define __PARAMS_H__
+
+#include <string>
+#include <vector>
+
+#include "maths/vector.h"
+#include "color/color.h"
+
+/// the values given to a parameter: one number, or three for a vector or a color
+using ParamValues = std::vector<double>;
+
+/// these set `out` if the values fit its type, and return whether they did
+inline bool getParam(const ParamValues& values, double& out)
+{
+    if (values.size() != 1) return false;
+    out = values[0];
+    return true;
+}
+
+inline bool getParam(const ParamValues& values, float& out)
+{
+    if (values.size() != 1) return false;
+    out = float(values[0]);
+    return true;
+}
+
+inline bool getParam(const ParamValues& values, Vector& out)
+{
+    if (values.size() != 3) return false;
+    out = Vector(values[0], values[1], values[2]);
+    return true;
+}
+
+inline bool getParam(const ParamValues& values, Color& out)
+{
+    if (values.size() != 3) return false;
+    out = Color(float(values[0]), float(values[1]), float(values[2]));
+    return true;
+}
+
+/// for the parameters of an object's parts: if name starts with "prefix.", puts the rest of it in `rest`
+inline bool stripParamPrefix(const std::string& name, const char* prefix, std::string& rest)
+{
+    size_t length = std::char_traits<char>::length(prefix);
+    if (name.compare(0, length, prefix) != 0 || name.size() <= length || name[length] != '.') return false;
+    rest = name.substr(length + 1);
+    return true;
+}
+
+#endif // __PARAMS_H__
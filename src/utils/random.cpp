@@ -0,0 +1,20 @@
+/**
+ * @File random.cpp
+ * @Brief A fast pseudo-random number generator, with one instance per thread.
+ */
+#include "random.h"
+
+#include <atomic>
+
+Random& getRandomGen()
+{
+    // every thread gets a different stream of the generator
+    static std::atomic<uint64_t> threadCounter(0);
+    static thread_local Random rng(0x853c49e6748fea9bULL, threadCounter++);
+    return rng;
+}
+
+void seedRandomGen(uint32_t pixelSeed, uint32_t sampleIndex)
+{
+    getRandomGen().seed(hash32(pixelSeed ^ hash32(sampleIndex)), pixelSeed);
+}
@@ -0,0 +1,72 @@
+/**
+ * @File random.h
+ * @Brief A fast pseudo-random number generator, with one instance per thread.
+ */
+#ifndef __RANDOM_H__
+#define __RANDOM_H__
+
+#include <stdint.h>
+
+/// a quick integer hash with good avalanche, used to derive seeds and scrambles
+inline constexpr uint32_t hash32(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+}
+
+/// PCG32 (see pcg-random.org): small state, fast and statistically much better than rand()
+class Random
+{
+public:
+    explicit Random(uint64_t seed = 0x853c49e6748fea9bULL, uint64_t stream = 0xda3e39cb94b95bdbULL)
+    {
+        seed_(seed, stream);
+    }
+
+    void seed(uint64_t seed, uint64_t stream = 0xda3e39cb94b95bdbULL) { seed_(seed, stream); }
+
+    uint32_t next()
+    {
+        uint64_t old = state_;
+        state_ = old * 6364136223846793005ULL + inc_;
+        uint32_t xorShifted = uint32_t(((old >> 18u) ^ old) >> 27u);
+        uint32_t rot = uint32_t(old >> 59u);
+        return (xorShifted >> rot) | (xorShifted << ((32 - rot) & 31));
+    }
+
+    /// returns a random number in [0..1)
+    float randomFloat() { return (next() >> 8) * (1.0f / 16777216.0f); }
+
+    /// returns a random number in [0..1), with all 32 bits of randomness
+    double randomDouble() { return next() * (1.0 / 4294967296.0); }
+
+    /// returns a random integer in [0..n)
+    int randomInt(int n) { return int((uint64_t(next()) * uint64_t(n)) >> 32); }
+
+private:
+    void seed_(uint64_t seed, uint64_t stream)
+    {
+        state_ = 0;
+        inc_ = (stream << 1u) | 1u;
+        next();
+        state_ += seed;
+        next();
+    }
+
+    uint64_t state_, inc_;
+};
+
+/// returns the generator of the calling thread. No locking is involved; each thread gets its own stream
+Random& getRandomGen();
+
+/// restarts the generator of the calling thread on the stream of the given pixel, at a point given by the
+/// sample. The renderers call it before tracing each pixel's sample (see Sampler::startSample()), so that the
+/// random numbers it takes don't depend on which thread traces it, or on what that thread traced before: the
+/// image comes out the same whatever the number of threads, and however the tiles get handed out to them
+void seedRandomGen(uint32_t pixelSeed, uint32_t sampleIndex);
+
+#endif // __RANDOM_H__
@@ -0,0 +1,107 @@
+/**
+ * @File sampling.cpp
+ * @Brief Low-discrepancy sample sequences and the helpers to map samples to directions.
+ */
+#include "sampling.h"
+
+#include <algorithm>
+
+#include "random.h"
+#include "utils/util.h"
+
+static const int PRIMES[] = { 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53, 59, 61, 67, 71, 73 };
+static const int NUM_PRIMES = int(sizeof(PRIMES) / sizeof(PRIMES[0]));
+
+static inline uint32_t reverseBits(uint32_t x)
+{
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffU) << 8) | ((x & 0xff00ff00U) >> 8);
+    x = ((x & 0x0f0f0f0fU) << 4) | ((x & 0xf0f0f0f0U) >> 4);
+    x = ((x & 0x33333333U) << 2) | ((x & 0xccccccccU) >> 2);
+    x = ((x & 0x55555555U) << 1) | ((x & 0xaaaaaaaaU) >> 1);
+    return x;
+}
+
+void sobol2D(uint32_t index, uint32_t scrambleU, uint32_t scrambleV, double& u, double& v)
+{
+    // the first dimension is the van der Corput sequence; the generator matrix of the second
+    // one is built on the fly (each next direction number is v ^ (v >> 1))
+    u = (reverseBits(index) ^ scrambleU) * (1.0 / 4294967296.0);
+
+    uint32_t resultV = scrambleV;
+    for (uint32_t dir = 1U << 31; index; index >>= 1, dir ^= dir >> 1)
+        if (index & 1) resultV ^= dir;
+    v = resultV * (1.0 / 4294967296.0);
+}
+
+double radicalInverse(int base, uint32_t index)
+{
+    double invBase = 1.0 / base;
+    double factor = invBase;
+    double result = 0;
+    while (index) {
+        result += (index % base) * factor;
+        index /= base;
+        factor *= invBase;
+    }
+    return result;
+}
+
+void Sampler::startSample(uint32_t pixelSeed, uint32_t sampleIndex)
+{
+    pixelSeed_ = pixelSeed;
+    sampleIndex_ = sampleIndex;
+    dimension_ = 0;
+    seedRandomGen(pixelSeed, sampleIndex);
+}
+
+/// shifts a sample by a per-pixel, per-dimension offset, wrapping around [0..1)
+static inline double rotate(double x, uint32_t seed)
+{
+    x += hash32(seed) * (1.0 / 4294967296.0);
+    return x >= 1.0 ? x - 1.0 : x;
+}
+
+void Sampler::next2D(double& u, double& v)
+{
+    int dim = dimension_++;
+    if (dim == 0) {
+        sobol2D(sampleIndex_, hash32(pixelSeed_ * 2), hash32(pixelSeed_ * 2 + 1), u, v);
+        return;
+    }
+
+    int primeIdx = (dim - 1) * 2;
+    if (primeIdx + 1 >= NUM_PRIMES) {
+        Random& rng = getRandomGen();
+        u = rng.randomDouble();
+        v = rng.randomDouble();
+        return;
+    }
+
+    u = rotate(radicalInverse(PRIMES[primeIdx], sampleIndex_), pixelSeed_ ^ (primeIdx * 0x9e3779b9U));
+    v = rotate(radicalInverse(PRIMES[primeIdx + 1], sampleIndex_), pixelSeed_ ^ ((primeIdx + 1) * 0x9e3779b9U));
+}
+
+Sampler& getSampler()
+{
+    static thread_local Sampler sampler;
+    return sampler;
+}
+
+Vector cosineHemisphereSample(const Vector& normal, double u, double v)
+{
+    // uniform point on the unit disc, projected up to the hemisphere (Malley's method)
+    double r = sqrt(u);
+    double phi = 2 * PI * v;
+    double x = r * cos(phi);
+    double y = r * sin(phi);
+    double z = sqrt(std::max(0.0, 1 - u));
+
+    // an orthonormal basis around the normal
+    Vector tangent = fabs(normal.x_) > 0.5 ? Vector(0, 1, 0) : Vector(1, 0, 0);
+    tangent = tangent ^ normal;
+    tangent.normalize();
+    Vector bitangent = normal ^ tangent;
+
+    return tangent * x + bitangent * y + normal * z;
+}
@@ -0,0 +1,43 @@
+/**
+ * @File sampling.h
+ * @Brief Low-discrepancy sample sequences and the helpers to map samples to directions.
+ */
+#ifndef __SAMPLING_H__
+#define __SAMPLING_H__
+
+#include <stdint.h>
+
+#include "maths/vector.h"
+
+/// the i-th point of the (0, 2) Sobol sequence in [0..1)^2, scrambled by XOR-ing with (scrambleU, scrambleV)
+void sobol2D(uint32_t index, uint32_t scrambleU, uint32_t scrambleV, double& u, double& v);
+
+/// the radical inverse of index in the given (prime) base - the Halton sequence for that base
+double radicalInverse(int base, uint32_t index);
+
+/// Generates the samples of one path (camera ray + bounces) as consecutive 2D dimensions of a
+/// low-discrepancy sequence: the first pair comes from a scrambled Sobol sequence, the next ones from
+/// Halton sequences in successive prime bases, Cranley-Patterson rotated per pixel so that neighbouring
+/// pixels are decorrelated. Dimensions beyond the prime table fall back to the thread's random generator,
+/// which startSample() seeds for the sample (see seedRandomGen()), as the rest of the path uses it too.
+/// Each thread has its own sampler (see getSampler()).
+class Sampler
+{
+public:
+    /// starts a new path: sampleIndex-th sample of the pixel identified by pixelSeed
+    void startSample(uint32_t pixelSeed, uint32_t sampleIndex);
+    /// gets the next two dimensions of the current sample
+    void next2D(double& u, double& v);
+
+private:
+    uint32_t pixelSeed_ = 0;
+    uint32_t sampleIndex_ = 0;
+    int dimension_ = 0;
+};
+
+Sampler& getSampler(); //!< returns the sampler of the calling thread
+
+/// maps a 2D sample to a direction on the hemisphere around normal, with probability density cos(theta) / PI
+Vector cosineHemisphereSample(const Vector& normal, double u, double v);
+
+#endif // __SAMPLING_H__
@@ -0,0 +1,99 @@
+/**
+ * @File thread_pool.cpp
+ * @Brief Implementation of the worker thread pool.
+ */
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+ThreadPool::ThreadPool(int numWorkers)
+{
+    for (int i = 0; i < numWorkers; i++)
+        workers_.emplace_back([this] { workerLoop(); });
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        exiting_ = true;
+    }
+    wakeUp_.notify_all();
+    for (auto& worker : workers_)
+        worker.join();
+}
+
+static int requestedThreads = 0; // by setNumThreads(); 0 for one per hardware thread
+
+void ThreadPool::setNumThreads(int numThreads)
+{
+    requestedThreads = numThreads;
+}
+
+ThreadPool& ThreadPool::instance()
+{
+    static ThreadPool instance(
+        (requestedThreads > 0 ? requestedThreads : std::max(1, int(std::thread::hardware_concurrency()))) - 1);
+    return instance;
+}
+
+bool ThreadPool::runPendingTask(std::unique_lock<std::mutex>& lock)
+{
+    if (tasks_.empty()) return false;
+
+    std::function<void()> task = std::move(tasks_.front());
+    tasks_.pop_front();
+    lock.unlock();
+    task();
+    lock.lock();
+    taskDone_.notify_all();
+    return true;
+}
+
+void ThreadPool::workerLoop()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        wakeUp_.wait(lock, [this] { return exiting_ || !tasks_.empty(); });
+        if (exiting_) return;
+        runPendingTask(lock);
+    }
+}
+
+void ThreadPool::parallelFor(int count, const std::function<void(int)>& fn)
+{
+    if (count <= 0) return;
+
+    // all participants pull indices from a shared counter until it runs out
+    struct Job {
+        std::atomic<int> next{0};
+        std::atomic<int> done{0};
+    };
+    auto job = std::make_shared<Job>();
+    auto run = [job, count, &fn] {
+        int index;
+        while ((index = job->next++) < count) {
+            fn(index);
+            job->done++;
+        }
+    };
+
+    int numHelpers = std::min(count, getNumThreads()) - 1;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (int i = 0; i < numHelpers; i++)
+            tasks_.push_back(run);
+    }
+    wakeUp_.notify_all();
+
+    run();
+
+    // while the others finish their indices, help with whatever else is queued (e.g. nested parallelFor()s)
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (job->done < count) {
+        if (!runPendingTask(lock))
+            taskDone_.wait(lock);
+    }
+}
@@ -0,0 +1,50 @@
+/**
+ * @File thread_pool.h
+ * @Brief A pool of worker threads, shared by everything that runs in parallel.
+ */
+#ifndef __THREAD_POOL_H__
+#define __THREAD_POOL_H__
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+public:
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool(ThreadPool&&) = delete;
+    ~ThreadPool();
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    ThreadPool& operator=(ThreadPool&&) = delete;
+
+    static ThreadPool& instance();
+    /// sets how many threads instance() gets (the calling one included), instead of one per hardware thread.
+    /// Only has an effect before the first call to instance()
+    static void setNumThreads(int numThreads);
+
+    int getNumThreads() const { return int(workers_.size()) + 1; } //!< the workers plus the calling thread
+
+    /// calls fn(i) for each i in [0..count), distributed over the pool, and returns when all calls are done.
+    /// Indices are handed out one by one, so uneven work (e.g. tiles) gets balanced. The calling thread
+    /// takes part in the work, and may call parallelFor() again from inside fn
+    void parallelFor(int count, const std::function<void(int)>& fn);
+
+private:
+    explicit ThreadPool(int numWorkers);
+
+    void workerLoop();
+    bool runPendingTask(std::unique_lock<std::mutex>& lock); //!< runs one queued task, if any (lock must be held)
+
+    std::vector<std::thread> workers_;
+    std::deque<std::function<void()>> tasks_;
+    std::mutex mutex_;
+    std::condition_variable wakeUp_;    // signaled when tasks are added or on exit
+    std::condition_variable taskDone_;  // signaled when a task finishes
+    bool exiting_ = false;
+};
+
+#endif // __THREAD_POOL_H__
@@ -6,6 +6,7 @@
 #define __UTIL_H__
 
 #include "constants.h"
+#include "random.h"
 
 #include <stdlib.h>
 #include <math.h>
@@ -17,9 +18,8 @@ inline constexpr double toRadians(double angle) { return angle / 180.0 * PI; }
 inline constexpr double toDegrees(double angle_rad) { return angle_rad / PI * 180.0; }
 inline constexpr int nearestInt(float x) { return (int) floor(x + 0.5f); }
 
-/// returns a random floating-point number in [0..1).
-/// This is not a very good implementation. A better method is to be employed soon.
-inline float randomFloat() { return rand() / (float) RAND_MAX; }
+/// returns a random floating-point number in [0..1), from the generator of the calling thread
+inline float randomFloat() { return getRandomGen().randomFloat(); }
 
 std::string upCaseString(std::string s); //!< returns the string in UPPERCASE
 std::string extensionUpper(const char* fileName); //!< Given a filename, return its extension in UPPERCASE